@@ -3,6 +3,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <map>
@@ -114,6 +115,45 @@ struct PatchTileHashFunc {
   }
 };
 
+// Identifies a tile of a tiled image source in 64 bits, so that caches can look tiles up without
+// building and hashing filenames: 8 bits source id, 6 bits level, 25 bits each for tx and ty.
+struct TileKey {
+  static const int kSourceBits = 8;
+  static const int kLevelBits = 6;
+  static const int kTileBits = 25;
+
+  uint64_t value;
+
+  TileKey() : value(~uint64_t(0)) {}
+  TileKey(int source_id, int level, int tx, int ty)
+    : value((uint64_t(source_id & ((1 << kSourceBits) - 1)) << (kLevelBits + 2 * kTileBits)) |
+            (uint64_t(level & ((1 << kLevelBits) - 1)) << (2 * kTileBits)) |
+            (uint64_t(tx & ((1 << kTileBits) - 1)) << kTileBits) |
+            uint64_t(ty & ((1 << kTileBits) - 1))) {}
+
+  int source_id() const { return int(value >> (kLevelBits + 2 * kTileBits)); }
+  int level() const { return int(value >> (2 * kTileBits)) & ((1 << kLevelBits) - 1); }
+  int tx() const { return int(value >> kTileBits) & ((1 << kTileBits) - 1); }
+  int ty() const { return int(value) & ((1 << kTileBits) - 1); }
+
+  bool operator==(const TileKey& other) const {
+    return value == other.value;
+  }
+  bool operator!=(const TileKey& other) const {
+    return value != other.value;
+  }
+};
+
+struct TileKeyHashFunc {
+  size_t operator() (TileKey const &key) const {
+    // Mix the bits so that neighboring tiles spread over buckets and cache shards.
+    uint64_t k = key.value * 0x9E3779B97F4A7C15ull;
+    return static_cast<size_t>(k ^ (k >> 32));
+  }
+};
+
+typedef std::unordered_set<TileKey, TileKeyHashFunc> TileKeySet;
+
 struct PatchXY {
   int x;
   int y;
@@ -148,12 +188,14 @@ struct PatchXYHashFunc {
   }
 };
 
+// Position of a patch in pixels of its level. The finest levels of terapixel images are wider
+// than floats can represent exactly, so the position is kept in 64 bit integers.
 struct PatchCoords {
   int image_id;
   int level;
-  int x;
-  int y;
-  PatchCoords(int _image_id, int _level, int _x, int _y)
+  int64_t x;
+  int64_t y;
+  PatchCoords(int _image_id, int _level, int64_t _x, int64_t _y)
     : image_id(_image_id), level(_level), x(_x), y(_y) {}
   PatchCoords() : image_id(-1), level(-1), x(-1), y(-1) {}
   PatchCoords(const PatchCoords& other) : image_id(other.image_id), level(other.level),
@@ -215,7 +257,9 @@ inline bool PatchCoordIdGreaterThan(const PatchCoords& lhs,
 }
 
 inline float ComputeSquaredDistance(PatchCoords& p1, PatchCoords& p2) {
-  return ((p1.x - p2.x)*(p1.x - p2.x)) + ((p1.y - p2.y)*(p1.y - p2.y));
+  double dx = double(p1.x - p2.x);
+  double dy = double(p1.y - p2.y);
+  return float(dx * dx + dy * dy);
 }
 
 typedef std::unordered_set<BinKey, BinKeyHashFunc, BinKeyEqualFunc> BinKeySet;
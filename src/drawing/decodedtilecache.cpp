@@ -0,0 +1,113 @@
+#include <QMutexLocker>
+
+#include "drawing/decodedtilecache.h"
+
+// More shards than loader threads keeps lock contention low.
+const int kNumShards = 16;
+
+DecodedTileCache::DecodedTileCache(long long budget_bytes) {
+  for (int i = 0; i < kNumShards; ++i) {
+    shards_.push_back(std::unique_ptr<Shard>(new Shard()));
+  }
+  SetBudgetBytes(budget_bytes);
+}
+
+void DecodedTileCache::SetBudgetBytes(long long budget_bytes) {
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    QMutexLocker locker(&shards_[i]->mutex);
+    shards_[i]->budget_bytes = budget_bytes / (long long)shards_.size();
+    EvictToBudget(*shards_[i]);
+  }
+}
+
+long long DecodedTileCache::budget_bytes() {
+  long long budget = 0;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    QMutexLocker locker(&shards_[i]->mutex);
+    budget += shards_[i]->budget_bytes;
+  }
+  return budget;
+}
+
+QImage DecodedTileCache::Get(TileKey key) {
+  Shard& shard = GetShard(key);
+  QMutexLocker locker(&shard.mutex);
+  auto it = shard.entries.find(key);
+  if (it == shard.entries.end()) {
+    shard.misses++;
+    return QImage();
+  }
+
+  shard.hits++;
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_position);
+  return it->second.image;
+}
+
+bool DecodedTileCache::Contains(TileKey key) {
+  Shard& shard = GetShard(key);
+  QMutexLocker locker(&shard.mutex);
+  return shard.entries.count(key) > 0;
+}
+
+void DecodedTileCache::Insert(TileKey key, const QImage& image) {
+  if (image.isNull())
+    return;
+
+  Shard& shard = GetShard(key);
+  QMutexLocker locker(&shard.mutex);
+  if (shard.budget_bytes <= 0)
+    return;
+  auto it = shard.entries.find(key);
+  if (it != shard.entries.end()) {
+    shard.resident_bytes -= it->second.bytes;
+    shard.lru.erase(it->second.lru_position);
+    shard.entries.erase(it);
+  }
+
+  shard.lru.push_front(key);
+  CacheEntry entry;
+  entry.image = image;
+  entry.bytes = image.byteCount();
+  entry.lru_position = shard.lru.begin();
+  shard.entries[key] = entry;
+  shard.resident_bytes += entry.bytes;
+  EvictToBudget(shard);
+}
+
+void DecodedTileCache::Clear() {
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    QMutexLocker locker(&shards_[i]->mutex);
+    shards_[i]->entries.clear();
+    shards_[i]->lru.clear();
+    shards_[i]->resident_bytes = 0;
+  }
+}
+
+DecodedTileCacheStats DecodedTileCache::GetStats() {
+  DecodedTileCacheStats stats;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    QMutexLocker locker(&shards_[i]->mutex);
+    stats.hits += shards_[i]->hits;
+    stats.misses += shards_[i]->misses;
+    stats.evictions += shards_[i]->evictions;
+    stats.resident_bytes += shards_[i]->resident_bytes;
+    stats.budget_bytes += shards_[i]->budget_bytes;
+    stats.resident_tiles += int(shards_[i]->entries.size());
+  }
+  return stats;
+}
+
+DecodedTileCache::Shard& DecodedTileCache::GetShard(TileKey key) {
+  return *shards_[TileKeyHashFunc()(key) % shards_.size()];
+}
+
+void DecodedTileCache::EvictToBudget(Shard& shard) {
+  // The most recently inserted image is kept even if it alone exceeds the budget.
+  while (shard.resident_bytes > shard.budget_bytes && shard.lru.size() > 1) {
+    auto it = shard.entries.find(shard.lru.back());
+    shard.resident_bytes -= it->second.bytes;
+    shard.entries.erase(it);
+    shard.lru.pop_back();
+    shard.evictions++;
+  }
+}
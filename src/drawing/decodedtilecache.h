@@ -0,0 +1,71 @@
+#ifndef GIGAPATCHEXPLORER_EXPLORER_DECODEDTILECACHE_H_
+#define GIGAPATCHEXPLORER_EXPLORER_DECODEDTILECACHE_H_
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <QImage>
+#include <QMutex>
+
+#include "common.h"
+
+struct DecodedTileCacheStats {
+  long long hits;
+  long long misses;
+  long long evictions;
+  long long resident_bytes;
+  long long budget_bytes;
+  int resident_tiles;
+  DecodedTileCacheStats()
+    : hits(0), misses(0), evictions(0), resident_bytes(0), budget_bytes(0), resident_tiles(0) {}
+};
+
+// Keeps decoded tile images in system memory so that tiles evicted from the (much smaller) GPU
+// texture cache can be uploaded again without reading and decoding their files. Safe to use from
+// any thread: tiles are spread over shards by key hash, and each shard has its own lock, LRU
+// order and an equal share of the byte budget, so loader threads rarely wait for each other.
+class DecodedTileCache {
+public:
+  explicit DecodedTileCache(long long budget_bytes);
+
+  void SetBudgetBytes(long long budget_bytes);
+  long long budget_bytes();
+
+  // Returns the cached image or a null image. The returned QImage shares its pixels with the
+  // cache until it is modified.
+  QImage Get(TileKey key);
+  bool Contains(TileKey key);
+  // Adds or replaces the image and evicts least recently used images of its shard as needed.
+  void Insert(TileKey key, const QImage& image);
+  void Clear();
+  DecodedTileCacheStats GetStats();
+
+private:
+  struct CacheEntry {
+    QImage image;
+    long long bytes;
+    std::list<TileKey>::iterator lru_position;
+  };
+
+  struct Shard {
+    QMutex mutex;  // Guards everything below.
+    std::unordered_map<TileKey, CacheEntry, TileKeyHashFunc> entries;
+    std::list<TileKey> lru;  // Most recently used first.
+    long long resident_bytes;
+    long long budget_bytes;
+    long long hits;
+    long long misses;
+    long long evictions;
+    Shard() : resident_bytes(0), budget_bytes(0), hits(0), misses(0), evictions(0) {}
+  };
+
+  Shard& GetShard(TileKey key);
+  // Expects the shard's mutex locked.
+  static void EvictToBudget(Shard& shard);
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+#endif  // GIGAPATCHEXPLORER_EXPLORER_DECODEDTILECACHE_H_
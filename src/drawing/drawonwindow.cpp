@@ -138,11 +138,14 @@ void DrawOnWindow::DrawPatchPointers(int level, QColor pointers_color,
   for (int i = 0; i < int(patches_to_draw.size()); ++i) {
     const PatchCoords cur_patch_coords = patches_to_draw[i];
     if (patches_to_draw[i].level == level) {
-      // Compute correct patch coordinates in full image space:
-      float patch_coord_x = float(cur_patch_coords.x);
-      vertexData.push_back(patch_coord_x);
-      float patch_coord_y = float(cur_patch_coords.y);
-      vertexData.push_back(patch_coord_y);
+      // Compute window coordinates (relative to the eye) in double precision; image coordinates
+      // of fine levels are too large for the float vertex attributes.
+      double patch_coord_x = global_translation_.x() +
+        double(cur_patch_coords.x) * global_scale_factor_.x();
+      vertexData.push_back(GLfloat(patch_coord_x));
+      double patch_coord_y = global_translation_.y() +
+        double(cur_patch_coords.y) * global_scale_factor_.y();
+      vertexData.push_back(GLfloat(patch_coord_y));
     }
   }
 
@@ -182,6 +185,5 @@ void DrawOnWindow::UpdateGlobalTransformMatrix() {
   global_transform_matrix_.setToIdentity();
   global_transform_matrix_.ortho(0, float(windowSize.width()), float(windowSize.height()), 
                                  0, -1, 1);
-  global_transform_matrix_.translate(global_translation_.x(), global_translation_.y());
-  global_transform_matrix_.scale(global_scale_factor_.x(), global_scale_factor_.y());
+  // The global translation and scale are applied on the CPU (see DrawPatchPointers()).
 }
\ No newline at end of file
@@ -47,7 +47,7 @@ private:
   QPointF tile_size_;
   QOpenGLWidget *parent_;               // Contains active OpenGL context where to draw.
   QOpenGLBuffer vbo_;                   // Contains tile's quad vertices and texture coords.
-  QMatrix4x4 global_transform_matrix_;  // Transform applied to all tiles drawn.
+  QMatrix4x4 global_transform_matrix_;  // Maps window pixels to clip space.
   QPointF global_translation_;
   QPointF global_scale_factor_;
   float border_percentage_;              // Percentage of quad size for border.
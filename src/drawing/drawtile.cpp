@@ -1,11 +1,21 @@
+#include <cstddef>
+
 #include "drawing/drawtile.h"
 
+#define PROGRAM_VERTEX_ATTRIBUTE 0
+#define PROGRAM_TILE_RECT_ATTRIBUTE 1
+#define PROGRAM_TILE_TEXCOORDS_ATTRIBUTE 2
+#define PROGRAM_TILE_LAYER_ATTRIBUTE 3
+
 DrawTile::DrawTile(QOpenGLWidget *parent)
     : parent_(parent),
       tile_size_(QPointF(-1.0f, -1.0f)),
       global_translation_(QPointF(0.0f, 0.0f)),
       global_scale_factor_(QPointF(1.0f, 1.0f)),
-      default_shader_program_(nullptr), 
+      texcoords_scale_(QPointF(1.0f, 1.0f)),
+      texcoords_shift_(QPointF(0.0f, 0.0f)),
+      default_shader_program_(nullptr),
+      instance_vbo_(QOpenGLBuffer::VertexBuffer),
       border_percentage_(0.0f),
       border_color_(Qt::black) {}
 
@@ -14,14 +24,16 @@ DrawTile::~DrawTile() {
 }
 
 void DrawTile::Init(QSize _tile_size) {
-  if (_tile_size.width() <= 0 || _tile_size.height() <= 0) 
+  if (_tile_size.width() <= 0 || _tile_size.height() <= 0)
     return;
 
   parent_->makeCurrent();
 
   global_translation_ = QPointF(0.0f, 0.0f);
   global_scale_factor_ = QPointF(1.0f, 1.0f);
-  UpdateGlobalTransformMatrix();
+  texcoords_scale_ = QPointF(1.0f, 1.0f);
+  texcoords_shift_ = QPointF(0.0f, 0.0f);
+  UpdateWindowMatrix();
 
   tile_size_ = QPointF(float(_tile_size.width()), float(_tile_size.height()));
 
@@ -49,42 +61,59 @@ void DrawTile::Init(QSize _tile_size) {
   vbo_.bind();
   vbo_.allocate(&vertexData[0], int(vertexData.size() * sizeof(GLfloat)));
 
+  if (instance_vbo_.isCreated()) {
+    instance_vbo_.destroy();
+  }
+  instance_vbo_.create();
+  // The tile instances are rewritten every frame.
+  instance_vbo_.setUsagePattern(QOpenGLBuffer::StreamDraw);
+
   // TODO (ronell): Put the shader codes in separate files for easy modification.
-#define PROGRAM_VERTEX_ATTRIBUTE 0
-#define PROGRAM_TEXCOORD_ATTRIBUTE 1
 
-  // Pass through vertex shader:
+  // Places the unit quad at the tile's window rectangle:
   QOpenGLShader *vshader = new QOpenGLShader(QOpenGLShader::Vertex, parent_);
   const char *vsrc =
     "#version 430 core\n"
     "layout (location=0) in vec2 vertexPosition;\n"
-    "layout (location=1) in vec2 vertexTexCoords;\n"
+    "layout (location=1) in vec4 tileRect;\n"
+    "layout (location=2) in vec4 tileTexCoords;\n"
+    "layout (location=3) in float tileLayer;\n"
     "uniform mat4 matrix;\n"
     "out vec2 vTexCoords;\n"
+    "out vec2 vLayerTexCoords;\n"
+    "flat out float vLayer;\n"
 
     "void main(void) {\n"
-    "   gl_Position = matrix * vec4(vertexPosition, 0.0, 1.0);\n"
-    "   vTexCoords = vertexTexCoords;\n"
+    "   gl_Position = matrix * vec4(tileRect.xy + vertexPosition * tileRect.zw, 0.0, 1.0);\n"
+    "   vTexCoords = vertexPosition;\n"
+    "   vLayerTexCoords = (vertexPosition * tileTexCoords.xy) + tileTexCoords.zw;\n"
+    "   vLayer = tileLayer;\n"
     "}";
   vshader->compileSourceCode(vsrc);
 
-  // Texture mapping fragment shader:
+  // Texture array mapping fragment shader, with a checkerboard for tiles without a layer:
   QOpenGLShader *fshader = new QOpenGLShader(QOpenGLShader::Fragment, parent_);
   const char *fsrc =
     "#version 430 core\n"
     "in vec2 vTexCoords;\n"
-    "uniform vec2 vTexCoordsScale;\n"
-    "uniform vec2 vTexCoordsShift;\n"
+    "in vec2 vLayerTexCoords;\n"
+    "flat in float vLayer;\n"
+    "uniform vec2 tileSize;\n"
     "uniform float borderPercentage;\n"
     "uniform vec4 borderColor;\n"
     "out vec4 fragColor;\n"
-    "layout(binding = 0) uniform sampler2D tileImage;\n"
+    "layout(binding = 0) uniform sampler2DArray tileImages;\n"
     "void main() {\n"
-    "    vec2 texCoords = (vTexCoords*vTexCoordsScale) + vTexCoordsShift;\n"
-    "    fragColor = texture(tileImage, texCoords);\n"
-    "    if(vTexCoords.s < borderPercentage || vTexCoords.s > 1.0f - borderPercentage)\n" 
+    "    if (vLayer < 0.0) {\n"
+    "       ivec2 cell = ivec2(vTexCoords * tileSize) / 16;\n"
+    "       fragColor = (((cell.x + cell.y) & 1) != 0) ? vec4(0.0, 0.0, 0.0, 1.0) :\n"
+    "         vec4(vec3(35.0 / 255.0), 1.0);\n"
+    "    } else {\n"
+    "       fragColor = texture(tileImages, vec3(vLayerTexCoords, vLayer));\n"
+    "    }\n"
+    "    if(vTexCoords.s < borderPercentage || vTexCoords.s > 1.0f - borderPercentage)\n"
     "       {fragColor += borderColor;}\n"
-    "    if(vTexCoords.t < borderPercentage || vTexCoords.t > 1.0f - borderPercentage )\n" 
+    "    if(vTexCoords.t < borderPercentage || vTexCoords.t > 1.0f - borderPercentage )\n"
     "       {fragColor += borderColor;}\n"
     "}\n";
   fshader->compileSourceCode(fsrc);
@@ -92,16 +121,18 @@ void DrawTile::Init(QSize _tile_size) {
   default_shader_program_ = std::make_shared<QOpenGLShaderProgram>();
   default_shader_program_->addShader(vshader);
   default_shader_program_->addShader(fshader);
-  default_shader_program_->bindAttributeLocation("vertex", PROGRAM_VERTEX_ATTRIBUTE);
-  default_shader_program_->bindAttributeLocation("texCoord", PROGRAM_TEXCOORD_ATTRIBUTE);
+  default_shader_program_->bindAttributeLocation("vertexPosition", PROGRAM_VERTEX_ATTRIBUTE);
+  default_shader_program_->bindAttributeLocation("tileRect", PROGRAM_TILE_RECT_ATTRIBUTE);
+  default_shader_program_->bindAttributeLocation("tileTexCoords",
+                                                 PROGRAM_TILE_TEXCOORDS_ATTRIBUTE);
+  default_shader_program_->bindAttributeLocation("tileLayer", PROGRAM_TILE_LAYER_ATTRIBUTE);
   default_shader_program_->link();
 
   default_shader_program_->bind();
-  default_shader_program_->setUniformValue("texture", 0);
-  default_shader_program_->setUniformValue("vTexCoordsScale", 1.0f, 1.0f);
-  default_shader_program_->setUniformValue("vTexCoordsShift", 0.0f, 0.0f);
+  default_shader_program_->setUniformValue("tileSize", float(tile_size_.x()),
+                                           float(tile_size_.y()));
   default_shader_program_->setUniformValue("borderPercentage", border_percentage_);
-  default_shader_program_->setUniformValue("borderColor", border_color_.redF(), 
+  default_shader_program_->setUniformValue("borderColor", border_color_.redF(),
                                            border_color_.greenF(), border_color_.blueF(),
                                            border_color_.alphaF());
   default_shader_program_->release();
@@ -110,26 +141,18 @@ void DrawTile::Init(QSize _tile_size) {
 
 void DrawTile::SetGlobalTranslation(QPointF translation) {
   global_translation_ = translation;
-  UpdateGlobalTransformMatrix();
 }
 
 void DrawTile::SetGlobalScaleFactor(QPointF scale_factor) {
   global_scale_factor_ = scale_factor;
-  UpdateGlobalTransformMatrix();
 }
 
 void DrawTile::UpdateTextureCoordsScale(QPointF texcoords_scale_factor) {
-  parent_->makeCurrent();
-  default_shader_program_->bind();
-  default_shader_program_->setUniformValue("vTexCoordsScale", texcoords_scale_factor.x(), 
-                                           texcoords_scale_factor.y());
+  texcoords_scale_ = texcoords_scale_factor;
 }
 
 void DrawTile::UpdateTextureCoordsShift(QPointF texcoords_shift) {
-  parent_->makeCurrent();
-  default_shader_program_->bind();
-  default_shader_program_->setUniformValue("vTexCoordsShift", texcoords_shift.x(),
-                                           texcoords_shift.y());
+  texcoords_shift_ = texcoords_shift;
 }
 
 void DrawTile::UpdateBorderPercentage(float border_percentage) {
@@ -148,44 +171,91 @@ void DrawTile::UpdateBorderColor(QColor border_color) {
                                            border_color_.alphaF());
 }
 
-void DrawTile::DrawTileAt(QPointF localTranslation, QOpenGLTexture *texture) {
-  if (texture == nullptr || !default_shader_program_->isLinked() || !vbo_.isCreated()) 
+void DrawTile::BeginTiles() {
+  instances_.clear();
+}
+
+void DrawTile::AddTileAt(QPointF local_translation, int layer) {
+  TileInstance instance;
+  instance.rect[0] = float(global_translation_.x() +
+                           local_translation.x() * global_scale_factor_.x());
+  instance.rect[1] = float(global_translation_.y() +
+                           local_translation.y() * global_scale_factor_.y());
+  instance.rect[2] = float(tile_size_.x() * global_scale_factor_.x());
+  instance.rect[3] = float(tile_size_.y() * global_scale_factor_.y());
+  instance.texcoords[0] = float(texcoords_scale_.x());
+  instance.texcoords[1] = float(texcoords_scale_.y());
+  instance.texcoords[2] = float(texcoords_shift_.x());
+  instance.texcoords[3] = float(texcoords_shift_.y());
+  instance.layer = float(layer);
+  instances_.push_back(instance);
+}
+
+void DrawTile::DrawTiles(TileTextureArray *texture_array) {
+  if (instances_.empty() || default_shader_program_ == nullptr ||
+      !default_shader_program_->isLinked() || !vbo_.isCreated() || !instance_vbo_.isCreated())
     return;
 
   parent_->makeCurrent();
-  default_shader_program_->bind();
-  texture->bind();
-  vbo_.bind();
+  UpdateWindowMatrix();
+  QOpenGLExtraFunctions *QGL = QOpenGLContext::currentContext()->extraFunctions();
 
-  QMatrix4x4 localTransformMatrix;
-  localTransformMatrix.setToIdentity();
-  localTransformMatrix.translate(localTranslation.x(), localTranslation.y());
-  localTransformMatrix.scale(tile_size_.x(), tile_size_.y());
+  default_shader_program_->bind();
+  default_shader_program_->setUniformValue("matrix", window_matrix_);
+  bool has_textures = texture_array != nullptr && texture_array->IsCreated();
+  if (has_textures) {
+    texture_array->Bind(0);
+  }
 
-  default_shader_program_->setUniformValue("matrix", 
-                                           global_transform_matrix_ * localTransformMatrix);
+  vbo_.bind();
   default_shader_program_->enableAttributeArray(PROGRAM_VERTEX_ATTRIBUTE);
-  default_shader_program_->enableAttributeArray(PROGRAM_TEXCOORD_ATTRIBUTE);
   default_shader_program_->setAttributeBuffer(PROGRAM_VERTEX_ATTRIBUTE, GL_FLOAT, 0, 2);
-  default_shader_program_->setAttributeBuffer(PROGRAM_TEXCOORD_ATTRIBUTE, GL_FLOAT, 0, 2);
 
-  QOpenGLFunctions *QGL = QOpenGLContext::currentContext()->functions();
-  QGL->glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-  default_shader_program_->release();
-  texture->release();
+  // Re-allocating every frame lets the driver hand us fresh memory instead of waiting for the
+  // GPU to finish reading last frame's instances.
+  instance_vbo_.bind();
+  instance_vbo_.allocate(&instances_[0], int(instances_.size() * sizeof(TileInstance)));
+  default_shader_program_->setAttributeBuffer(PROGRAM_TILE_RECT_ATTRIBUTE, GL_FLOAT,
+                                              int(offsetof(TileInstance, rect)), 4,
+                                              int(sizeof(TileInstance)));
+  default_shader_program_->setAttributeBuffer(PROGRAM_TILE_TEXCOORDS_ATTRIBUTE, GL_FLOAT,
+                                              int(offsetof(TileInstance, texcoords)), 4,
+                                              int(sizeof(TileInstance)));
+  default_shader_program_->setAttributeBuffer(PROGRAM_TILE_LAYER_ATTRIBUTE, GL_FLOAT,
+                                              int(offsetof(TileInstance, layer)), 1,
+                                              int(sizeof(TileInstance)));
+  for (int attribute = PROGRAM_TILE_RECT_ATTRIBUTE; attribute <= PROGRAM_TILE_LAYER_ATTRIBUTE;
+       ++attribute) {
+    default_shader_program_->enableAttributeArray(attribute);
+    QGL->glVertexAttribDivisor(attribute, 1);
+  }
+
+  QGL->glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(instances_.size()));
+
+  // Leave the attribute state as we found it for other drawing code.
+  for (int attribute = PROGRAM_TILE_RECT_ATTRIBUTE; attribute <= PROGRAM_TILE_LAYER_ATTRIBUTE;
+       ++attribute) {
+    QGL->glVertexAttribDivisor(attribute, 0);
+    default_shader_program_->disableAttributeArray(attribute);
+  }
+  default_shader_program_->disableAttributeArray(PROGRAM_VERTEX_ATTRIBUTE);
+  instance_vbo_.release();
   vbo_.release();
+  if (has_textures) {
+    texture_array->Release(0);
+  }
+  default_shader_program_->release();
 }
 
 void DrawTile::CleanupGL() {
   parent_->makeCurrent();
   vbo_.destroy();
+  instance_vbo_.destroy();
 }
 
-void DrawTile::UpdateGlobalTransformMatrix() {
+void DrawTile::UpdateWindowMatrix() {
   QSize windowSize = parent_->size();
-  global_transform_matrix_.setToIdentity();
-  global_transform_matrix_.ortho(0, float(windowSize.width()), float(windowSize.height()), 
-                                 0, -1, 1);
-  global_transform_matrix_.translate(global_translation_.x(), global_translation_.y());
-  global_transform_matrix_.scale(global_scale_factor_.x(), global_scale_factor_.y());
-}
\ No newline at end of file
+  window_matrix_.setToIdentity();
+  window_matrix_.ortho(0, float(windowSize.width()), float(windowSize.height()),
+                       0, -1, 1);
+}
@@ -2,19 +2,26 @@
 #define GIGAPATCHEXPLORER_EXPLORER_DRAWTILE_H_
 
 #include <memory>
+#include <vector>
 
 #include <QOpenGLBuffer>
-#include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
 #include <QOpenGLShaderProgram>
-#include <QOpenGLTexture>
 #include <QOpenGLWidget>
 
+#include "drawing/tiletexturearray.h"
+
 QT_FORWARD_DECLARE_CLASS(QOpenGLShaderProgram);
-QT_FORWARD_DECLARE_CLASS(QOpenGLTexture)
 
-// Handles drawing stuff per tile (textures, points, etc.) on the parent QOpenGLWidget.
-// The global translation and scale can be set, while the local translation is specified
-// during the per tile draw call.
+// Handles drawing tiles on the parent QOpenGLWidget. Tiles are collected with AddTileAt() and
+// then drawn all at once by DrawTiles() with a single instanced draw call, reading their texels
+// from the layers of a TileTextureArray. The CPU cost per frame is thus a few floats per tile
+// instead of a round of state changes and a draw call per tile.
+//
+// The global translation and scale, and the texture coordinates scale and shift, are applied to
+// the tiles added after they are set, while the local translation is specified per tile. Tile
+// positions are combined in double precision and only their window (eye relative) positions are
+// sent to the GPU as floats, so tiles stay pixel exact however far from the image origin.
 class DrawTile {
 
 public:
@@ -29,22 +36,40 @@ public:
   void UpdateTextureCoordsShift(QPointF texcoords_shift);
   void UpdateBorderPercentage(float border_percentage);
   void UpdateBorderColor(QColor border_color);
-  void DrawTileAt(QPointF local_translation, QOpenGLTexture *texture);
+  // Starts collecting a new set of tiles.
+  void BeginTiles();
+  // Adds a tile showing the given layer of the texture array, or a checkerboard placeholder if
+  // layer is negative. Tiles added later are drawn on top of earlier ones.
+  void AddTileAt(QPointF local_translation, int layer);
+  // Draws all tiles added since BeginTiles() with one instanced draw call.
+  void DrawTiles(TileTextureArray *texture_array);
+  int num_tiles() { return int(instances_.size()); }
   // We make the clean up function public so that the parent can call it anytime.
   void CleanupGL();
 
 private:
-  void UpdateGlobalTransformMatrix();
+  // Per tile data streamed to the GPU.
+  struct TileInstance {
+    GLfloat rect[4];       // Window position and size of the tile.
+    GLfloat texcoords[4];  // Texture coordinates scale (xy) and shift (zw).
+    GLfloat layer;         // Texture array layer, negative for the placeholder.
+  };
+
+  void UpdateWindowMatrix();
 
   std::shared_ptr<QOpenGLShaderProgram> default_shader_program_;
   QPointF tile_size_;
   QOpenGLWidget *parent_;               // Contains active OpenGL context where to draw.
   QOpenGLBuffer vbo_;                   // Contains tile's quad vertices and texture coords.
-  QMatrix4x4 global_transform_matrix_;  // Transform applied to all tiles drawn.
+  QOpenGLBuffer instance_vbo_;          // Contains the TileInstances of the current frame.
+  QMatrix4x4 window_matrix_;            // Maps window pixels to clip space.
   QPointF global_translation_;
   QPointF global_scale_factor_;
+  QPointF texcoords_scale_;
+  QPointF texcoords_shift_;
   float border_percentage_;              // Percentage of quad size for border.
   QColor border_color_;
+  std::vector<TileInstance> instances_;
 };
 
 #endif  // GIGAPATCHEXPLORER_EXPLORER_DRAWTILE_H_
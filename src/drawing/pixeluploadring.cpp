@@ -0,0 +1,193 @@
+#include <QMutexLocker>
+#include <QOpenGLContext>
+
+#include "drawing/pixeluploadring.h"
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+// glBufferStorage is not part of QOpenGLExtraFunctions (OpenGL 4.4 / ARB_buffer_storage).
+typedef void (QOPENGLF_APIENTRYP BufferStorageFunc)(GLenum target, GLsizeiptr size,
+                                                     const void *data, GLbitfield flags);
+
+PixelUploadRing::PixelUploadRing()
+    : gl_(nullptr),
+      buffer_id_(0),
+      mapped_data_(nullptr),
+      format_(TileTextureFormat_RGBA8),
+      bytes_per_slot_(0),
+      closed_(true) {}
+
+PixelUploadRing::~PixelUploadRing() {
+  Destroy();
+}
+
+bool PixelUploadRing::Create(QSize slot_size, TileTextureFormat format, int num_slots) {
+  Destroy();
+  QOpenGLContext* context = QOpenGLContext::currentContext();
+  if (context == nullptr || slot_size.isEmpty() || num_slots <= 0)
+    return false;
+
+  QSurfaceFormat surface_format = context->format();
+  bool has_buffer_storage = context->hasExtension("GL_ARB_buffer_storage") ||
+    (!context->isOpenGLES() && surface_format.version() >= qMakePair(4, 4));
+  BufferStorageFunc buffer_storage =
+    reinterpret_cast<BufferStorageFunc>(context->getProcAddress("glBufferStorage"));
+  if (!has_buffer_storage || buffer_storage == nullptr)
+    return false;
+
+  gl_ = context->extraFunctions();
+  slot_size_ = slot_size;
+  format_ = format;
+  bytes_per_slot_ = EncodedTileBytes(format, slot_size);
+  GLsizeiptr buffer_bytes = GLsizeiptr(bytes_per_slot_) * num_slots;
+  const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+  while (gl_->glGetError() != GL_NO_ERROR) {}
+  gl_->glGenBuffers(1, &buffer_id_);
+  gl_->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_id_);
+  buffer_storage(GL_PIXEL_UNPACK_BUFFER, buffer_bytes, nullptr, flags);
+  mapped_data_ = static_cast<uchar*>(gl_->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                                                           buffer_bytes, flags));
+  gl_->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  if (gl_->glGetError() != GL_NO_ERROR || mapped_data_ == nullptr) {
+    printf("Warning! Cannot map a %d MB pixel upload buffer.\n",
+           int(buffer_bytes / (1024 * 1024)));
+    gl_->glDeleteBuffers(1, &buffer_id_);
+    buffer_id_ = 0;
+    mapped_data_ = nullptr;
+    return false;
+  }
+
+  QMutexLocker locker(&mutex_);
+  closed_ = false;
+  states_.assign(size_t(num_slots), kFree);
+  for (int slot = num_slots - 1; slot >= 0; --slot) {
+    free_.push_back(slot);
+  }
+  return true;
+}
+
+void PixelUploadRing::Destroy() {
+  {
+    QMutexLocker locker(&mutex_);
+    // No new writers from here on, and the ones still decoding must finish before we unmap.
+    closed_ = true;
+    while (true) {
+      bool writing = false;
+      for (size_t slot = 0; slot < states_.size(); ++slot) {
+        writing = writing || states_[slot] == kWriting;
+      }
+      if (!writing)
+        break;
+      writing_done_.wait(&mutex_);
+    }
+    states_.clear();
+    free_.clear();
+  }
+
+  if (buffer_id_ != 0 && QOpenGLContext::currentContext() != nullptr) {
+    for (size_t i = 0; i < in_flight_.size(); ++i) {
+      gl_->glDeleteSync(in_flight_[i].fence);
+    }
+    gl_->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_id_);
+    gl_->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    gl_->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    gl_->glDeleteBuffers(1, &buffer_id_);
+  }
+  in_flight_.clear();
+  unfenced_.clear();
+  buffer_id_ = 0;
+  mapped_data_ = nullptr;
+}
+
+bool PixelUploadRing::IsCreated() {
+  QMutexLocker locker(&mutex_);
+  return !closed_;
+}
+
+int PixelUploadRing::AcquireSlot() {
+  QMutexLocker locker(&mutex_);
+  if (closed_ || free_.empty())
+    return -1;
+  int slot = free_.back();
+  free_.pop_back();
+  states_[size_t(slot)] = kWriting;
+  return slot;
+}
+
+void PixelUploadRing::FinishWriting(int slot) {
+  QMutexLocker locker(&mutex_);
+  if (size_t(slot) >= states_.size())
+    return;
+  states_[size_t(slot)] = kReady;
+  writing_done_.wakeAll();
+}
+
+void PixelUploadRing::ReleaseSlot(int slot) {
+  QMutexLocker locker(&mutex_);
+  if (size_t(slot) >= states_.size() || states_[size_t(slot)] == kFree)
+    return;
+  states_[size_t(slot)] = kFree;
+  free_.push_back(slot);
+  writing_done_.wakeAll();
+}
+
+QImage PixelUploadRing::SlotImage(int slot) {
+  return QImage(slot_data(slot), slot_size_.width(), slot_size_.height(),
+                slot_size_.width() * 4, QImage::Format_RGB32);
+}
+
+void PixelUploadRing::WriteImage(int slot, const QImage& image) {
+  EncodeTile(format_, PadTileImage(image, slot_size_), slot_data(slot));
+}
+
+int PixelUploadRing::free_slots() {
+  QMutexLocker locker(&mutex_);
+  return int(free_.size());
+}
+
+void PixelUploadRing::UploadToLayer(int slot, TileTextureArray* texture_array, int layer) {
+  {
+    QMutexLocker locker(&mutex_);
+    if (size_t(slot) >= states_.size() || states_[size_t(slot)] != kReady)
+      return;
+    states_[size_t(slot)] = kUploading;
+  }
+  texture_array->UploadFromBuffer(layer, buffer_id_, size_t(slot) * size_t(bytes_per_slot_));
+  unfenced_.push_back(slot);
+}
+
+void PixelUploadRing::FenceUploads() {
+  if (unfenced_.empty())
+    return;
+  FencedUploads uploads;
+  uploads.fence = gl_->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  uploads.slots.swap(unfenced_);
+  in_flight_.push_back(uploads);
+}
+
+void PixelUploadRing::RetireFinishedUploads() {
+  // Fences signal in order, so we can stop at the first one that is not signaled yet.
+  while (!in_flight_.empty()) {
+    GLenum result = gl_->glClientWaitSync(in_flight_.front().fence,
+                                          GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+      return;
+
+    gl_->glDeleteSync(in_flight_.front().fence);
+    const std::vector<int>& slots = in_flight_.front().slots;
+    {
+      QMutexLocker locker(&mutex_);
+      for (size_t i = 0; i < slots.size(); ++i) {
+        states_[size_t(slots[i])] = kFree;
+        free_.push_back(slots[i]);
+      }
+    }
+    in_flight_.pop_front();
+  }
+}
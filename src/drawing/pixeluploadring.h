@@ -0,0 +1,95 @@
+#ifndef GIGAPATCHEXPLORER_EXPLORER_PIXELUPLOADRING_H_
+#define GIGAPATCHEXPLORER_EXPLORER_PIXELUPLOADRING_H_
+
+#include <deque>
+#include <vector>
+
+#include <QImage>
+#include <QMutex>
+#include <QOpenGLExtraFunctions>
+#include <QSize>
+#include <QWaitCondition>
+
+#include "drawing/tileencoder.h"
+#include "drawing/tiletexturearray.h"
+
+// A ring of tile sized slots in one persistently mapped pixel buffer object, so that worker
+// threads can decode tiles straight into memory the GPU reads from, encoded in the
+// TileTextureFormat of the TileTextureArray. RGBA8 tiles are decoded in place; other formats are
+// encoded into the slot from the decoded image.
+//
+// A slot goes through these states:
+//   free -> writing (AcquireSlot(), any thread) -> ready (FinishWriting()) ->
+//   uploading (UploadToLayer(), GL thread) -> free (RetireFinishedUploads(), once the GPU is done)
+// and can be given back at any time before it is uploaded with ReleaseSlot(). The GL thread
+// never waits: uploads are fenced with sync objects that are only polled, and AcquireSlot()
+// returns -1 instead of waiting when the ring is full, in which case the caller decodes into its
+// own memory as before.
+class PixelUploadRing {
+public:
+  PixelUploadRing();
+  ~PixelUploadRing();
+
+  // Allocates num_slots slots for tiles of slot_size in format. Returns false if the driver does
+  // not support
+  // persistently mapped buffers (OpenGL 4.4 or ARB_buffer_storage) or the allocation fails. Must
+  // be called with the OpenGL context current.
+  bool Create(QSize slot_size, TileTextureFormat format, int num_slots);
+  // Waits for slots being written by other threads, then unmaps and deletes the buffer. Must be
+  // called with the OpenGL context current.
+  void Destroy();
+  bool IsCreated();
+
+  // Thread safe. Returns a slot to write a tile into, or -1 if none is free.
+  int AcquireSlot();
+  // Thread safe. Marks an acquired slot as written.
+  void FinishWriting(int slot);
+  // Thread safe. Returns an acquired slot that is not going to be uploaded.
+  void ReleaseSlot(int slot);
+
+  // Data of an acquired slot, valid until the slot is released or uploaded.
+  uchar* slot_data(int slot) { return mapped_data_ + slot * bytes_per_slot_; }
+  // True if slots hold plain 32 bit pixels that images can be decoded into.
+  bool decodes_in_place() { return format_ == TileTextureFormat_RGBA8; }
+  // Wraps the slot's pixels in an image without copying them. Only if decodes_in_place().
+  QImage SlotImage(int slot);
+  // Pads and converts the image as needed (see PadTileImage()) and encodes it into the slot.
+  void WriteImage(int slot, const QImage& image);
+  QSize slot_size() { return slot_size_; }
+  TileTextureFormat format() { return format_; }
+  int num_slots() { return int(states_.size()); }
+  int free_slots();
+
+  // Starts an asynchronous copy of a written slot into a layer of the texture array. The slot
+  // is busy until the copy is fenced with FenceUploads() and the fence is signaled.
+  void UploadToLayer(int slot, TileTextureArray* texture_array, int layer);
+  // Puts a fence behind the uploads started since the last call.
+  void FenceUploads();
+  // Frees the slots of all uploads the GPU has finished. Never waits.
+  void RetireFinishedUploads();
+
+private:
+  enum SlotState { kFree, kWriting, kReady, kUploading };
+
+  // Uploads covered by one fence.
+  struct FencedUploads {
+    GLsync fence;
+    std::vector<int> slots;
+  };
+
+  QOpenGLExtraFunctions* gl_;
+  GLuint buffer_id_;
+  uchar* mapped_data_;
+  QSize slot_size_;
+  TileTextureFormat format_;
+  int bytes_per_slot_;
+  QMutex mutex_;                          // Guards states_, free_ and closed_.
+  bool closed_;                           // No slots are handed out after Destroy().
+  QWaitCondition writing_done_;           // Signaled whenever a slot leaves the writing state.
+  std::vector<SlotState> states_;
+  std::vector<int> free_;
+  std::vector<int> unfenced_;             // Uploaded slots without a fence yet (GL thread only).
+  std::deque<FencedUploads> in_flight_;   // Oldest first (GL thread only).
+};
+
+#endif  // GIGAPATCHEXPLORER_EXPLORER_PIXELUPLOADRING_H_
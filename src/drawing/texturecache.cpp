@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <iterator>
+
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QPainter>
+
+#include "drawing/texturecache.h"
+
+// Extensions to query the free video memory (both report kilobytes).
+#define GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+#define GL_TEXTURE_FREE_MEMORY_ATI 0x87FC
+
+// Share of the free video memory used for tile textures when the budget is auto-detected.
+const double kAutoBudgetShareOfFreeMemory = 0.5;
+// Budget used when the driver does not report its free memory.
+const long long kDefaultBudgetBytes = 512ll * 1024 * 1024;
+// The texture pool has at least this many slots, even if the budget is smaller, so that the
+// visible tiles of a large screen fit.
+const int kMinTexturePoolLayers = 256;
+// Number of tiles that can be decoded but not yet uploaded, or being uploaded, at the same time
+// in the upload ring. Workers decode into memory of their own when all slots are busy.
+const int kUploadRingSlots = 64;
+// Frame time we try to keep while uploading (60 Hz), and how much slower a frame may be before
+// the upload budget is cut.
+const double kTargetFrameMillisecs = 1000.0 / 60.0;
+const double kSlowFrameFactor = 1.25;
+// Frame intervals longer than this mean that nothing was drawn for a while, not a slow frame.
+const double kIdleFrameMillisecs = 250.0;
+// Upload budget per frame, in tiles, at the start and at most.
+const int kInitialUploadTilesPerFrame = 8;
+const int kMaxUploadTilesPerFrame = 64;
+// Wall time after which a frame stops uploading, whatever is left of the byte budget.
+const qint64 kMaxUploadNanosecsPerFrame = 4000000;
+
+QTextureCache::QTextureCache(bool display_texture_basefilename, int num_loader_threads,
+                             long long budget_bytes, long long decoded_budget_bytes)
+    : opengl_widget_(nullptr),
+      texture_array_(std::make_shared<TileTextureArray>()),
+      upload_ring_(std::make_shared<PixelUploadRing>()),
+      texture_format_(TileTextureFormat_RGBA8),
+      created_texture_format_(TileTextureFormat_RGBA8),
+      decoded_tile_cache_(std::make_shared<DecodedTileCache>(qMax(0ll, decoded_budget_bytes))),
+      tile_loader_(std::make_shared<TileLoader>(num_loader_threads)),
+      upload_epoch_(0),
+      upload_bytes_per_frame_(0),
+      last_frame_upload_bytes_(0),
+      last_frame_millisecs_(0.0),
+      display_texture_basefilename_(display_texture_basefilename),
+      budget_is_explicit_(false),
+      budget_bytes_(kDefaultBudgetBytes),
+      resident_bytes_(0),
+      pinned_max_level_(-1),
+      frame_(0) {
+  if (budget_bytes > 0) {
+    SetBudgetBytes(budget_bytes);
+  }
+  tile_loader_->SetDecodedTileCache(decoded_tile_cache_);
+}
+
+QTextureCache::~QTextureCache() {
+  Clear();
+}
+
+void QTextureCache::Clear() {
+  for (size_t i = 0; i < pending_uploads_.size(); ++i) {
+    pending_uploads_[i].Release();
+  }
+  pending_uploads_.clear();
+  entries_.clear();
+  lru_.clear();
+  free_layers_.clear();
+  layer_was_used_.clear();
+  resident_bytes_ = 0;
+  tile_loader_->SetUploadRing(nullptr);
+  upload_ring_->Destroy();
+  texture_array_->Destroy();
+}
+
+void QTextureCache::SetTextureFormat(TileTextureFormat format) {
+  texture_format_ = format;
+}
+
+void QTextureCache::InitGL(QSize tile_size) {
+  if (texture_array_->IsCreated() && texture_array_->tile_size() == tile_size &&
+      created_texture_format_ == texture_format_)
+    return;
+
+  Clear();
+  created_texture_format_ = texture_format_;
+  // Smaller formats fit more slots into the budget. If the array has to fall back to another
+  // format, the pool is sized again for that one.
+  TileTextureFormat format = texture_format_;
+  long long bytes_per_layer = 0;
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    bytes_per_layer = EncodedTileBytes(format, tile_size);
+    long long budget_layers = bytes_per_layer > 0 ? budget_bytes_ / bytes_per_layer : 0;
+    int num_layers = int(qMin(qMax(budget_layers, (long long)kMinTexturePoolLayers), 1ll << 30));
+    if (!texture_array_->Create(tile_size, format, num_layers))
+      return;
+    if (texture_array_->format() == format)
+      break;
+    format = texture_array_->format();
+  }
+  printf("Texture pool: %d slots of %dx%d %s (%lld MB).\n", texture_array_->num_layers(),
+         tile_size.width(), tile_size.height(), TileTextureFormatName(texture_array_->format()),
+         texture_array_->num_layers() * texture_array_->bytes_per_layer() / (1024 * 1024));
+  for (int layer = texture_array_->num_layers() - 1; layer >= 0; --layer) {
+    free_layers_.push_back(layer);
+  }
+  layer_was_used_.assign(size_t(texture_array_->num_layers()), false);
+  upload_bytes_per_frame_ = kInitialUploadTilesPerFrame * texture_array_->bytes_per_layer();
+
+  // Tiles decoded into the old ring may still be waiting to be taken; they see that their ring
+  // is gone and are dropped.
+  upload_ring_ = std::make_shared<PixelUploadRing>();
+  if (upload_ring_->Create(tile_size, texture_array_->format(), kUploadRingSlots)) {
+    tile_loader_->SetUploadRing(upload_ring_);
+  } else {
+    printf("Persistently mapped buffers are not supported; uploading tiles synchronously.\n");
+  }
+}
+
+void QTextureCache::SetBudgetBytes(long long budget_bytes) {
+  budget_bytes_ = budget_bytes;
+  budget_is_explicit_ = true;
+}
+
+void QTextureCache::AutoDetectBudget() {
+  if (budget_is_explicit_)
+    return;
+
+  QOpenGLContext* context = QOpenGLContext::currentContext();
+  if (context == nullptr)
+    return;
+
+  // Both queries return free kilobytes in the first component.
+  GLint free_kilobytes[4] = { 0, 0, 0, 0 };
+  QOpenGLFunctions* gl = context->functions();
+  if (context->hasExtension("GL_NVX_gpu_memory_info")) {
+    gl->glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, free_kilobytes);
+  } else if (context->hasExtension("GL_ATI_meminfo")) {
+    gl->glGetIntegerv(GL_TEXTURE_FREE_MEMORY_ATI, free_kilobytes);
+  }
+
+  if (free_kilobytes[0] > 0) {
+    budget_bytes_ = (long long)(double(free_kilobytes[0]) * 1024.0 * kAutoBudgetShareOfFreeMemory);
+    printf("Texture cache budget: %lld MB (of %d MB free video memory).\n",
+           budget_bytes_ / (1024 * 1024), free_kilobytes[0] / 1024);
+  } else {
+    budget_bytes_ = kDefaultBudgetBytes;
+    printf("Texture cache budget: %lld MB (free video memory unknown).\n",
+           budget_bytes_ / (1024 * 1024));
+  }
+}
+
+void QTextureCache::BeginFrame() {
+  frame_++;
+  if (frame_timer_.isValid()) {
+    last_frame_millisecs_ = double(frame_timer_.nsecsElapsed()) / 1000000.0;
+    if (last_frame_millisecs_ < kIdleFrameMillisecs && last_frame_upload_bytes_ > 0) {
+      AdaptUploadBudget(last_frame_millisecs_);
+    }
+  }
+  frame_timer_.start();
+  last_frame_upload_bytes_ = 0;
+}
+
+int QTextureCache::GetTextureLayer(TileKey key) {
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    stats_.misses++;
+    return -1;
+  }
+
+  stats_.hits++;
+  CacheEntry& entry = it->second;
+  entry.last_used_frame = frame_;
+  lru_.splice(lru_.begin(), lru_, entry.lru_position);
+  return entry.layer;
+}
+
+void QTextureCache::RequestTextures(const std::vector<TileLoadRequest>& ranked_requests,
+                                    int epoch) {
+  upload_epoch_ = epoch;
+  upload_ranks_.clear();
+  for (size_t i = 0; i < ranked_requests.size(); ++i) {
+    upload_ranks_.insert(std::make_pair(ranked_requests[i].key, int(i)));
+  }
+
+  std::vector<TileLoadRequest> missing;
+  missing.reserve(ranked_requests.size());
+  for (size_t i = 0; i < ranked_requests.size(); ++i) {
+    if (!Contains(ranked_requests[i].key) && failed_tiles_.count(ranked_requests[i].key) == 0) {
+      missing.push_back(ranked_requests[i]);
+    }
+  }
+  tile_loader_->RequestTiles(missing, epoch);
+}
+
+int QTextureCache::UploadLoadedTextures() {
+  std::vector<LoadedTile> loaded_tiles = tile_loader_->TakeLoadedTiles();
+  pending_uploads_.insert(pending_uploads_.end(), loaded_tiles.begin(), loaded_tiles.end());
+  if (opengl_widget_ != nullptr && opengl_widget_->context()->isValid()) {
+    opengl_widget_->makeCurrent();
+  }
+  // Frees the ring slots of earlier uploads that the GPU has finished.
+  upload_ring_->RetireFinishedUploads();
+  if (pending_uploads_.empty())
+    return 0;
+  if (!texture_array_->IsCreated()) {
+    // Without InitGL() there is nowhere to put the tiles; they are requested again later.
+    for (size_t i = 0; i < pending_uploads_.size(); ++i) {
+      pending_uploads_[i].Release();
+    }
+    pending_uploads_.clear();
+    return 0;
+  }
+
+  PreparePendingUploads();
+  QElapsedTimer upload_timer;
+  upload_timer.start();
+  int num_uploaded = 0;
+  size_t next = 0;
+  for (; next < pending_uploads_.size(); ++next) {
+    // At least one tile per frame, so that uploads progress however slow the frames are.
+    if (num_uploaded > 0 &&
+        (last_frame_upload_bytes_ + texture_array_->bytes_per_layer() > upload_bytes_per_frame_ ||
+         upload_timer.nsecsElapsed() > kMaxUploadNanosecsPerFrame))
+      break;
+
+    LoadedTile& tile = pending_uploads_[next];
+    if (display_texture_basefilename_) {
+      // Same as the base name of the tile's file. Painting on the slot image draws into the ring.
+      QString display = QString("%1-%2-%3").arg(tile.key.level(), 4, 10, QChar('0'))
+        .arg(tile.key.tx(), 4, 10, QChar('0')).arg(tile.key.ty(), 4, 10, QChar('0'));
+      // Encoded slots cannot be painted on.
+      if (tile.ring != nullptr) {
+        if (tile.ring->decodes_in_place()) {
+          QImage slot_image = tile.ring->SlotImage(tile.ring_slot);
+          WriteTextureDebugInfo(slot_image, display);
+        }
+      } else {
+        WriteTextureDebugInfo(*tile.image, display);
+      }
+    }
+
+    int layer = AllocateLayer();
+    if (layer < 0) {
+      printf("Warning! No texture array layer left for tile %d-%d-%d.\n", tile.key.level(),
+             tile.key.tx(), tile.key.ty());
+      // Everything left is requested again later.
+      for (size_t i = next; i < pending_uploads_.size(); ++i) {
+        pending_uploads_[i].Release();
+      }
+      next = pending_uploads_.size();
+      break;
+    }
+    if (tile.ring != nullptr) {
+      tile.ring->UploadToLayer(tile.ring_slot, texture_array_.get(), layer);
+      stats_.streamed_uploads++;
+    } else {
+      texture_array_->Upload(layer, *tile.image);
+    }
+    stats_.uploads++;
+    if (layer_was_used_[size_t(layer)]) {
+      stats_.slot_reuses++;
+    }
+    layer_was_used_[size_t(layer)] = true;
+    Insert(tile.key, layer);
+    last_frame_upload_bytes_ += texture_array_->bytes_per_layer();
+    num_uploaded++;
+  }
+  pending_uploads_.erase(pending_uploads_.begin(), pending_uploads_.begin() + next);
+  stats_.deferred_uploads += pending_uploads_.size();
+
+  upload_ring_->FenceUploads();
+  EvictToBudget();
+  return num_uploaded;
+}
+
+TextureCacheStats QTextureCache::GetStats() {
+  TextureCacheStats stats = stats_;
+  stats.upload_bytes_per_frame = upload_bytes_per_frame_;
+  stats.last_frame_millisecs = last_frame_millisecs_;
+  stats.resident_bytes = resident_bytes_;
+  stats.allocated_bytes = texture_array_->bytes_per_layer() * texture_array_->num_layers();
+  stats.budget_bytes = budget_bytes_;
+  stats.total_slots = texture_array_->num_layers();
+  stats.used_slots = int(entries_.size());
+  stats.free_slots = int(free_layers_.size());
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    size_t level = size_t(it->second.level);
+    if (stats.resident_bytes_per_level.size() <= level) {
+      stats.resident_bytes_per_level.resize(level + 1, 0);
+      stats.resident_tiles_per_level.resize(level + 1, 0);
+    }
+    stats.resident_bytes_per_level[level] += it->second.bytes;
+    stats.resident_tiles_per_level[level]++;
+  }
+  return stats;
+}
+
+void QTextureCache::ResetStats() {
+  stats_ = TextureCacheStats();
+}
+
+void QTextureCache::Insert(TileKey key, int layer) {
+  lru_.push_front(key);
+  CacheEntry entry;
+  entry.layer = layer;
+  entry.bytes = texture_array_->bytes_per_layer();
+  entry.level = key.level();
+  // New textures were requested for this view, so they are likely to be drawn right away.
+  entry.last_used_frame = frame_;
+  entry.lru_position = lru_.begin();
+  entries_[key] = entry;
+  resident_bytes_ += entry.bytes;
+}
+
+void QTextureCache::PreparePendingUploads() {
+  std::vector<LoadedTile> upload;
+  upload.reserve(pending_uploads_.size());
+  for (size_t i = 0; i < pending_uploads_.size(); ++i) {
+    LoadedTile& tile = pending_uploads_[i];
+    if (tile.failed()) {
+      failed_tiles_.insert(tile.key);
+      continue;
+    }
+    // Tiles decoded into a ring that was replaced since are requested again later.
+    bool stale_ring = tile.ring != nullptr && tile.ring != upload_ring_;
+    bool obsolete = tile.epoch < upload_epoch_ && upload_ranks_.count(tile.key) == 0;
+    if (Contains(tile.key) || stale_ring || obsolete) {
+      if (obsolete) {
+        stats_.dropped_uploads++;
+      }
+      tile.Release();
+      continue;
+    }
+    upload.push_back(tile);
+  }
+
+  // Tiles that were requested individually (not ranked) go last.
+  auto rank = [this](const LoadedTile& tile) {
+    auto it = upload_ranks_.find(tile.key);
+    return it != upload_ranks_.end() ? it->second : int(upload_ranks_.size());
+  };
+  std::stable_sort(upload.begin(), upload.end(),
+                   [&rank](const LoadedTile& lhs, const LoadedTile& rhs) {
+                     return rank(lhs) < rank(rhs);
+                   });
+  pending_uploads_.swap(upload);
+}
+
+void QTextureCache::AdaptUploadBudget(double frame_millisecs) {
+  long long bytes_per_tile = texture_array_->bytes_per_layer();
+  if (bytes_per_tile <= 0)
+    return;
+  if (frame_millisecs > kTargetFrameMillisecs * kSlowFrameFactor) {
+    upload_bytes_per_frame_ = qMax(bytes_per_tile, upload_bytes_per_frame_ / 2);
+  } else {
+    upload_bytes_per_frame_ = qMin(kMaxUploadTilesPerFrame * bytes_per_tile,
+                                   upload_bytes_per_frame_ + bytes_per_tile);
+  }
+}
+
+int QTextureCache::AllocateLayer() {
+  // The pool may be larger than the budget (see kMinTexturePoolLayers, or a budget lowered after
+  // InitGL()), so free slots beyond the budget are only used if nothing can be evicted.
+  if (free_layers_.empty() || resident_bytes_ + texture_array_->bytes_per_layer() > budget_bytes_) {
+    EvictOne();
+  }
+  if (free_layers_.empty())
+    return -1;
+  int layer = free_layers_.back();
+  free_layers_.pop_back();
+  return layer;
+}
+
+bool QTextureCache::EvictOne() {
+  for (auto it = lru_.rbegin(); it != lru_.rend(); ++it) {
+    auto entry_it = entries_.find(*it);
+    if (IsProtected(entry_it->second))
+      continue;
+
+    resident_bytes_ -= entry_it->second.bytes;
+    free_layers_.push_back(entry_it->second.layer);
+    entries_.erase(entry_it);
+    lru_.erase(std::next(it).base());
+    stats_.evictions++;
+    return true;
+  }
+  return false;
+}
+
+void QTextureCache::EvictToBudget() {
+  while (resident_bytes_ > budget_bytes_ && EvictOne()) {}
+}
+
+void QTextureCache::WriteTextureDebugInfo(QImage& content, QString display) {
+  QPainter debugPainter(&content);
+  debugPainter.setRenderHint(QPainter::Antialiasing, true);
+  debugPainter.setPen(QColor(0, 255, 0));
+  debugPainter.drawRect(3, 3, content.width() - 6, content.height() - 6);
+  debugPainter.drawText(4, 16, QString("tile %1").arg(display));
+  debugPainter.end();
+}
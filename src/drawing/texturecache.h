@@ -1,80 +1,191 @@
 #ifndef GIGAPATCHEXPLORER_EXPLORER_TEXTURECACHE_H_
 #define GIGAPATCHEXPLORER_EXPLORER_TEXTURECACHE_H_
 
+#include <list>
 #include <memory>
-#include <string>
+#include <unordered_map>
+#include <vector>
 
-#include <QCache>
-#include <QFileInfo>
-#include <QOpenGLContext>
-#include <QOpenGLTexture>
+#include <QElapsedTimer>
+#include <QOpenGLWidget>
 
-#include "external/ivda/timer.h"
+#include "drawing/decodedtilecache.h"
+#include "drawing/pixeluploadring.h"
+#include "drawing/tileloader.h"
+#include "drawing/tiletexturearray.h"
 
+struct TextureCacheStats {
+  long long hits;                       // GetTextureLayer() calls that found the texture.
+  long long misses;                     // GetTextureLayer() calls that did not.
+  long long evictions;                  // Textures evicted to stay within the budget.
+  long long resident_bytes;             // Texture memory used by all cached textures.
+  long long allocated_bytes;            // Texture memory allocated for the texture array.
+  long long budget_bytes;
+  long long uploads;                    // Tiles written into a slot.
+  long long slot_reuses;                // Uploads into a slot that held another tile before.
+  long long streamed_uploads;           // Uploads copied asynchronously from the upload ring.
+  long long deferred_uploads;           // Tiles left for a later frame by the upload budget.
+  long long dropped_uploads;            // Tiles that became obsolete before their upload.
+  long long upload_bytes_per_frame;     // Current per-frame upload budget.
+  double last_frame_millisecs;          // Last measured frame time.
+  int total_slots;                      // Layers of the texture array.
+  int used_slots;                       // Layers holding a cached tile.
+  int free_slots;                       // Layers that can be written without evicting.
+  std::vector<long long> resident_bytes_per_level;
+  std::vector<int> resident_tiles_per_level;
+  TextureCacheStats()
+    : hits(0), misses(0), evictions(0), resident_bytes(0), allocated_bytes(0),
+      budget_bytes(0), uploads(0), slot_reuses(0), streamed_uploads(0), deferred_uploads(0),
+      dropped_uploads(0), upload_bytes_per_frame(0), last_frame_millisecs(0.0), total_slots(0),
+      used_slots(0), free_slots(0) {}
+};
+
+// Caches tile textures by tile key. Tiles are never decoded on the calling (GL) thread: missing
+// tiles are requested from a TileLoader, which decodes them on worker threads, and the decoded
+// images are uploaded by UploadLoadedTextures() into free layers of a TileTextureArray, so that
+// all cached tiles can be drawn with one draw call. Decoded images are also kept in a
+// DecodedTileCache in system memory, so tiles evicted from this cache are re-uploaded from there
+// instead of being decoded again.
+//
+// The cache is limited by the bytes of texture memory its textures use, not by their number. The
+// texture array is a pool of slots (layers) allocated once by InitGL() to fit the budget, so
+// caching a tile only writes into a free slot and evicting it only returns the slot to the free
+// list; no texture memory is allocated or freed while browsing. Least recently used textures are
+// evicted first, except textures used during the current or the previous frame (see
+// BeginFrame()) and textures of pinned coarse levels, so that nothing on screen is ever evicted.
+// If all slots hold protected textures, new tiles wait until some become unprotected.
+//
+// Where the driver supports persistently mapped buffers, tiles are decoded by the loader straight
+// into a PixelUploadRing and copied into their slots by the GPU asynchronously, so uploading
+// never blocks the GL thread.
+//
+// Uploads are time sliced so that a burst of decoded tiles (e.g. after a jump) does not stall a
+// frame: each frame uploads the most important tiles first, in the order of the last ranked
+// request list, until its byte budget or time slice is used up, and leaves the rest for the next
+// frames. The byte budget adapts to the measured frame time: it is halved when a frame that
+// uploaded tiles was too slow and grows by one tile per frame otherwise.
 class QTextureCache {
 public:
-  QTextureCache(bool display_texture_basefilename)
-    : texture_cache_(std::make_shared<QCache<QString, QOpenGLTexture>>(10000)) {
-    opengl_widget_ = nullptr;
-    display_texture_basefilename_ = display_texture_basefilename;
-  };
-  ~QTextureCache() {};
+  // budget_bytes <= 0 leaves the budget to AutoDetectBudget(). decoded_budget_bytes is the budget
+  // of the decoded tile cache (<= 0 disables it).
+  QTextureCache(bool display_texture_basefilename, int num_loader_threads = 0,
+                long long budget_bytes = 0, long long decoded_budget_bytes = 0);
+  ~QTextureCache();
 
   void SetOpenGLWidget(QOpenGLWidget* opengl_widget) {
     opengl_widget_ = opengl_widget;
   }
 
-  bool Contains(std::string image_filename) {
-    return texture_cache_->contains(QString(image_filename.c_str()));
+  // Emits TilesLoaded() whenever decoded tiles are ready to be uploaded.
+  TileLoader* tile_loader() {
+    return tile_loader_.get();
   }
 
-  QOpenGLTexture* GetTexture(std::string image_filename, 
-                             QOpenGLTexture::WrapMode mode = QOpenGLTexture::ClampToEdge) {
-
-    if (opengl_widget_ != nullptr && opengl_widget_->context()->isValid()) {
-      opengl_widget_->makeCurrent();
-    }
-    
-    QString image_filename_qstring = QString(image_filename.c_str());
-//    IVDA::Timer find_timer; find_timer.Start();
-    QOpenGLTexture* texture = texture_cache_->object(image_filename_qstring);
-//    printf("Find took %f seconds.\n", find_timer.Elapsed() / 1000.0f);
-    if (texture == 0) {
-
-//      IVDA::Timer load_timer; load_timer.Start();
-      std::shared_ptr<QImage> content = std::make_shared<QImage>(image_filename_qstring);
-      if (content->isNull()) {
-        printf("Warning! Cannot load image %s.\n", image_filename_qstring.toStdString().c_str());
-        return nullptr;
-      } else if (display_texture_basefilename_) {
-        QFileInfo info(image_filename_qstring);
-        WriteTextureDebugInfo(content, info.baseName());
-      }
-//      printf("Load took %f seconds.\n", load_timer.Elapsed() / 1000.0f);
-
-      texture = new QOpenGLTexture(*content);
-      texture_cache_->insert(image_filename_qstring, texture);
-      texture->setWrapMode(mode);
-
-    }
-    return texture;
+  DecodedTileCache* decoded_tile_cache() {
+    return decoded_tile_cache_.get();
   }
 
-private:
-  QOpenGLWidget* opengl_widget_;
-  std::shared_ptr<QCache<QString, QOpenGLTexture>> texture_cache_;
-  bool display_texture_basefilename_;
+  void SetBudgetBytes(long long budget_bytes);
+  long long budget_bytes() { return budget_bytes_; }
+  // Sets the budget to a share of the free video memory reported by the driver, or to a default
+  // if the driver does not report it. Does nothing if the budget was set explicitly. Must be
+  // called with the OpenGL context current.
+  void AutoDetectBudget();
+  // Creates the texture pool for tiles of the given size, with as many slots as fit the budget,
+  // and the upload ring, unless they already exist. Changing the tile size clears the cache.
+  // Must be called with the OpenGL context current, after AutoDetectBudget().
+  void InitGL(QSize tile_size);
+  // Format of the tile textures. Takes effect with the next InitGL(), which recreates the
+  // textures if the format changed.
+  void SetTextureFormat(TileTextureFormat format);
+  TileTextureFormat texture_format() { return texture_format_; }
+  TileTextureArray* texture_array() { return texture_array_.get(); }
+  // Textures of levels <= max_level are never evicted (-1 pins nothing).
+  void SetPinnedLevels(int max_level) { pinned_max_level_ = max_level; }
+
+  // Starts a new frame. Textures returned by GetTextureLayer() during this and the previous frame
+  // are protected from eviction. Also measures the frame time to adapt the upload budget.
+  void BeginFrame();
+
+  bool Contains(TileKey key) {
+    return entries_.count(key) > 0;
+  }
 
+  // Returns the layer of texture_array() that holds the tile, or -1 if it is not loaded (yet).
+  // Does not load anything.
+  int GetTextureLayer(TileKey key);
 
-  void WriteTextureDebugInfo(std::shared_ptr<QImage> content, QString display) {
-    
-      QPainter debugPainter(&*content);
-      debugPainter.setRenderHint(QPainter::Antialiasing, true);
-      debugPainter.setPen(QColor(0, 255, 0));
-      debugPainter.drawRect(3, 3, content->width() - 6, content->height() - 6);
-      debugPainter.drawText(4, 16, QString("tile %1").arg(display));
-      debugPainter.end();
+  // Asynchronously loads the missing textures, most important first. A newer epoch than the
+  // previous call's marks queued requests that are not in ranked_requests as obsolete. The order
+  // is also the order in which loaded tiles are uploaded.
+  void RequestTextures(const std::vector<TileLoadRequest>& ranked_requests, int epoch);
+
+  // Creates textures for the most important tiles decoded so far, as many as this frame's upload
+  // budget allows, and evicts textures to stay within the budget. Must be called with the OpenGL
+  // context current. Returns the number of textures created.
+  int UploadLoadedTextures();
+  // True if decoded tiles are waiting for a later frame's upload budget.
+  bool HasPendingUploads() { return !pending_uploads_.empty(); }
+
+  // Deletes all textures, the texture array and the upload ring. Must be called with the OpenGL
+  // context current.
+  void Clear();
+  TextureCacheStats GetStats();
+  void ResetStats();
+
+private:
+  struct CacheEntry {
+    int layer;
+    long long bytes;
+    int level;
+    int last_used_frame;
+    std::list<TileKey>::iterator lru_position;
+  };
+
+  void Insert(TileKey key, int layer);
+  // Drops pending tiles that failed, are cached already, became obsolete, or were decoded into a
+  // replaced upload ring, and sorts the others by their rank.
+  void PreparePendingUploads();
+  // Shrinks the upload budget after a slow frame with uploads and grows it after a fast one.
+  void AdaptUploadBudget(double frame_millisecs);
+  // Returns a free layer: an unused one or one freed by evicting the least recently used
+  // unprotected texture. Returns -1 if there is none.
+  int AllocateLayer();
+  // Evicts the least recently used unprotected texture. Returns false if there is none.
+  bool EvictOne();
+  // Evicts unprotected textures, least recently used first, until the budget is met.
+  void EvictToBudget();
+  bool IsProtected(const CacheEntry& entry) {
+    return entry.level <= pinned_max_level_ || entry.last_used_frame >= frame_ - 1;
   }
+  void WriteTextureDebugInfo(QImage& content, QString display);
+
+  QOpenGLWidget* opengl_widget_;
+  std::unordered_map<TileKey, CacheEntry, TileKeyHashFunc> entries_;
+  std::list<TileKey> lru_;                            // Most recently used first.
+  std::shared_ptr<TileTextureArray> texture_array_;
+  std::shared_ptr<PixelUploadRing> upload_ring_;      // Replaced with the texture array.
+  TileTextureFormat texture_format_;                  // Requested format.
+  TileTextureFormat created_texture_format_;          // Requested when the array was created.
+  std::vector<int> free_layers_;
+  std::vector<bool> layer_was_used_;                  // Whether each layer held a tile before.
+  std::shared_ptr<DecodedTileCache> decoded_tile_cache_;
+  std::shared_ptr<TileLoader> tile_loader_;
+  TileKeySet failed_tiles_;                           // Tiles that could not be loaded.
+  std::vector<LoadedTile> pending_uploads_;           // Decoded tiles not uploaded yet.
+  std::unordered_map<TileKey, int, TileKeyHashFunc> upload_ranks_;  // From the last ranking.
+  int upload_epoch_;                                  // Epoch of the last ranking.
+  long long upload_bytes_per_frame_;
+  long long last_frame_upload_bytes_;
+  QElapsedTimer frame_timer_;
+  double last_frame_millisecs_;
+  bool display_texture_basefilename_;
+  bool budget_is_explicit_;
+  long long budget_bytes_;
+  long long resident_bytes_;
+  int pinned_max_level_;
+  int frame_;
+  TextureCacheStats stats_;                           // Only the counters are kept up to date.
 };
 
 #endif  // GIGAPATCHEXPLORER_EXPLORER_TEXTURECACHE_H_
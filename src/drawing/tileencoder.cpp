@@ -0,0 +1,435 @@
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include <QFile>
+
+#include "drawing/tileencoder.h"
+
+namespace {
+
+const char* const kFormatNames[TileTextureFormat_COUNT] = { "rgba8", "rgb8", "rgb565", "bc1" };
+
+// Minimum PSNR (dB) of the round trip of the synthetic tile in CheckTileEncoders().
+const double kMinPSNR[TileTextureFormat_COUNT] = { 1000.0, 1000.0, 38.0, 35.0 };
+
+uint16_t To565(int r, int g, int b) {
+  return uint16_t((((r * 31 + 127) / 255) << 11) | (((g * 63 + 127) / 255) << 5) |
+                  ((b * 31 + 127) / 255));
+}
+
+QRgb From565(uint16_t c) {
+  int r = (c >> 11) & 31;
+  int g = (c >> 5) & 63;
+  int b = c & 31;
+  return qRgb((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2));
+}
+
+void PutLittleEndian16(uint16_t value, uchar* dst) {
+  dst[0] = uchar(value & 0xff);
+  dst[1] = uchar(value >> 8);
+}
+
+uint16_t GetLittleEndian16(const uchar* src) {
+  return uint16_t(src[0] | (src[1] << 8));
+}
+
+int ColorDistance(QRgb a, QRgb b) {
+  int dr = qRed(a) - qRed(b);
+  int dg = qGreen(a) - qGreen(b);
+  int db = qBlue(a) - qBlue(b);
+  return dr * dr + dg * dg + db * db;
+}
+
+// Palette of a BC1 block, in the order of the 2 bit indices.
+void GetBC1Palette(uint16_t c0, uint16_t c1, QRgb palette[4]) {
+  palette[0] = From565(c0);
+  palette[1] = From565(c1);
+  if (c0 > c1) {
+    palette[2] = qRgb((2 * qRed(palette[0]) + qRed(palette[1])) / 3,
+                      (2 * qGreen(palette[0]) + qGreen(palette[1])) / 3,
+                      (2 * qBlue(palette[0]) + qBlue(palette[1])) / 3);
+    palette[3] = qRgb((qRed(palette[0]) + 2 * qRed(palette[1])) / 3,
+                      (qGreen(palette[0]) + 2 * qGreen(palette[1])) / 3,
+                      (qBlue(palette[0]) + 2 * qBlue(palette[1])) / 3);
+  } else {
+    palette[2] = qRgb((qRed(palette[0]) + qRed(palette[1])) / 2,
+                      (qGreen(palette[0]) + qGreen(palette[1])) / 2,
+                      (qBlue(palette[0]) + qBlue(palette[1])) / 2);
+    palette[3] = qRgb(0, 0, 0);
+  }
+}
+
+void EncodeBC1Block(const QRgb pixels[16], uchar* dst) {
+  int min_color[3] = { 255, 255, 255 };
+  int max_color[3] = { 0, 0, 0 };
+  for (int i = 0; i < 16; ++i) {
+    int color[3] = { qRed(pixels[i]), qGreen(pixels[i]), qBlue(pixels[i]) };
+    for (int c = 0; c < 3; ++c) {
+      min_color[c] = qMin(min_color[c], color[c]);
+      max_color[c] = qMax(max_color[c], color[c]);
+    }
+  }
+
+  // The maximum is never smaller than the minimum in any channel, so c0 >= c1 and the block is
+  // decoded with four colors (or is a single color if they are equal).
+  uint16_t c0 = To565(max_color[0], max_color[1], max_color[2]);
+  uint16_t c1 = To565(min_color[0], min_color[1], min_color[2]);
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    QRgb palette[4];
+    GetBC1Palette(c0, c1, palette);
+    for (int i = 0; i < 16; ++i) {
+      uint32_t best_index = 0;
+      int best_distance = ColorDistance(pixels[i], palette[0]);
+      for (uint32_t index = 1; index < 4; ++index) {
+        int distance = ColorDistance(pixels[i], palette[index]);
+        if (distance < best_distance) {
+          best_distance = distance;
+          best_index = index;
+        }
+      }
+      indices |= best_index << (2 * i);
+    }
+  }
+
+  PutLittleEndian16(c0, dst);
+  PutLittleEndian16(c1, dst + 2);
+  PutLittleEndian16(uint16_t(indices & 0xffff), dst + 4);
+  PutLittleEndian16(uint16_t(indices >> 16), dst + 6);
+}
+
+void DecodeBC1Block(const uchar* src, QRgb pixels[16]) {
+  QRgb palette[4];
+  GetBC1Palette(GetLittleEndian16(src), GetLittleEndian16(src + 2), palette);
+  uint32_t indices = uint32_t(GetLittleEndian16(src + 4)) |
+    (uint32_t(GetLittleEndian16(src + 6)) << 16);
+  for (int i = 0; i < 16; ++i) {
+    pixels[i] = palette[(indices >> (2 * i)) & 3];
+  }
+}
+
+double ComputePSNR(const QImage& a, const QImage& b) {
+  double squared_error = 0.0;
+  for (int y = 0; y < a.height(); ++y) {
+    const QRgb* row_a = reinterpret_cast<const QRgb*>(a.constScanLine(y));
+    const QRgb* row_b = reinterpret_cast<const QRgb*>(b.constScanLine(y));
+    for (int x = 0; x < a.width(); ++x) {
+      squared_error += double(ColorDistance(row_a[x], row_b[x]));
+    }
+  }
+  double mse = squared_error / (3.0 * a.width() * a.height());
+  if (mse == 0.0)
+    return 1000.0;
+  return 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+// Encodes the 4x4 image given as one row of 16 pixels and compares it to the expected bytes.
+bool CheckBlock(const char* name, TileTextureFormat format, const QRgb pixels[16],
+                const std::vector<uchar>& expected) {
+  QImage image(4, 4, QImage::Format_RGB32);
+  for (int y = 0; y < 4; ++y) {
+    memcpy(image.scanLine(y), pixels + 4 * y, 4 * sizeof(QRgb));
+  }
+  std::vector<uchar> encoded(size_t(EncodedTileBytes(format, image.size())));
+  EncodeTile(format, image, &encoded[0]);
+  bool passed = encoded.size() >= expected.size() &&
+    memcmp(&encoded[0], &expected[0], expected.size()) == 0;
+  printf("  %-6s %-28s %s\n", TileTextureFormatName(format), name, passed ? "ok" : "FAILED");
+  return passed;
+}
+
+QImage LoadTileImage(const std::string& image_file) {
+  QImage image(QString(image_file.c_str()));
+  if (image.isNull()) {
+    printf("Cannot load image %s.\n", image_file.c_str());
+    return image;
+  }
+  return image.convertToFormat(QImage::Format_RGB32);
+}
+
+}  // namespace
+
+const char* TileTextureFormatName(TileTextureFormat format) {
+  if (format < 0 || format >= TileTextureFormat_COUNT)
+    return "invalid";
+  return kFormatNames[format];
+}
+
+bool ParseTileTextureFormat(const std::string& name, TileTextureFormat* format) {
+  for (int i = 0; i < TileTextureFormat_COUNT; ++i) {
+    if (name == kFormatNames[i]) {
+      *format = TileTextureFormat(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool TileTextureFormatSupportsSize(TileTextureFormat format, QSize tile_size) {
+  if (tile_size.isEmpty())
+    return false;
+  if (format == TileTextureFormat_BC1)
+    return tile_size.width() % 4 == 0 && tile_size.height() % 4 == 0;
+  return true;
+}
+
+int EncodedTileBytes(TileTextureFormat format, QSize tile_size) {
+  int num_pixels = tile_size.width() * tile_size.height();
+  switch (format) {
+  case TileTextureFormat_RGB8:
+    return num_pixels * 3;
+  case TileTextureFormat_RGB565:
+    return num_pixels * 2;
+  case TileTextureFormat_BC1:
+    return (tile_size.width() / 4) * (tile_size.height() / 4) * 8;
+  default:
+    return num_pixels * 4;
+  }
+}
+
+QImage PadTileImage(const QImage& image, QSize tile_size) {
+  QImage tile_image = image;
+  if (tile_image.format() != QImage::Format_RGB32 &&
+      tile_image.format() != QImage::Format_ARGB32) {
+    tile_image = tile_image.convertToFormat(QImage::Format_RGB32);
+  }
+  if (tile_image.size() == tile_size)
+    return tile_image;
+
+  QImage padded(tile_size, tile_image.format());
+  padded.fill(Qt::black);
+  const int width = qMin(tile_image.width(), tile_size.width());
+  const int height = qMin(tile_image.height(), tile_size.height());
+  for (int y = 0; y < height; ++y) {
+    memcpy(padded.scanLine(y), tile_image.constScanLine(y), size_t(width) * 4);
+  }
+  return padded;
+}
+
+void EncodeTile(TileTextureFormat format, const QImage& image, uchar* dst) {
+  const int width = image.width();
+  const int height = image.height();
+  switch (format) {
+  case TileTextureFormat_RGB8:
+    for (int y = 0; y < height; ++y) {
+      const QRgb* row = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+      uchar* out = dst + y * width * 3;
+      for (int x = 0; x < width; ++x) {
+        out[3 * x] = uchar(qRed(row[x]));
+        out[3 * x + 1] = uchar(qGreen(row[x]));
+        out[3 * x + 2] = uchar(qBlue(row[x]));
+      }
+    }
+    break;
+  case TileTextureFormat_RGB565:
+    // GL_UNSIGNED_SHORT_5_6_5 reads shorts in the machine's byte order.
+    for (int y = 0; y < height; ++y) {
+      const QRgb* row = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+      uint16_t* out = reinterpret_cast<uint16_t*>(dst) + y * width;
+      for (int x = 0; x < width; ++x) {
+        out[x] = To565(qRed(row[x]), qGreen(row[x]), qBlue(row[x]));
+      }
+    }
+    break;
+  case TileTextureFormat_BC1:
+    for (int by = 0; by + 4 <= height; by += 4) {
+      for (int bx = 0; bx + 4 <= width; bx += 4) {
+        QRgb pixels[16];
+        for (int y = 0; y < 4; ++y) {
+          memcpy(pixels + 4 * y, image.constScanLine(by + y) + bx * sizeof(QRgb),
+                 4 * sizeof(QRgb));
+        }
+        EncodeBC1Block(pixels, dst);
+        dst += 8;
+      }
+    }
+    break;
+  default:
+    for (int y = 0; y < height; ++y) {
+      memcpy(dst + y * width * 4, image.constScanLine(y), size_t(width) * 4);
+    }
+    break;
+  }
+}
+
+QImage DecodeTile(TileTextureFormat format, const uchar* src, QSize tile_size) {
+  const int width = tile_size.width();
+  const int height = tile_size.height();
+  QImage image(tile_size, QImage::Format_RGB32);
+  switch (format) {
+  case TileTextureFormat_RGB8:
+    for (int y = 0; y < height; ++y) {
+      QRgb* row = reinterpret_cast<QRgb*>(image.scanLine(y));
+      const uchar* in = src + y * width * 3;
+      for (int x = 0; x < width; ++x) {
+        row[x] = qRgb(in[3 * x], in[3 * x + 1], in[3 * x + 2]);
+      }
+    }
+    break;
+  case TileTextureFormat_RGB565:
+    for (int y = 0; y < height; ++y) {
+      QRgb* row = reinterpret_cast<QRgb*>(image.scanLine(y));
+      const uint16_t* in = reinterpret_cast<const uint16_t*>(src) + y * width;
+      for (int x = 0; x < width; ++x) {
+        row[x] = From565(in[x]);
+      }
+    }
+    break;
+  case TileTextureFormat_BC1:
+    for (int by = 0; by + 4 <= height; by += 4) {
+      for (int bx = 0; bx + 4 <= width; bx += 4) {
+        QRgb pixels[16];
+        DecodeBC1Block(src, pixels);
+        for (int y = 0; y < 4; ++y) {
+          memcpy(image.scanLine(by + y) + bx * sizeof(QRgb), pixels + 4 * y, 4 * sizeof(QRgb));
+        }
+        src += 8;
+      }
+    }
+    break;
+  default:
+    for (int y = 0; y < height; ++y) {
+      memcpy(image.scanLine(y), src + y * width * 4, size_t(width) * 4);
+    }
+    break;
+  }
+  return image;
+}
+
+bool CheckTileEncoders() {
+  printf("Checking tile encoders against reference buffers:\n");
+  bool passed = true;
+
+  const QRgb white = qRgb(255, 255, 255);
+  const QRgb black = qRgb(0, 0, 0);
+  QRgb solid_red[16];
+  QRgb white_over_black[16];
+  QRgb gray_ramp[16];
+  QRgb primaries[16];
+  for (int i = 0; i < 16; ++i) {
+    solid_red[i] = qRgb(255, 0, 0);
+    white_over_black[i] = i < 8 ? white : black;
+    gray_ramp[i] = qRgb(85 * (i % 4), 85 * (i % 4), 85 * (i % 4));
+    primaries[i] = black;
+  }
+  primaries[0] = qRgb(255, 0, 0);
+  primaries[1] = qRgb(0, 255, 0);
+  primaries[2] = qRgb(0, 0, 255);
+  primaries[3] = qRgb(128, 128, 128);
+  primaries[4] = qRgb(0x12, 0x34, 0x56);
+
+  // Single color blocks have equal end points and all indices 0.
+  passed &= CheckBlock("solid red", TileTextureFormat_BC1, solid_red,
+                       { 0x00, 0xf8, 0x00, 0xf8, 0x00, 0x00, 0x00, 0x00 });
+  // End points white (index 0) and black (index 1).
+  passed &= CheckBlock("white over black", TileTextureFormat_BC1, white_over_black,
+                       { 0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x55, 0x55 });
+  // 0, 85, 170 and 255 are exactly the palette colors 1, 3, 2 and 0.
+  passed &= CheckBlock("gray ramp", TileTextureFormat_BC1, gray_ramp,
+                       { 0xff, 0xff, 0x00, 0x00, 0x2d, 0x2d, 0x2d, 0x2d });
+  uint16_t expected_565[5] = { 0xf800, 0x07e0, 0x001f, 0x8410, 0x11aa };
+  std::vector<uchar> expected_565_bytes(sizeof(expected_565));
+  memcpy(&expected_565_bytes[0], expected_565, sizeof(expected_565));
+  passed &= CheckBlock("primaries", TileTextureFormat_RGB565, primaries, expected_565_bytes);
+  passed &= CheckBlock("primaries", TileTextureFormat_RGB8, primaries,
+                       { 0xff, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0xff,
+                         0x80, 0x80, 0x80, 0x12, 0x34, 0x56 });
+  uint32_t expected_rgba8[5] = { 0xffff0000, 0xff00ff00, 0xff0000ff, 0xff808080, 0xff123456 };
+  std::vector<uchar> expected_rgba8_bytes(sizeof(expected_rgba8));
+  memcpy(&expected_rgba8_bytes[0], expected_rgba8, sizeof(expected_rgba8));
+  passed &= CheckBlock("primaries", TileTextureFormat_RGBA8, primaries, expected_rgba8_bytes);
+
+  // A smooth synthetic tile, like most of a photograph.
+  QImage tile(256, 256, QImage::Format_RGB32);
+  for (int y = 0; y < tile.height(); ++y) {
+    QRgb* row = reinterpret_cast<QRgb*>(tile.scanLine(y));
+    for (int x = 0; x < tile.width(); ++x) {
+      int wave = int(16.0 * std::sin(double(x + 2 * y) / 12.0));
+      row[x] = qRgb(qBound(0, x + wave, 255), qBound(0, y - wave, 255), (x + y) / 2);
+    }
+  }
+  for (int i = 0; i < TileTextureFormat_COUNT; ++i) {
+    TileTextureFormat format = TileTextureFormat(i);
+    std::vector<uchar> encoded(size_t(EncodedTileBytes(format, tile.size())));
+    EncodeTile(format, tile, &encoded[0]);
+    double psnr = ComputePSNR(tile, DecodeTile(format, &encoded[0], tile.size()));
+    bool format_passed = psnr >= kMinPSNR[i];
+    printf("  %-6s %-28s %s (%.1f dB, %d bytes)\n", TileTextureFormatName(format),
+           "round trip", format_passed ? "ok" : "FAILED", psnr, int(encoded.size()));
+    passed &= format_passed;
+  }
+
+  printf(passed ? "All tile encoder checks passed.\n" : "Tile encoder checks FAILED.\n");
+  return passed;
+}
+
+bool CheckTileEncoderAgainstReference(TileTextureFormat format, const std::string& image_file,
+                                      const std::string& reference_file) {
+  QImage image = LoadTileImage(image_file);
+  if (image.isNull())
+    return false;
+  if (!TileTextureFormatSupportsSize(format, image.size())) {
+    printf("Format %s does not support %d x %d tiles.\n", TileTextureFormatName(format),
+           image.width(), image.height());
+    return false;
+  }
+
+  QFile reference(QString(reference_file.c_str()));
+  if (!reference.open(QIODevice::ReadOnly)) {
+    printf("Cannot open reference file %s.\n", reference_file.c_str());
+    return false;
+  }
+  QByteArray expected = reference.readAll();
+  std::vector<uchar> encoded(size_t(EncodedTileBytes(format, image.size())));
+  EncodeTile(format, image, &encoded[0]);
+
+  if (size_t(expected.size()) != encoded.size()) {
+    printf("FAILED: %s encodes to %d bytes in %s, the reference has %d.\n", image_file.c_str(),
+           int(encoded.size()), TileTextureFormatName(format), int(expected.size()));
+    return false;
+  }
+  int num_different = 0;
+  int first_different = -1;
+  for (size_t i = 0; i < encoded.size(); ++i) {
+    if (encoded[i] != uchar(expected[int(i)])) {
+      if (first_different < 0) {
+        first_different = int(i);
+      }
+      num_different++;
+    }
+  }
+  if (num_different > 0) {
+    printf("FAILED: %d of %d bytes differ from %s, the first at offset %d.\n", num_different,
+           int(encoded.size()), reference_file.c_str(), first_different);
+    return false;
+  }
+  printf("%s encoded in %s matches %s.\n", image_file.c_str(), TileTextureFormatName(format),
+         reference_file.c_str());
+  return true;
+}
+
+bool EncodeTileFile(TileTextureFormat format, const std::string& image_file,
+                    const std::string& output_file) {
+  QImage image = LoadTileImage(image_file);
+  if (image.isNull())
+    return false;
+  if (!TileTextureFormatSupportsSize(format, image.size())) {
+    printf("Format %s does not support %d x %d tiles.\n", TileTextureFormatName(format),
+           image.width(), image.height());
+    return false;
+  }
+
+  std::vector<uchar> encoded(size_t(EncodedTileBytes(format, image.size())));
+  EncodeTile(format, image, &encoded[0]);
+  QFile output(QString(output_file.c_str()));
+  if (!output.open(QIODevice::WriteOnly) ||
+      output.write(reinterpret_cast<const char*>(&encoded[0]), qint64(encoded.size())) !=
+      qint64(encoded.size())) {
+    printf("Cannot write %s.\n", output_file.c_str());
+    return false;
+  }
+  printf("Wrote %s encoded in %s to %s (%d bytes).\n", image_file.c_str(),
+         TileTextureFormatName(format), output_file.c_str(), int(encoded.size()));
+  return true;
+}
@@ -0,0 +1,55 @@
+#ifndef GIGAPATCHEXPLORER_EXPLORER_TILEENCODER_H_
+#define GIGAPATCHEXPLORER_EXPLORER_TILEENCODER_H_
+
+#include <string>
+
+#include <QImage>
+#include <QSize>
+
+// Formats tiles can be stored in as textures. The tile sources have no alpha, so everything but
+// RGBA8 drops it.
+enum TileTextureFormat {
+  TileTextureFormat_RGBA8,   // 4 bytes per pixel, uploaded as BGRA (the decoder's layout).
+  TileTextureFormat_RGB8,    // 3 bytes per pixel. Saves upload bandwidth and system memory, but
+                             // most drivers pad it to 4 bytes in video memory.
+  TileTextureFormat_RGB565,  // 2 bytes per pixel.
+  TileTextureFormat_BC1,     // S3TC/DXT1 blocks, 0.5 bytes per pixel. Needs sizes that are
+                             // multiples of 4.
+  TileTextureFormat_COUNT
+};
+
+// Lower case name ("rgba8", "rgb8", "rgb565", "bc1") used in settings and on the command line.
+const char* TileTextureFormatName(TileTextureFormat format);
+// Returns false and leaves format unchanged if name is not a format name.
+bool ParseTileTextureFormat(const std::string& name, TileTextureFormat* format);
+bool TileTextureFormatSupportsSize(TileTextureFormat format, QSize tile_size);
+
+// Size in bytes of a tile of tile_size encoded in format. Rows are tightly packed.
+int EncodedTileBytes(TileTextureFormat format, QSize tile_size);
+
+// Converts image to RGB32 (or keeps ARGB32) and pads it with black to tile_size. Tiles at the
+// right and bottom border of a level may be smaller than the tile size, but are drawn at the
+// full tile size, so they must not be stretched.
+QImage PadTileImage(const QImage& image, QSize tile_size);
+
+// Encodes an image of format RGB32 or ARGB32 (whose size is the tile size) into dst, which must
+// have room for EncodedTileBytes(). The encoders are meant to run on the loader threads while
+// tiles are decoded: BC1 takes the bounding box of each block's colors as end points and picks
+// the nearest of the four palette colors for every pixel.
+void EncodeTile(TileTextureFormat format, const QImage& image, uchar* dst);
+// Decodes what EncodeTile() wrote back into an RGB32 image, as the GPU would sample it.
+QImage DecodeTile(TileTextureFormat format, const uchar* src, QSize tile_size);
+
+// Checks the encoders against reference buffers of hand-computed blocks and pixels, and checks
+// that round trips of a synthetic tile stay above a minimum PSNR. Needs no OpenGL context.
+// Prints the results and returns true if all checks pass.
+bool CheckTileEncoders();
+// Encodes the image file in format and compares the result byte by byte with the reference
+// file. Prints the result and returns true if they are equal.
+bool CheckTileEncoderAgainstReference(TileTextureFormat format, const std::string& image_file,
+                                      const std::string& reference_file);
+// Encodes the image file in format and writes the result, e.g. to create a reference file.
+bool EncodeTileFile(TileTextureFormat format, const std::string& image_file,
+                    const std::string& output_file);
+
+#endif  // GIGAPATCHEXPLORER_EXPLORER_TILEENCODER_H_
@@ -0,0 +1,299 @@
+#include <QBuffer>
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThread>
+
+#include "drawing/tileloader.h"
+
+class TileLoaderRunnable : public QRunnable {
+public:
+  TileLoaderRunnable(TileLoader *loader) : loader_(loader) {}
+  void run() Q_DECL_OVERRIDE { loader_->ProcessRequests(); }
+
+private:
+  TileLoader *loader_;
+};
+
+TileLoader::TileLoader(int num_workers, QObject *parent)
+    : QObject(parent),
+      current_epoch_(0),
+      active_workers_(0) {
+  SetNumWorkers(num_workers);
+}
+
+TileLoader::~TileLoader() {
+  CancelPendingRequests();
+  thread_pool_.waitForDone();
+}
+
+void TileLoader::SetNumWorkers(int num_workers) {
+  if (num_workers <= 0) {
+    num_workers = qMax(1, QThread::idealThreadCount());
+  }
+  thread_pool_.setMaxThreadCount(num_workers);
+
+  QMutexLocker locker(&mutex_);
+  StartWorkers();
+}
+
+void TileLoader::SetUploadRing(std::shared_ptr<PixelUploadRing> upload_ring) {
+  QMutexLocker locker(&mutex_);
+  upload_ring_ = upload_ring;
+}
+
+void TileLoader::RequestTiles(const std::vector<TileLoadRequest>& ranked_requests, int epoch) {
+  QMutexLocker locker(&mutex_);
+  const bool notify = loaded_.empty();
+  const bool new_epoch = epoch > current_epoch_;
+  if (new_epoch) {
+    current_epoch_ = epoch;
+    wanted_.clear();
+  }
+
+  TileKeySet old_pending;
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    old_pending.insert(pending_[i].request.key);
+  }
+
+  TileKeySet ranked;
+  std::deque<PendingTile> reordered;
+  bool taken_from_cache = false;
+  for (size_t i = 0; i < ranked_requests.size(); ++i) {
+    TileKey key = ranked_requests[i].key;
+    if (!ranked.insert(key).second)
+      continue;
+    wanted_.insert(key);
+    if (old_pending.count(key) > 0) {
+      stats_.reprioritized++;
+      reordered.push_back(PendingTile(ranked_requests[i], current_epoch_));
+    } else if (requested_.insert(key).second) {
+      stats_.requested++;
+      if (TakeFromDecodedTileCache(ranked_requests[i])) {
+        taken_from_cache = true;
+      } else {
+        reordered.push_back(PendingTile(ranked_requests[i], current_epoch_));
+      }
+    }
+  }
+
+  // Queued tiles that are not part of the new ranking are kept (behind it) only if they are
+  // still wanted in this epoch; obsolete ones are dropped before we waste time decoding them.
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    TileKey key = pending_[i].request.key;
+    if (ranked.count(key) > 0)
+      continue;
+    if (IsWanted(key, pending_[i].epoch)) {
+      reordered.push_back(pending_[i]);
+    } else {
+      requested_.erase(key);
+      stats_.dropped_before_decode++;
+    }
+  }
+  pending_.swap(reordered);
+
+  // Decoded tiles that nobody took yet would only evict useful textures from the cache.
+  if (new_epoch) {
+    std::vector<LoadedTile> still_wanted;
+    for (size_t i = 0; i < loaded_.size(); ++i) {
+      if (IsWanted(loaded_[i].key, loaded_[i].epoch)) {
+        still_wanted.push_back(loaded_[i]);
+      } else {
+        loaded_[i].Release();
+        requested_.erase(loaded_[i].key);
+        stats_.discarded_after_decode++;
+      }
+    }
+    loaded_.swap(still_wanted);
+  }
+
+  StartWorkers();
+  if (taken_from_cache && notify) {
+    locker.unlock();
+    emit TilesLoaded();
+  }
+}
+
+std::vector<LoadedTile> TileLoader::TakeLoadedTiles() {
+  QMutexLocker locker(&mutex_);
+  std::vector<LoadedTile> tiles;
+  tiles.swap(loaded_);
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    requested_.erase(tiles[i].key);
+  }
+  return tiles;
+}
+
+void TileLoader::CancelPendingRequests() {
+  QMutexLocker locker(&mutex_);
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    requested_.erase(pending_[i].request.key);
+  }
+  stats_.dropped_before_decode += pending_.size();
+  pending_.clear();
+}
+
+TileLoaderStats TileLoader::GetStats() {
+  QMutexLocker locker(&mutex_);
+  return stats_;
+}
+
+void TileLoader::ResetStats() {
+  QMutexLocker locker(&mutex_);
+  stats_ = TileLoaderStats();
+}
+
+void TileLoader::StartWorkers() {
+  while (active_workers_ < thread_pool_.maxThreadCount() &&
+         active_workers_ < int(pending_.size())) {
+    active_workers_++;
+    thread_pool_.start(new TileLoaderRunnable(this));
+  }
+}
+
+bool TileLoader::IsWanted(TileKey key, int epoch) {
+  return epoch >= current_epoch_ || wanted_.count(key) > 0;
+}
+
+bool TileLoader::TakeFromDecodedTileCache(const TileLoadRequest& request) {
+  if (decoded_tile_cache_ == nullptr)
+    return false;
+  QImage image = decoded_tile_cache_->Get(request.key);
+  if (image.isNull())
+    return false;
+
+  LoadedTile tile;
+  tile.key = request.key;
+  tile.image = std::make_shared<QImage>(image);
+  tile.epoch = current_epoch_;
+  loaded_.push_back(tile);
+  stats_.served_from_cache++;
+  return true;
+}
+
+void TileLoader::ProcessRequests() {
+  while (true) {
+    LoadedTile tile;
+    bool notify = false;
+    std::shared_ptr<TiledImageObject> source;
+    std::shared_ptr<PixelUploadRing> ring;
+    {
+      QMutexLocker locker(&mutex_);
+      if (pending_.empty()) {
+        active_workers_--;
+        return;
+      }
+      tile.key = pending_.front().request.key;
+      tile.epoch = pending_.front().epoch;
+      source = pending_.front().request.source;
+      ring = upload_ring_;
+      pending_.pop_front();
+    }
+
+    if (!DecodeTile(source.get(), ring, &tile)) {
+      printf("Warning! Cannot load image %s.\n", source->GetTileFilename(tile.key).c_str());
+    }
+
+    {
+      QMutexLocker locker(&mutex_);
+      stats_.decoded++;
+      if (tile.failed()) {
+        stats_.failed++;
+      } else if (source->IsSynthesizedLevel(tile.key.level())) {
+        stats_.synthesized++;
+      }
+      // The view may have moved on while we were decoding.
+      if (!IsWanted(tile.key, tile.epoch)) {
+        tile.Release();
+        requested_.erase(tile.key);
+        stats_.discarded_after_decode++;
+        continue;
+      }
+      notify = loaded_.empty();
+      loaded_.push_back(tile);
+    }
+    if (notify) {
+      emit TilesLoaded();
+    }
+  }
+}
+
+bool TileLoader::DecodeTile(TiledImageObject* source, std::shared_ptr<PixelUploadRing> ring,
+                            LoadedTile* tile) {
+  if (source->IsSynthesizedLevel(tile->key.level()) || source->storage() == TileStorage_RAW ||
+      source->storage() == TileStorage_TIFF)
+    return ReadTileFromSource(source, ring, tile);
+
+  // Packed tiles are decoded straight from the pack's mapping.
+  QByteArray packed_bytes;
+  QBuffer packed_buffer;
+  QImageReader reader;
+  if (source->storage() == TileStorage_PACK) {
+    const uchar* data = nullptr;
+    int length = 0;
+    if (!source->GetPackedTile(tile->key, &data, &length))
+      return false;
+    packed_bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(data), length);
+    packed_buffer.setBuffer(&packed_bytes);
+    packed_buffer.open(QIODevice::ReadOnly);
+    reader.setDevice(&packed_buffer);
+  } else {
+    reader.setFileName(QString::fromStdString(source->GetTileFilename(tile->key)));
+  }
+
+  int slot = ring != nullptr ? ring->AcquireSlot() : -1;
+  if (slot < 0) {
+    QImage image;
+    if (!reader.read(&image))
+      return false;
+    tile->image = std::make_shared<QImage>(image);
+    if (decoded_tile_cache_ != nullptr) {
+      decoded_tile_cache_->Insert(tile->key, *tile->image);
+    }
+    return true;
+  }
+
+  // The reader decodes into the target's memory, i.e. straight into the slot, if the target
+  // already has the size and format of the decoded tile. Otherwise (e.g. grayscale JPEGs,
+  // smaller border tiles, or slots of an encoded format) it allocates its own image, which we
+  // then convert and encode into the slot.
+  // With the decoded tile cache, which needs its own copy because the slot is recycled once the
+  // tile is uploaded, we decode into normal memory and only write to the slot: reading the tile
+  // back out of the write-combined mapping would be much slower.
+  const bool decode_in_place = ring->decodes_in_place() && decoded_tile_cache_ == nullptr;
+  QImage target = decode_in_place ? ring->SlotImage(slot) : QImage();
+  if (!reader.read(&target)) {
+    ring->ReleaseSlot(slot);
+    return false;
+  }
+  if (!decode_in_place || target.constBits() != ring->slot_data(slot)) {
+    ring->WriteImage(slot, target);
+  }
+  if (decoded_tile_cache_ != nullptr) {
+    decoded_tile_cache_->Insert(tile->key, target);
+  }
+  ring->FinishWriting(slot);
+  tile->ring = ring;
+  tile->ring_slot = slot;
+  return true;
+}
+
+bool TileLoader::ReadTileFromSource(TiledImageObject* source,
+                                    std::shared_ptr<PixelUploadRing> ring, LoadedTile* tile) {
+  QImage image;
+  if (!source->ReadTileImage(tile->key, &image))
+    return false;
+  int slot = ring != nullptr ? ring->AcquireSlot() : -1;
+  if (slot < 0) {
+    tile->image = std::make_shared<QImage>(image);
+  } else {
+    ring->WriteImage(slot, image);
+    ring->FinishWriting(slot);
+    tile->ring = ring;
+    tile->ring_slot = slot;
+  }
+  if (decoded_tile_cache_ != nullptr) {
+    decoded_tile_cache_->Insert(tile->key, image);
+  }
+  return true;
+}
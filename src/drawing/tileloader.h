@@ -0,0 +1,148 @@
+#ifndef GIGAPATCHEXPLORER_EXPLORER_TILELOADER_H_
+#define GIGAPATCHEXPLORER_EXPLORER_TILELOADER_H_
+
+#include <deque>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QThreadPool>
+
+#include "common.h"
+#include "drawing/decodedtilecache.h"
+#include "drawing/pixeluploadring.h"
+#include "imagesources/tiledimage.h"
+
+// Identifies a tile to load and the image it belongs to. The filename is only built by the
+// worker that reads the tile.
+struct TileLoadRequest {
+  TileKey key;
+  std::shared_ptr<TiledImageObject> source;
+  TileLoadRequest(TileKey _key, std::shared_ptr<TiledImageObject> _source)
+    : key(_key), source(_source) {}
+};
+
+// A tile that was read and decoded by a worker thread, waiting to be uploaded as a texture by the
+// thread that owns the OpenGL context. The pixels are either in a slot of a PixelUploadRing or,
+// if no slot was free, in an image.
+struct LoadedTile {
+  TileKey key;
+  std::shared_ptr<QImage> image;
+  std::shared_ptr<PixelUploadRing> ring;
+  int ring_slot;                  // -1 if the pixels are in image.
+  int epoch;                      // Epoch of the request that produced this tile.
+  LoadedTile() : ring_slot(-1), epoch(0) {}
+  bool failed() const { return image == nullptr && ring_slot < 0; }
+  // Gives the ring slot back without uploading it.
+  void Release() {
+    if (ring != nullptr) {
+      ring->ReleaseSlot(ring_slot);
+    }
+  }
+};
+
+// Counts how much work the loader did and how much it avoided by dropping obsolete requests.
+struct TileLoaderStats {
+  long long requested;               // Tiles queued for loading.
+  long long decoded;                 // Tiles read and decoded by the workers.
+  long long failed;                  // Tiles that could not be read or decoded.
+  long long dropped_before_decode;   // Obsolete queued requests removed before decoding.
+  long long discarded_after_decode;  // Obsolete tiles decoded but never handed out.
+  long long reprioritized;           // Queued requests that were moved in the queue.
+  long long served_from_cache;       // Requests served from the decoded tile cache.
+  long long synthesized;             // Decoded tiles of synthesized coarse levels.
+  TileLoaderStats()
+    : requested(0), decoded(0), failed(0), dropped_before_decode(0), discarded_after_decode(0),
+      reprioritized(0), served_from_cache(0), synthesized(0) {}
+};
+
+// Reads and decodes tile images on a pool of background worker threads so that the GUI/GL thread
+// never blocks on file I/O or JPEG decoding. Finished tiles are collected until the GL thread
+// takes them with TakeLoadedTiles(). TilesLoaded() is emitted (from a worker thread) when tiles
+// become available and none were waiting to be taken, so receivers living in the GUI thread get
+// one queued signal per batch rather than one per tile.
+//
+// Requests carry the epoch of the view they were made for. A new ranked request list with a
+// newer epoch replaces the queue: tiles missing from it are dropped before they are decoded, and
+// tiles that were already being decoded for an older epoch are discarded when they finish.
+//
+// With a DecodedTileCache, requested tiles that are in it are handed out right away without
+// queuing them, and every decoded tile is added to it.
+//
+// With a PixelUploadRing, workers decode tiles directly into free slots of the ring, in the pixel
+// format of the texture array, so the GL thread only has to start an asynchronous copy.
+class TileLoader : public QObject {
+  Q_OBJECT
+
+public:
+  // Uses QThread::idealThreadCount() workers when num_workers <= 0.
+  explicit TileLoader(int num_workers = 0, QObject *parent = 0);
+  ~TileLoader();
+
+  void SetNumWorkers(int num_workers);
+  int num_workers() { return thread_pool_.maxThreadCount(); }
+  // Set before requesting tiles. nullptr disables the decoded tile cache.
+  void SetDecodedTileCache(std::shared_ptr<DecodedTileCache> decoded_tile_cache) {
+    decoded_tile_cache_ = decoded_tile_cache;
+  }
+  // Ring to decode tiles into. nullptr makes workers decode into images.
+  void SetUploadRing(std::shared_ptr<PixelUploadRing> upload_ring);
+
+  // Replaces the queue with the given tiles, most important first. If epoch is newer than the
+  // current one, it becomes the current epoch and all tiles not in ranked_requests are
+  // considered obsolete.
+  void RequestTiles(const std::vector<TileLoadRequest>& ranked_requests, int epoch);
+  // Returns the tiles decoded since the last call. Must be called from the GL thread.
+  std::vector<LoadedTile> TakeLoadedTiles();
+  // Drops all queued (not yet started) requests.
+  void CancelPendingRequests();
+  TileLoaderStats GetStats();
+  void ResetStats();
+
+signals:
+  void TilesLoaded();
+
+private:
+  friend class TileLoaderRunnable;
+
+  struct PendingTile {
+    TileLoadRequest request;
+    int epoch;
+    PendingTile(const TileLoadRequest& _request, int _epoch) : request(_request), epoch(_epoch) {}
+  };
+
+  // Worker thread loop: decodes queued tiles until the queue is empty.
+  void ProcessRequests();
+  // Starts as many workers as there are queued tiles, up to the pool size. Expects mutex_ locked.
+  void StartWorkers();
+  // True if a tile requested in the given epoch is still needed. Expects mutex_ locked.
+  bool IsWanted(TileKey key, int epoch);
+  // Hands out the tile right away if it is in the decoded tile cache. Expects mutex_ locked.
+  bool TakeFromDecodedTileCache(const TileLoadRequest& request);
+  // Reads and decodes the tile's file (or its bytes in a tile pack), into a slot of the ring if
+  // one is free. Returns false if the tile cannot be read.
+  bool DecodeTile(TiledImageObject* source, std::shared_ptr<PixelUploadRing> ring,
+                  LoadedTile* tile);
+  // Has the source read tiles that are not encoded files, i.e. tiles of synthesized coarse
+  // levels (see TiledImageObject::SynthesizeTile()) and tiles of raw and TIFF images, and hands
+  // them out like decoded tiles.
+  bool ReadTileFromSource(TiledImageObject* source, std::shared_ptr<PixelUploadRing> ring,
+                          LoadedTile* tile);
+
+  QThreadPool thread_pool_;
+  std::shared_ptr<DecodedTileCache> decoded_tile_cache_;
+  QMutex mutex_;                                // Guards everything below.
+  std::shared_ptr<PixelUploadRing> upload_ring_;
+  std::deque<PendingTile> pending_;             // Tiles waiting for a worker.
+  TileKeySet requested_;                        // Pending, in flight, or loaded but not taken.
+  TileKeySet wanted_;                           // Tiles requested in the current epoch.
+  std::vector<LoadedTile> loaded_;
+  int current_epoch_;
+  int active_workers_;
+  TileLoaderStats stats_;
+};
+
+#endif  // GIGAPATCHEXPLORER_EXPLORER_TILELOADER_H_
@@ -0,0 +1,173 @@
+#include <QOpenGLContext>
+
+#include "drawing/tiletexturearray.h"
+
+#ifndef GL_BGRA
+#define GL_BGRA 0x80E1
+#endif
+#ifndef GL_RGB565
+#define GL_RGB565 0x8D62
+#endif
+#ifndef GL_UNSIGNED_SHORT_5_6_5
+#define GL_UNSIGNED_SHORT_5_6_5 0x8363
+#endif
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+namespace {
+
+// How the layers of each TileTextureFormat are stored and uploaded.
+struct TextureFormatGL {
+  GLenum internal_format;
+  GLenum pixel_format;  // Unused for compressed formats.
+  GLenum pixel_type;    // Unused for compressed formats.
+  bool compressed;
+};
+
+const TextureFormatGL kTextureFormatsGL[TileTextureFormat_COUNT] = {
+  { GL_RGBA8, GL_BGRA, GL_UNSIGNED_BYTE, false },
+  { GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE, false },
+  { GL_RGB565, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, false },
+  { GL_COMPRESSED_RGB_S3TC_DXT1_EXT, 0, 0, true }
+};
+
+}  // namespace
+
+TileTextureArray::TileTextureArray()
+    : gl_(nullptr),
+      texture_id_(0),
+      format_(TileTextureFormat_RGBA8),
+      num_layers_(0) {}
+
+TileTextureArray::~TileTextureArray() {
+  Destroy();
+}
+
+bool TileTextureArray::Create(QSize tile_size, TileTextureFormat format, int num_layers) {
+  Destroy();
+  QOpenGLContext* context = QOpenGLContext::currentContext();
+  if (context == nullptr || tile_size.isEmpty())
+    return false;
+
+  if (format == TileTextureFormat_BC1 &&
+      (!context->hasExtension("GL_EXT_texture_compression_s3tc") ||
+       !TileTextureFormatSupportsSize(format, tile_size))) {
+    printf("Warning! BC1 textures are not supported for %d x %d tiles; using RGB565.\n",
+           tile_size.width(), tile_size.height());
+    format = TileTextureFormat_RGB565;
+  }
+
+  gl_ = context->extraFunctions();
+  tile_size_ = tile_size;
+  format_ = format;
+  // Immutable storage cannot grow later, so if the driver cannot give us all layers we settle
+  // for fewer rather than none.
+  for (num_layers = qBound(1, num_layers, max_layers()); num_layers >= 1; num_layers /= 2) {
+    texture_id_ = AllocateTexture(num_layers);
+    if (texture_id_ != 0) {
+      num_layers_ = num_layers;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TileTextureArray::Destroy() {
+  if (texture_id_ != 0 && QOpenGLContext::currentContext() != nullptr) {
+    gl_->glDeleteTextures(1, &texture_id_);
+  }
+  texture_id_ = 0;
+  num_layers_ = 0;
+}
+
+void TileTextureArray::Upload(int layer, const QImage& image) {
+  if (!IsCreated() || layer < 0 || layer >= num_layers_ || image.isNull())
+    return;
+
+  // Tiles are decoded as 32 bit (A)RGB, which is BGRA in memory on little endian machines, so
+  // RGBA8 tiles need no encoding.
+  QImage tile_image = PadTileImage(image, tile_size_);
+
+  if (format_ == TileTextureFormat_RGBA8) {
+    TexSubImage(layer, tile_image.constBits());
+  } else {
+    encode_buffer_.resize(size_t(bytes_per_layer()));
+    EncodeTile(format_, tile_image, &encode_buffer_[0]);
+    TexSubImage(layer, &encode_buffer_[0]);
+  }
+}
+
+void TileTextureArray::UploadFromBuffer(int layer, GLuint buffer_id, size_t offset) {
+  if (!IsCreated() || layer < 0 || layer >= num_layers_)
+    return;
+
+  gl_->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_id);
+  TexSubImage(layer, reinterpret_cast<const void*>(offset));
+  gl_->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void TileTextureArray::TexSubImage(int layer, const void* pixels) {
+  const TextureFormatGL& format_gl = kTextureFormatsGL[format_];
+  gl_->glBindTexture(GL_TEXTURE_2D_ARRAY, texture_id_);
+  // RGB8 rows are not 4 byte aligned for all tile widths.
+  gl_->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  if (format_gl.compressed) {
+    gl_->glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, tile_size_.width(),
+                                   tile_size_.height(), 1, format_gl.internal_format,
+                                   GLsizei(bytes_per_layer()), pixels);
+  } else {
+    gl_->glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, tile_size_.width(),
+                         tile_size_.height(), 1, format_gl.pixel_format, format_gl.pixel_type,
+                         pixels);
+  }
+  gl_->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  gl_->glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void TileTextureArray::Bind(GLuint unit) {
+  gl_->glActiveTexture(GL_TEXTURE0 + unit);
+  gl_->glBindTexture(GL_TEXTURE_2D_ARRAY, texture_id_);
+}
+
+void TileTextureArray::Release(GLuint unit) {
+  gl_->glActiveTexture(GL_TEXTURE0 + unit);
+  gl_->glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  gl_->glActiveTexture(GL_TEXTURE0);
+}
+
+int TileTextureArray::max_layers() {
+  GLint max_layers = 256;  // Minimum guaranteed by OpenGL 3.0.
+  if (gl_ != nullptr) {
+    gl_->glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+  }
+  return int(max_layers);
+}
+
+GLuint TileTextureArray::AllocateTexture(int num_layers) {
+  // Clear stale errors so that we only check the allocation below.
+  while (gl_->glGetError() != GL_NO_ERROR) {}
+
+  GLuint texture_id = 0;
+  gl_->glGenTextures(1, &texture_id);
+  gl_->glBindTexture(GL_TEXTURE_2D_ARRAY, texture_id);
+  // No mipmaps: tiles of the current level are drawn at 0.7x to 1.4x their size (levels switch
+  // at half levels), cached children in place of missing tiles at 0.35x to 0.7x, and ancestors
+  // magnified, which linear filtering handles. Mipmaps would have to be built for every layer on
+  // upload.
+  gl_->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  gl_->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  gl_->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  gl_->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  gl_->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+  gl_->glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, kTextureFormatsGL[format_].internal_format,
+                      tile_size_.width(), tile_size_.height(), num_layers);
+  gl_->glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  if (gl_->glGetError() != GL_NO_ERROR) {
+    printf("Warning! Cannot allocate a tile texture array with %d layers.\n", num_layers);
+    gl_->glDeleteTextures(1, &texture_id);
+    return 0;
+  }
+  return texture_id;
+}
@@ -0,0 +1,65 @@
+#ifndef GIGAPATCHEXPLORER_EXPLORER_TILETEXTUREARRAY_H_
+#define GIGAPATCHEXPLORER_EXPLORER_TILETEXTUREARRAY_H_
+
+#include <vector>
+
+#include <QImage>
+#include <QOpenGLExtraFunctions>
+#include <QSize>
+
+#include "drawing/tileencoder.h"
+
+// Holds equally sized tile images in the layers of a single 2D array texture, so that tiles of
+// any level can be drawn together with one instanced draw call (see DrawTile). Which layer holds
+// which tile is up to the owner (see QTextureCache). All functions need a current OpenGL context.
+//
+// The texture has immutable storage (glTexStorage3D) that is allocated once for all layers, so
+// tiles are only ever written into existing layers with glTexSubImage3D and the driver never has
+// to allocate or free texture memory while browsing.
+//
+// Layers hold tiles in one TileTextureFormat. Data uploaded from a buffer must already be
+// encoded in it (see EncodeTile()); images are encoded on upload.
+class TileTextureArray {
+public:
+  TileTextureArray();
+  ~TileTextureArray();
+
+  // Allocates num_layers layers of tile_size (clamped to max_layers()), or fewer if the driver
+  // runs out of memory. BC1 falls back to RGB565 if the driver or the tile size does not
+  // support it; format() tells what was used. Destroys any previous texture. Returns false if
+  // the texture could not be created at all.
+  bool Create(QSize tile_size, TileTextureFormat format, int num_layers);
+  void Destroy();
+  bool IsCreated() { return texture_id_ != 0; }
+
+  // Copies the image into the layer. Smaller images (border tiles) are padded with black.
+  void Upload(int layer, const QImage& image);
+  // Copies an encoded tile of bytes_per_layer() bytes from a pixel unpack buffer into the layer.
+  // The copy runs asynchronously on the GPU.
+  void UploadFromBuffer(int layer, GLuint buffer_id, size_t offset);
+  void Bind(GLuint unit);
+  void Release(GLuint unit);
+
+  GLuint texture_id() { return texture_id_; }
+  QSize tile_size() { return tile_size_; }
+  TileTextureFormat format() { return format_; }
+  int num_layers() { return num_layers_; }
+  // Maximum number of layers supported by the driver.
+  int max_layers();
+  long long bytes_per_layer() { return EncodedTileBytes(format_, tile_size_); }
+
+private:
+  // Allocates an uninitialized texture with num_layers layers and returns its id.
+  GLuint AllocateTexture(int num_layers);
+  // Writes an encoded tile into the layer. pixels is an offset if a pixel unpack buffer is bound.
+  void TexSubImage(int layer, const void* pixels);
+
+  QOpenGLExtraFunctions* gl_;
+  GLuint texture_id_;
+  QSize tile_size_;
+  TileTextureFormat format_;
+  int num_layers_;
+  std::vector<uchar> encode_buffer_;  // Reused by Upload() for formats other than RGBA8.
+};
+
+#endif  // GIGAPATCHEXPLORER_EXPLORER_TILETEXTUREARRAY_H_
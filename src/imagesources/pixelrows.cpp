@@ -0,0 +1,74 @@
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GIGAPATCHEXPLORER_PIXELROWS_SSE2
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+
+#include "imagesources/pixelrows.h"
+
+void ConvertRowToRgb32(const uchar* src, int width, int channels, bool min_is_white, uchar* dst) {
+  QRgb* out = reinterpret_cast<QRgb*>(dst);
+  if (channels < 3) {
+    const int invert = min_is_white ? 255 : 0;
+    for (int x = 0; x < width; ++x) {
+      int gray = src[x * channels] ^ invert;
+      out[x] = qRgb(gray, gray, gray);
+    }
+    return;
+  }
+  for (int x = 0; x < width; ++x, src += channels) {
+    out[x] = qRgb(src[0], src[1], src[2]);
+  }
+}
+
+void Downsample2x2Row(const uchar* row0, const uchar* row1, int src_width, uchar* dst) {
+  const int dst_width = (src_width + 1) / 2;
+  const int full_pairs = src_width / 2;
+  int x = 0;
+#ifdef GIGAPATCHEXPLORER_PIXELROWS_SSE2
+  // 4 source pixels of both rows per step: widen to 16 bits, add the rows, add neighbouring
+  // pixels and round.
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  for (; x + 2 <= full_pairs; x += 2) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + x * 8));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + x * 8));
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    __m128i sum = _mm_unpacklo_epi64(lo, hi);
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x * 4), _mm_packus_epi16(sum, zero));
+  }
+#endif
+  for (; x < full_pairs; ++x) {
+    const uchar* a = row0 + x * 8;
+    const uchar* b = row1 + x * 8;
+    for (int c = 0; c < 4; ++c) {
+      dst[x * 4 + c] = uchar((a[c] + a[c + 4] + b[c] + b[c + 4] + 2) >> 2);
+    }
+  }
+  if (dst_width > full_pairs) {
+    const uchar* a = row0 + full_pairs * 8;
+    const uchar* b = row1 + full_pairs * 8;
+    for (int c = 0; c < 4; ++c) {
+      dst[full_pairs * 4 + c] = uchar((2 * a[c] + 2 * b[c] + 2) >> 2);
+    }
+  }
+}
+
+QImage Downsample2x2(const QImage& src) {
+  QImage source = src;
+  if (source.format() != QImage::Format_RGB32 && source.format() != QImage::Format_ARGB32)
+    source = source.convertToFormat(QImage::Format_RGB32);
+  const int height = source.height();
+  QImage dst((source.width() + 1) / 2, (height + 1) / 2, source.format());
+  for (int y = 0; y < dst.height(); ++y) {
+    const uchar* row0 = source.constScanLine(2 * y);
+    const uchar* row1 = source.constScanLine(std::min(2 * y + 1, height - 1));
+    Downsample2x2Row(row0, row1, source.width(), dst.scanLine(y));
+  }
+  return dst;
+}
@@ -0,0 +1,20 @@
+#ifndef GIGAPATCHEXPLORER_IMAGE_PIXELROWS_H_
+#define GIGAPATCHEXPLORER_IMAGE_PIXELROWS_H_
+
+#include <QImage>
+
+// Converts a row of 8-bit pixels with 1 or 2 (gray), 3 (RGB) or more interleaved channels to
+// RGB32. Channels past gray or RGB (e.g. alpha) are dropped. min_is_white inverts gray values.
+void ConvertRowToRgb32(const uchar* src, int width, int channels, bool min_is_white, uchar* dst);
+
+// Averages 2x2 pixel blocks of two source rows into one row of (src_width + 1) / 2 pixels. Rows
+// have 4 bytes per pixel (RGB32 or ARGB32) and every channel is averaged with rounding. For odd
+// widths the last column is averaged with itself; pass the same row twice for the last row of an
+// odd height. Uses SSE2 where available.
+void Downsample2x2Row(const uchar* row0, const uchar* row1, int src_width, uchar* dst);
+
+// Halves an RGB32 image (sizes rounded up) by averaging 2x2 pixel blocks. Other formats are
+// converted to RGB32 first.
+QImage Downsample2x2(const QImage& src);
+
+#endif  // GIGAPATCHEXPLORER_IMAGE_PIXELROWS_H_
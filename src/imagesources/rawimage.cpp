@@ -0,0 +1,140 @@
+#include "LargeRAWFile.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+#include "imagesources/pixelrows.h"
+#include "imagesources/rawimage.h"
+
+namespace {
+
+const char* kRawPixelTypeNames[RawPixelType_COUNT] = { "gray8", "rgb8", "rgba8", "gray16" };
+
+}  // namespace
+
+int RawImageFormat::bytes_per_pixel() const {
+  switch (pixel_type) {
+    case RawPixelType_RGB8: return 3;
+    case RawPixelType_RGBA8: return 4;
+    case RawPixelType_GRAY16: return 2;
+    default: return 1;
+  }
+}
+
+bool ParseRawImageFormat(const std::string& text, RawImageFormat* format) {
+  std::stringstream s(text);
+  RawImageFormat parsed;
+  std::string type;
+  if (!(s >> parsed.width >> parsed.height >> type) || parsed.width <= 0 || parsed.height <= 0)
+    return false;
+  if (!(s >> parsed.header_bytes))
+    parsed.header_bytes = 0;
+  if (parsed.header_bytes < 0)
+    return false;
+
+  std::string bits;
+  size_t colon = type.find(':');
+  if (colon != std::string::npos) {
+    bits = type.substr(colon + 1);
+    type = type.substr(0, colon);
+  }
+  int t = 0;
+  while (t < RawPixelType_COUNT && type != kRawPixelTypeNames[t])
+    ++t;
+  if (t == RawPixelType_COUNT)
+    return false;
+  parsed.pixel_type = RawPixelType(t);
+  if (!bits.empty()) {
+    parsed.significant_bits = std::atoi(bits.c_str());
+    if (parsed.pixel_type != RawPixelType_GRAY16 || parsed.significant_bits < 8 ||
+        parsed.significant_bits > 16)
+      return false;
+  }
+  *format = parsed;
+  return true;
+}
+
+std::string RawImageFormatToString(const RawImageFormat& format) {
+  std::stringstream s;
+  s << format.width << " " << format.height << " " << kRawPixelTypeNames[format.pixel_type];
+  if (format.pixel_type == RawPixelType_GRAY16 && format.significant_bits != 16)
+    s << ":" << format.significant_bits;
+  s << " " << format.header_bytes;
+  return s.str();
+}
+
+RawImageFile::RawImageFile() : data_(nullptr) {}
+
+RawImageFile::~RawImageFile() {
+  Close();
+}
+
+bool RawImageFile::Open(const std::string& filename, const RawImageFormat& format) {
+  Close();
+  // LargeRAWFile reads through a single file position, which the loader threads would have to
+  // take turns on; it only checks the file here, and the pixels are read from a mapping.
+  IVDA::LargeRAWFile raw_file(filename);
+  if (!raw_file.Open(false)) {
+    printf("ERROR: Cannot open raw image %s.\n", filename.c_str());
+    return false;
+  }
+  const uint64_t file_size = raw_file.GetCurrentSize();
+  raw_file.Close();
+  const uint64_t needed_size = uint64_t(format.header_bytes) +
+    uint64_t(format.width) * uint64_t(format.height) * uint64_t(format.bytes_per_pixel());
+  if (file_size < needed_size) {
+    printf("ERROR: %s has %llu bytes, but %s needs %llu.\n", filename.c_str(),
+           (unsigned long long)file_size, RawImageFormatToString(format).c_str(),
+           (unsigned long long)needed_size);
+    return false;
+  }
+
+  file_.setFileName(QString::fromStdString(filename));
+  if (!file_.open(QIODevice::ReadOnly)) {
+    printf("ERROR: Cannot open raw image %s.\n", filename.c_str());
+    return false;
+  }
+  data_ = file_.map(0, qint64(needed_size));
+  if (data_ == nullptr) {
+    printf("ERROR: Cannot map raw image %s.\n", filename.c_str());
+    file_.close();
+    return false;
+  }
+  format_ = format;
+  printf("\nRaw image %s mapped: %s.\n", filename.c_str(), RawImageFormatToString(format).c_str());
+  return true;
+}
+
+void RawImageFile::Close() {
+  if (data_ != nullptr)
+    file_.unmap(const_cast<uchar*>(data_));
+  if (file_.isOpen())
+    file_.close();
+  data_ = nullptr;
+}
+
+bool RawImageFile::ReadRegion(int64_t x, int64_t y, int width, int height, QImage* image) const {
+  if (!is_open() || x < 0 || y < 0 || width <= 0 || height <= 0 ||
+      x + width > format_.width || y + height > format_.height)
+    return false;
+
+  const int bytes_per_pixel = format_.bytes_per_pixel();
+  const int shift = format_.significant_bits - 8;
+  *image = QImage(width, height, QImage::Format_RGB32);
+  for (int r = 0; r < height; ++r) {
+    const uchar* src = data_ + format_.header_bytes +
+      ((y + r) * format_.width + x) * bytes_per_pixel;
+    uchar* dst = image->scanLine(r);
+    if (format_.pixel_type != RawPixelType_GRAY16) {
+      ConvertRowToRgb32(src, width, bytes_per_pixel, false, dst);
+      continue;
+    }
+    QRgb* out = reinterpret_cast<QRgb*>(dst);
+    for (int i = 0; i < width; ++i) {
+      int value = std::min(255, (src[2 * i] | (src[2 * i + 1] << 8)) >> shift);
+      out[i] = qRgb(value, value, value);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,61 @@
+#ifndef GIGAPATCHEXPLORER_IMAGE_RAWIMAGE_H_
+#define GIGAPATCHEXPLORER_IMAGE_RAWIMAGE_H_
+
+#include <cstdint>
+#include <string>
+
+#include <QFile>
+#include <QImage>
+
+enum RawPixelType {
+  RawPixelType_GRAY8,
+  RawPixelType_RGB8,
+  RawPixelType_RGBA8,
+  RawPixelType_GRAY16,   // Little endian; shown scaled by significant_bits.
+  RawPixelType_COUNT
+};
+
+// Layout of a flat raw image file: a header of header_bytes, then the pixels row by row.
+struct RawImageFormat {
+  int64_t width;
+  int64_t height;
+  RawPixelType pixel_type;
+  int64_t header_bytes;
+  int significant_bits;  // Bits used by RawPixelType_GRAY16 pixels, e.g. 12 for 12-bit sensors.
+  RawImageFormat()
+      : width(0), height(0), pixel_type(RawPixelType_GRAY8), header_bytes(0),
+        significant_bits(16) {}
+  int bytes_per_pixel() const;
+};
+
+// Parses "<width> <height> <gray8|rgb8|rgba8|gray16[:bits]> [<header bytes>]", e.g.
+// "50000 50000 gray16:12 512". Returns false and leaves format unchanged if text is invalid.
+bool ParseRawImageFormat(const std::string& text, RawImageFormat* format);
+// The inverse of ParseRawImageFormat().
+std::string RawImageFormatToString(const RawImageFormat& format);
+
+// A flat raw image file that is memory mapped, so that any number of threads can cut regions out
+// of it at the same time without reading more than the region's rows.
+class RawImageFile {
+public:
+  RawImageFile();
+  ~RawImageFile();
+
+  // Checks that the file is large enough for format and maps it. Prints the reason and returns
+  // false otherwise.
+  bool Open(const std::string& filename, const RawImageFormat& format);
+  void Close();
+  bool is_open() const { return data_ != nullptr; }
+  const RawImageFormat& format() const { return format_; }
+
+  // Converts the region of width x height pixels at (x, y) into an RGB32 image. The region must
+  // be inside the image. Thread-safe.
+  bool ReadRegion(int64_t x, int64_t y, int width, int height, QImage* image) const;
+
+private:
+  QFile file_;
+  const uchar* data_;   // The mapping of the whole file.
+  RawImageFormat format_;
+};
+
+#endif  // GIGAPATCHEXPLORER_IMAGE_RAWIMAGE_H_
@@ -0,0 +1,436 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <set>
+
+#include <QBuffer>
+#include <QImageReader>
+#include <QtEndian>
+
+#include "imagesources/pixelrows.h"
+#include "imagesources/tiffreader.h"
+
+namespace {
+
+enum TiffTag {
+  TiffTag_NEW_SUBFILE_TYPE = 254,
+  TiffTag_IMAGE_WIDTH = 256,
+  TiffTag_IMAGE_LENGTH = 257,
+  TiffTag_BITS_PER_SAMPLE = 258,
+  TiffTag_COMPRESSION = 259,
+  TiffTag_PHOTOMETRIC = 262,
+  TiffTag_STRIP_OFFSETS = 273,
+  TiffTag_SAMPLES_PER_PIXEL = 277,
+  TiffTag_ROWS_PER_STRIP = 278,
+  TiffTag_STRIP_BYTE_COUNTS = 279,
+  TiffTag_PLANAR_CONFIG = 284,
+  TiffTag_PREDICTOR = 317,
+  TiffTag_TILE_WIDTH = 322,
+  TiffTag_TILE_LENGTH = 323,
+  TiffTag_TILE_OFFSETS = 324,
+  TiffTag_TILE_BYTE_COUNTS = 325,
+  TiffTag_JPEG_TABLES = 347
+};
+
+enum TiffCompression {
+  TiffCompression_NONE = 1,
+  TiffCompression_JPEG = 7,
+  TiffCompression_DEFLATE = 8,
+  TiffCompression_DEFLATE_OLD = 32946
+};
+
+// Size in bytes of one value of a TIFF field type; 0 for unknown types.
+int TiffTypeSize(int type) {
+  switch (type) {
+    case 1: case 2: case 6: case 7: return 1;  // BYTE, ASCII, SBYTE, UNDEFINED
+    case 3: case 8: return 2;                  // SHORT, SSHORT
+    case 4: case 9: case 11: case 13: return 4;  // LONG, SLONG, FLOAT, IFD
+    case 5: case 10: case 12: case 16: case 17: case 18: return 8;  // RATIONAL, ..., IFD8
+    default: return 0;
+  }
+}
+
+// Splices the shared tables into an abbreviated JPEG stream, so that it can be decoded on its
+// own. For RGB (rather than YCbCr) data an Adobe marker tells the decoder not to convert colors.
+QByteArray CompleteJpegStream(const QByteArray& tables, const QByteArray& chunk, bool rgb) {
+  static const char kAdobeRgbMarker[16] = {
+    '\xFF', '\xEE', 0, 14, 'A', 'd', 'o', 'b', 'e', 0, 100, 0, 0, 0, 0, 0
+  };
+  if (chunk.size() < 2)
+    return chunk;
+  QByteArray stream;
+  stream.reserve(tables.size() + chunk.size() + int(sizeof(kAdobeRgbMarker)));
+  stream.append(chunk.constData(), 2);  // SOI
+  if (rgb)
+    stream.append(kAdobeRgbMarker, int(sizeof(kAdobeRgbMarker)));
+  if (tables.size() > 4)
+    stream.append(tables.constData() + 2, tables.size() - 4);  // Without SOI and EOI.
+  stream.append(chunk.constData() + 2, chunk.size() - 2);
+  return stream;
+}
+
+}  // namespace
+
+TiffDirectory::TiffDirectory()
+    : width(0),
+      height(0),
+      tile_width(0),
+      tile_height(0),
+      rows_per_strip(0),
+      samples_per_pixel(1),
+      bits_per_sample(1),
+      compression(TiffCompression_NONE),
+      photometric(1),
+      planar_config(1),
+      predictor(1),
+      subfile_type(0) {}
+
+TiffReader::TiffReader()
+    :
+#ifdef _WIN32
+      handle_(INVALID_HANDLE_VALUE),
+#else
+      fd_(-1),
+#endif
+      file_size_(0),
+      big_endian_(false),
+      bigtiff_(false) {}
+
+TiffReader::~TiffReader() {
+  Close();
+}
+
+bool TiffReader::is_open() const {
+#ifdef _WIN32
+  return handle_ != INVALID_HANDLE_VALUE;
+#else
+  return fd_ >= 0;
+#endif
+}
+
+bool TiffReader::Open(const std::string& filename) {
+  Close();
+#ifdef _WIN32
+  handle_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+  LARGE_INTEGER size;
+  if (handle_ != INVALID_HANDLE_VALUE && GetFileSizeEx(handle_, &size))
+    file_size_ = uint64_t(size.QuadPart);
+#else
+  fd_ = open(filename.c_str(), O_RDONLY);
+  struct stat info;
+  if (fd_ >= 0 && fstat(fd_, &info) == 0)
+    file_size_ = uint64_t(info.st_size);
+#endif
+  if (!is_open()) {
+    printf("ERROR: Cannot open TIFF file %s.\n", filename.c_str());
+    return false;
+  }
+
+  uchar header[16];
+  if (!ReadBytes(0, 8, reinterpret_cast<char*>(header)) ||
+      !((header[0] == 'I' && header[1] == 'I') || (header[0] == 'M' && header[1] == 'M'))) {
+    printf("ERROR: %s is not a TIFF file.\n", filename.c_str());
+    Close();
+    return false;
+  }
+  big_endian_ = header[0] == 'M';
+  uint16_t version = Get16(header + 2);
+  uint64_t offset = 0;
+  if (version == 42) {
+    bigtiff_ = false;
+    offset = Get32(header + 4);
+  } else if (version == 43 && ReadBytes(0, 16, reinterpret_cast<char*>(header)) &&
+             Get16(header + 4) == 8) {
+    bigtiff_ = true;
+    offset = Get64(header + 8);
+  } else {
+    printf("ERROR: %s is not a TIFF or BigTIFF file.\n", filename.c_str());
+    Close();
+    return false;
+  }
+
+  // Directories form a linked list; guard against loops in damaged files.
+  std::set<uint64_t> visited;
+  while (offset != 0 && visited.insert(offset).second) {
+    TiffDirectory dir;
+    uint64_t next_offset = 0;
+    if (!ReadDirectory(offset, &dir, &next_offset)) {
+      printf("ERROR: Cannot read directory %d of %s.\n", int(directories_.size()),
+             filename.c_str());
+      Close();
+      return false;
+    }
+    directories_.push_back(dir);
+    offset = next_offset;
+  }
+  if (directories_.empty()) {
+    printf("ERROR: %s has no images.\n", filename.c_str());
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void TiffReader::Close() {
+#ifdef _WIN32
+  if (handle_ != INVALID_HANDLE_VALUE)
+    CloseHandle(handle_);
+  handle_ = INVALID_HANDLE_VALUE;
+#else
+  if (fd_ >= 0)
+    close(fd_);
+  fd_ = -1;
+#endif
+  file_size_ = 0;
+  directories_.clear();
+}
+
+bool TiffReader::ReadBytes(uint64_t offset, size_t count, char* dst) const {
+  if (!is_open() || offset > file_size_ || count > file_size_ - offset)
+    return false;
+  while (count > 0) {
+#ifdef _WIN32
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = DWORD(offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = DWORD(offset >> 32);
+    DWORD to_read = DWORD(std::min<size_t>(count, 1 << 30));
+    DWORD num_read = 0;
+    if (!ReadFile(handle_, dst, to_read, &num_read, &overlapped) || num_read == 0)
+      return false;
+#else
+    ssize_t num_read = pread(fd_, dst, count, off_t(offset));
+    if (num_read <= 0)
+      return false;
+#endif
+    offset += uint64_t(num_read);
+    dst += num_read;
+    count -= size_t(num_read);
+  }
+  return true;
+}
+
+bool TiffReader::ReadDirectory(uint64_t offset, TiffDirectory* dir, uint64_t* next_offset) {
+  const int count_bytes = bigtiff_ ? 8 : 2;
+  const int entry_bytes = bigtiff_ ? 20 : 12;
+  const int value_bytes = bigtiff_ ? 8 : 4;
+  uchar count_field[8];
+  if (!ReadBytes(offset, count_bytes, reinterpret_cast<char*>(count_field)))
+    return false;
+  uint64_t num_entries = bigtiff_ ? Get64(count_field) : Get16(count_field);
+  if (num_entries > 4096)
+    return false;
+  std::vector<uchar> entries(size_t(num_entries * entry_bytes + value_bytes));
+  if (!ReadBytes(offset + count_bytes, entries.size(), reinterpret_cast<char*>(entries.data())))
+    return false;
+  const uchar* next = entries.data() + num_entries * entry_bytes;
+  *next_offset = bigtiff_ ? Get64(next) : Get32(next);
+
+  bool has_rows_per_strip = false;
+  for (uint64_t i = 0; i < num_entries; ++i) {
+    const uchar* entry = entries.data() + i * entry_bytes;
+    int tag = Get16(entry);
+    int type = Get16(entry + 2);
+    uint64_t count = bigtiff_ ? Get64(entry + 4) : Get32(entry + 4);
+    const uchar* value_field = entry + (bigtiff_ ? 12 : 8);
+    if (tag == TiffTag_JPEG_TABLES) {
+      if (!ReadEntryBytes(type, count, value_field, &dir->jpeg_tables))
+        return false;
+      continue;
+    }
+
+    std::vector<uint64_t> values;
+    switch (tag) {
+      case TiffTag_NEW_SUBFILE_TYPE: case TiffTag_IMAGE_WIDTH: case TiffTag_IMAGE_LENGTH:
+      case TiffTag_BITS_PER_SAMPLE: case TiffTag_COMPRESSION: case TiffTag_PHOTOMETRIC:
+      case TiffTag_SAMPLES_PER_PIXEL: case TiffTag_ROWS_PER_STRIP: case TiffTag_PLANAR_CONFIG:
+      case TiffTag_PREDICTOR: case TiffTag_TILE_WIDTH: case TiffTag_TILE_LENGTH:
+      case TiffTag_STRIP_OFFSETS: case TiffTag_STRIP_BYTE_COUNTS: case TiffTag_TILE_OFFSETS:
+      case TiffTag_TILE_BYTE_COUNTS:
+        if (!ReadEntryValues(type, count, value_field, &values) || values.empty())
+          return false;
+        break;
+      default:
+        continue;
+    }
+    switch (tag) {
+      case TiffTag_NEW_SUBFILE_TYPE: dir->subfile_type = uint32_t(values[0]); break;
+      case TiffTag_IMAGE_WIDTH: dir->width = int64_t(values[0]); break;
+      case TiffTag_IMAGE_LENGTH: dir->height = int64_t(values[0]); break;
+      case TiffTag_BITS_PER_SAMPLE: dir->bits_per_sample = int(values[0]); break;
+      case TiffTag_COMPRESSION: dir->compression = int(values[0]); break;
+      case TiffTag_PHOTOMETRIC: dir->photometric = int(values[0]); break;
+      case TiffTag_SAMPLES_PER_PIXEL: dir->samples_per_pixel = int(values[0]); break;
+      case TiffTag_PLANAR_CONFIG: dir->planar_config = int(values[0]); break;
+      case TiffTag_PREDICTOR: dir->predictor = int(values[0]); break;
+      case TiffTag_TILE_WIDTH: dir->tile_width = int(values[0]); break;
+      case TiffTag_TILE_LENGTH: dir->tile_height = int(values[0]); break;
+      case TiffTag_ROWS_PER_STRIP:
+        dir->rows_per_strip = int(std::min<uint64_t>(values[0], 1u << 30));
+        has_rows_per_strip = true;
+        break;
+      case TiffTag_STRIP_OFFSETS: case TiffTag_TILE_OFFSETS:
+        dir->chunk_offsets.swap(values);
+        break;
+      case TiffTag_STRIP_BYTE_COUNTS: case TiffTag_TILE_BYTE_COUNTS:
+        dir->chunk_byte_counts.swap(values);
+        break;
+    }
+  }
+
+  if (dir->width <= 0 || dir->height <= 0)
+    return false;
+  if (!has_rows_per_strip || dir->rows_per_strip <= 0 || dir->rows_per_strip > dir->height)
+    dir->rows_per_strip = int(std::min<int64_t>(dir->height, 1 << 30));
+  if (dir->tiled() && dir->tile_height <= 0)
+    return false;
+  // Planar images have one set of chunks per sample.
+  uint64_t num_chunks = uint64_t(dir->chunks_across()) * uint64_t(dir->chunks_down());
+  if (dir->planar_config == 2)
+    num_chunks *= uint64_t(dir->samples_per_pixel);
+  return dir->chunk_offsets.size() >= num_chunks && dir->chunk_byte_counts.size() >= num_chunks;
+}
+
+bool TiffReader::ReadEntryValues(int type, uint64_t count, const uchar* value_field,
+                                 std::vector<uint64_t>* values) {
+  const int size = TiffTypeSize(type);
+  if (size == 0 || count > (uint64_t(1) << 32))
+    return false;
+  const bool integer = type == 1 || type == 3 || type == 4 || type == 13 || type == 16 ||
+    type == 18;
+  if (!integer)
+    return true;
+
+  const uint64_t num_bytes = count * size;
+  std::vector<uchar> external;
+  const uchar* data = value_field;
+  if (num_bytes > uint64_t(bigtiff_ ? 8 : 4)) {
+    external.resize(size_t(num_bytes));
+    uint64_t offset = bigtiff_ ? Get64(value_field) : Get32(value_field);
+    if (!ReadBytes(offset, external.size(), reinterpret_cast<char*>(external.data())))
+      return false;
+    data = external.data();
+  }
+  values->resize(size_t(count));
+  for (uint64_t i = 0; i < count; ++i) {
+    const uchar* p = data + i * size;
+    switch (size) {
+      case 1: (*values)[i] = p[0]; break;
+      case 2: (*values)[i] = Get16(p); break;
+      case 4: (*values)[i] = Get32(p); break;
+      default: (*values)[i] = Get64(p); break;
+    }
+  }
+  return true;
+}
+
+bool TiffReader::ReadEntryBytes(int type, uint64_t count, const uchar* value_field,
+                                QByteArray* bytes) {
+  const int size = TiffTypeSize(type);
+  if (size != 1 || count > (uint64_t(1) << 24))
+    return false;
+  if (count <= uint64_t(bigtiff_ ? 8 : 4)) {
+    *bytes = QByteArray(reinterpret_cast<const char*>(value_field), int(count));
+    return true;
+  }
+  bytes->resize(int(count));
+  uint64_t offset = bigtiff_ ? Get64(value_field) : Get32(value_field);
+  return ReadBytes(offset, size_t(count), bytes->data());
+}
+
+uint16_t TiffReader::Get16(const uchar* p) const {
+  return big_endian_ ? qFromBigEndian<quint16>(p) : qFromLittleEndian<quint16>(p);
+}
+
+uint32_t TiffReader::Get32(const uchar* p) const {
+  return big_endian_ ? qFromBigEndian<quint32>(p) : qFromLittleEndian<quint32>(p);
+}
+
+uint64_t TiffReader::Get64(const uchar* p) const {
+  return big_endian_ ? qFromBigEndian<quint64>(p) : qFromLittleEndian<quint64>(p);
+}
+
+bool TiffReader::CanDecode(const TiffDirectory& dir, std::string* reason) {
+  if (dir.bits_per_sample != 8) {
+    *reason = "only 8 bits per sample are supported";
+    return false;
+  }
+  if (dir.planar_config != 1 && dir.samples_per_pixel > 1) {
+    *reason = "planar images are not supported";
+    return false;
+  }
+  if (dir.compression == TiffCompression_JPEG)
+    return true;
+  if (dir.compression != TiffCompression_NONE && dir.compression != TiffCompression_DEFLATE &&
+      dir.compression != TiffCompression_DEFLATE_OLD) {
+    *reason = "compression " + std::to_string(dir.compression) + " is not supported";
+    return false;
+  }
+  if (dir.photometric > 2) {
+    *reason = "photometric interpretation " + std::to_string(dir.photometric) +
+      " is not supported without JPEG compression";
+    return false;
+  }
+  return true;
+}
+
+bool TiffReader::DecodeChunk(const TiffDirectory& dir, int cx, int cy, QImage* image) const {
+  if (cx < 0 || cy < 0 || cx >= dir.chunks_across() || cy >= dir.chunks_down() ||
+      dir.decoded_chunk_bytes() > kTiffMaxDecodedChunkBytes)
+    return false;
+  const size_t index = size_t(cy) * dir.chunks_across() + cx;
+  const uint64_t byte_count = dir.chunk_byte_counts[index];
+  if (byte_count == 0 || byte_count > (uint64_t(1) << 30))
+    return false;
+  QByteArray chunk(int(byte_count), Qt::Uninitialized);
+  if (!ReadBytes(dir.chunk_offsets[index], size_t(byte_count), chunk.data()))
+    return false;
+
+  const int width = dir.chunk_width();
+  const int height = dir.tiled() ? dir.tile_height :
+    int(std::min<int64_t>(dir.rows_per_strip, dir.height - int64_t(cy) * dir.rows_per_strip));
+
+  if (dir.compression == TiffCompression_JPEG) {
+    QByteArray stream = CompleteJpegStream(dir.jpeg_tables, chunk, dir.photometric == 2);
+    QBuffer buffer(&stream);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer, "jpg");
+    QImage decoded;
+    if (!reader.read(&decoded))
+      return false;
+    *image = decoded.convertToFormat(QImage::Format_RGB32);
+    return true;
+  }
+
+  const int channels = dir.samples_per_pixel;
+  const int row_bytes = width * channels;
+  const int num_bytes = row_bytes * height;  // Fits: the chunk is at most 256 MB as RGB32.
+  if (dir.compression != TiffCompression_NONE) {
+    // qUncompress() takes zlib data prefixed with the (big endian) uncompressed size.
+    QByteArray prefixed(4, Qt::Uninitialized);
+    qToBigEndian<quint32>(quint32(num_bytes), reinterpret_cast<uchar*>(prefixed.data()));
+    prefixed.append(chunk);
+    chunk = qUncompress(prefixed);
+  }
+  if (chunk.size() < num_bytes)
+    return false;
+
+  uchar* samples = reinterpret_cast<uchar*>(chunk.data());
+  *image = QImage(width, height, QImage::Format_RGB32);
+  for (int y = 0; y < height; ++y) {
+    uchar* row = samples + size_t(y) * row_bytes;
+    if (dir.predictor == 2) {
+      for (int i = channels; i < row_bytes; ++i)
+        row[i] = uchar(row[i] + row[i - channels]);
+    }
+    ConvertRowToRgb32(row, width, channels, dir.photometric == 0, image->scanLine(y));
+  }
+  return true;
+}
@@ -0,0 +1,92 @@
+#ifndef GIGAPATCHEXPLORER_IMAGE_TIFFREADER_H_
+#define GIGAPATCHEXPLORER_IMAGE_TIFFREADER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <QByteArray>
+#include <QImage>
+
+// Largest chunk DecodeChunk() decodes, in bytes of RGB32 pixels. Strips of compressed images are
+// decoded whole, and some files store the whole image in a single strip.
+const int64_t kTiffMaxDecodedChunkBytes = int64_t(256) << 20;
+
+// One image file directory (IFD) of a TIFF file, i.e. one image: the full resolution image, a
+// pyramid level, a thumbnail, or a mask. Pixels are stored in chunks, which are tiles or (in
+// untiled images) strips of rows_per_strip full rows.
+struct TiffDirectory {
+  int64_t width;
+  int64_t height;
+  int tile_width;              // 0 for images stored in strips.
+  int tile_height;
+  int rows_per_strip;
+  int samples_per_pixel;
+  int bits_per_sample;
+  int compression;             // 1 none, 7 JPEG, 8 or 32946 deflate, ...
+  int photometric;             // 0 min-is-white, 1 min-is-black, 2 RGB, 6 YCbCr, ...
+  int planar_config;           // 1 interleaved (chunky), 2 planar.
+  int predictor;               // 1 none, 2 horizontal differencing.
+  uint32_t subfile_type;       // Bit 0 is set for reduced resolution images.
+  std::vector<uint64_t> chunk_offsets;
+  std::vector<uint64_t> chunk_byte_counts;
+  QByteArray jpeg_tables;      // Tables shared by the JPEG compressed chunks, if any.
+
+  TiffDirectory();
+  bool tiled() const { return tile_width > 0; }
+  int chunk_width() const { return tiled() ? tile_width : int(width); }
+  int chunk_height() const { return tiled() ? tile_height : rows_per_strip; }
+  int chunks_across() const { return int((width + chunk_width() - 1) / chunk_width()); }
+  int chunks_down() const { return int((height + chunk_height() - 1) / chunk_height()); }
+  int64_t decoded_chunk_bytes() const { return int64_t(chunk_width()) * chunk_height() * 4; }
+};
+
+// Reads the directories of a TIFF or BigTIFF file once, and then the chunks of its images with
+// positioned reads, so that any number of threads can read at the same time without sharing a
+// file position. Chunks can be decoded if they have 8 bits per sample, are interleaved, and are
+// uncompressed, deflate compressed, or JPEG compressed.
+class TiffReader {
+public:
+  TiffReader();
+  ~TiffReader();
+
+  // Opens the file and reads all its directories. Prints the reason and returns false if the
+  // file cannot be read or is not a TIFF file.
+  bool Open(const std::string& filename);
+  void Close();
+  bool is_open() const;
+  bool bigtiff() const { return bigtiff_; }
+  const std::vector<TiffDirectory>& directories() const { return directories_; }
+
+  // Returns true if DecodeChunk() can decode the directory's chunks, otherwise false and why.
+  static bool CanDecode(const TiffDirectory& dir, std::string* reason);
+
+  // Reads count bytes at offset. Thread-safe.
+  bool ReadBytes(uint64_t offset, size_t count, char* dst) const;
+  // Reads and decodes chunk (cx, cy) of dir into an RGB32 image of the chunk size. Strips at the
+  // bottom of the image have only the remaining rows. Fails for chunks larger than
+  // kTiffMaxDecodedChunkBytes. Thread-safe.
+  bool DecodeChunk(const TiffDirectory& dir, int cx, int cy, QImage* image) const;
+
+private:
+  bool ReadDirectory(uint64_t offset, TiffDirectory* dir, uint64_t* next_offset);
+  // Reads the integer values of an IFD entry (whose value field is at value_field).
+  bool ReadEntryValues(int type, uint64_t count, const uchar* value_field,
+                       std::vector<uint64_t>* values);
+  bool ReadEntryBytes(int type, uint64_t count, const uchar* value_field, QByteArray* bytes);
+  uint16_t Get16(const uchar* p) const;
+  uint32_t Get32(const uchar* p) const;
+  uint64_t Get64(const uchar* p) const;
+
+#ifdef _WIN32
+  void* handle_;
+#else
+  int fd_;
+#endif
+  uint64_t file_size_;
+  bool big_endian_;
+  bool bigtiff_;
+  std::vector<TiffDirectory> directories_;
+};
+
+#endif  // GIGAPATCHEXPLORER_IMAGE_TIFFREADER_H_
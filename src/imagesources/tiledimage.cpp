@@ -1,14 +1,74 @@
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <sstream>
 
+#include <QBuffer>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QSaveFile>
+
+#include "imagesources/pixelrows.h"
+#include "imagesources/rawimage.h"
+#include "imagesources/tiffreader.h"
 #include "imagesources/tiledimage.h"
+#include "imagesources/tilepack.h"
+
+// Quality of the synthesized tiles in the coarse level cache.
+const int kCoarseTileJpegQuality = 90;
+
+int TiledImageObject::next_source_id_ = 0;
+
+namespace {
+
+bool IsTiffFile(const std::string& filename) {
+  char magic[4] = { 0, 0, 0, 0 };
+  std::ifstream f(filename.c_str(), std::ios::binary);
+  f.read(magic, 4);
+  return (magic[0] == 'I' && magic[1] == 'I' && (magic[2] == 42 || magic[2] == 43) &&
+          magic[3] == 0) ||
+    (magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0 && (magic[3] == 42 || magic[3] == 43));
+}
 
-TiledImageObject::TiledImageObject() {}
+// Returns k if dir is the image at full reduced by 2^k (allowing for either rounding of the
+// sizes), else -1.
+int TiffReductionLevel(const TiffDirectory& full, const TiffDirectory& dir) {
+  for (int k = 0; k < 31 && (full.width >> k) > 0; ++k) {
+    const int64_t scale = int64_t(1) << k;
+    if (std::abs(dir.width - full.width / scale) <= 1 &&
+        std::abs(dir.height - full.height / scale) <= 1)
+      return k;
+  }
+  return -1;
+}
+
+}  // namespace
+
+TiledImageObject::TiledImageObject()
+    : storage_(TileStorage_FILES),
+      num_added_levels_(0),
+      source_id_(next_source_id_++ & ((1 << TileKey::kSourceBits) - 1)) {}
 
 TiledImageObject::~TiledImageObject() {}
 
 bool TiledImageObject::Init(std::string sourceDir) {
+  if (QFileInfo(QString::fromStdString(sourceDir)).isFile()) {
+    if (IsTiffFile(sourceDir))
+      return InitTiff(sourceDir);
+    pack_ = std::make_shared<TilePack>();
+    if (!pack_->Open(sourceDir, &params_)) {
+      pack_ = nullptr;
+      return false;
+    }
+    storage_ = TileStorage_PACK;
+    CompletePyramid();
+    return true;
+  }
+
+  storage_ = TileStorage_FILES;
   params_.source_dir = sourceDir;
 
   std::stringstream ss;
@@ -70,6 +130,7 @@ bool TiledImageObject::Init(std::string sourceDir) {
   }
 
   f.close();
+  CompletePyramid();
 
   printf("\nTiledImageObject created from %s with tile size %d x %d,"
          "%d levels, and %d total tiles.\n",
@@ -78,9 +139,355 @@ bool TiledImageObject::Init(std::string sourceDir) {
   return true;
 }
 
+bool TiledImageObject::InitRaw(const std::string& filename, const RawImageFormat& format,
+                               Size2DInt tile_size) {
+  raw_image_ = std::make_shared<RawImageFile>();
+  if (!raw_image_->Open(filename, format)) {
+    raw_image_ = nullptr;
+    return false;
+  }
+  storage_ = TileStorage_RAW;
+  Size2DInt imgres(int(format.width), int(format.height));
+  Size2DInt tileres((imgres.width + tile_size.width - 1) / tile_size.width,
+                    (imgres.height + tile_size.height - 1) / tile_size.height);
+  params_ = TiledImageParams();
+  params_.source_dir = filename;
+  params_.tile_size = tile_size;
+  params_.num_levels = 1;
+  params_.imgres_per_level.push_back(imgres);
+  params_.tileres_per_level.push_back(tileres);
+  params_.total_num_tiles = tileres.width * tileres.height;
+  CompletePyramid();
+  return true;
+}
+
+bool TiledImageObject::InitTiff(const std::string& filename) {
+  tiff_ = std::make_shared<TiffReader>();
+  if (!tiff_->Open(filename)) {
+    tiff_ = nullptr;
+    return false;
+  }
+
+  // The finest level is the largest tiled image we can decode. Masks (subfile type bit 2) and
+  // images in strips (thumbnails, labels) are skipped.
+  const std::vector<TiffDirectory>& dirs = tiff_->directories();
+  std::string reason;
+  int full = -1;
+  for (int d = 0; d < int(dirs.size()); ++d) {
+    if (!dirs[d].tiled() || (dirs[d].subfile_type & 4) != 0 ||
+        !TiffReader::CanDecode(dirs[d], &reason))
+      continue;
+    if (full < 0 || dirs[d].width > dirs[full].width)
+      full = d;
+  }
+  if (full < 0) {
+    printf("ERROR: %s has no tiled image that can be decoded%s%s.\n", filename.c_str(),
+           reason.empty() ? "" : ": ", reason.c_str());
+    tiff_ = nullptr;
+    return false;
+  }
+  const TiffDirectory& full_dir = dirs[full];
+  if (full_dir.width > (1 << 30) || full_dir.height > (1 << 30)) {
+    printf("ERROR: %s is too large.\n", filename.c_str());
+    tiff_ = nullptr;
+    return false;
+  }
+
+  params_ = TiledImageParams();
+  params_.source_dir = filename;
+  params_.tile_size = Size2DInt(full_dir.tile_width, full_dir.tile_height);
+  // All levels down to the one that fits into a single tile, finest first.
+  std::vector<Size2DInt> imgres;
+  Size2DInt res(int(full_dir.width), int(full_dir.height));
+  imgres.push_back(res);
+  while (res.width > params_.tile_size.width || res.height > params_.tile_size.height) {
+    res = Size2DInt((res.width + 1) / 2, (res.height + 1) / 2);
+    imgres.push_back(res);
+  }
+  params_.num_levels = int(imgres.size());
+  tiff_directory_per_level_.assign(params_.num_levels, -1);
+  tiff_directory_per_level_[params_.num_levels - 1] = full;
+
+  int num_tiff_levels = 1;
+  for (int d = 0; d < int(dirs.size()); ++d) {
+    const TiffDirectory& dir = dirs[d];
+    if (d == full || !dir.tiled() || (dir.subfile_type & 4) != 0 ||
+        dir.tile_width != full_dir.tile_width || dir.tile_height != full_dir.tile_height ||
+        !TiffReader::CanDecode(dir, &reason))
+      continue;
+    const int k = TiffReductionLevel(full_dir, dir);
+    const int level = params_.num_levels - 1 - k;
+    if (k <= 0 || level < 0 || tiff_directory_per_level_[level] >= 0)
+      continue;
+    tiff_directory_per_level_[level] = d;
+    imgres[k] = Size2DInt(int(dir.width), int(dir.height));
+    num_tiff_levels++;
+  }
+
+  params_.total_num_tiles = 0;
+  for (int l = 0; l < params_.num_levels; ++l) {
+    Size2DInt level_res = imgres[params_.num_levels - 1 - l];
+    Size2DInt tileres((level_res.width + params_.tile_size.width - 1) / params_.tile_size.width,
+                      (level_res.height + params_.tile_size.height - 1) / params_.tile_size.height);
+    params_.imgres_per_level.push_back(level_res);
+    params_.tileres_per_level.push_back(tileres);
+    params_.total_num_tiles += tileres.width * tileres.height;
+  }
+  printf("\n%s %s: %lld x %lld, tiles of %d x %d, %d of %d levels in the file.\n",
+         tiff_->bigtiff() ? "BigTIFF" : "TIFF", filename.c_str(), (long long)full_dir.width,
+         (long long)full_dir.height, params_.tile_size.width, params_.tile_size.height,
+         num_tiff_levels, params_.num_levels);
+  storage_ = TileStorage_TIFF;
+  CompletePyramid();
+  return true;
+}
+
+void TiledImageObject::CompletePyramid() {
+  num_added_levels_ = 0;
+  level_is_synthesized_.clear();
+  coarse_cache_dir_.clear();
+  if (params_.num_levels <= 0)
+    return;
+
+  // Add halved levels until the whole image fits into a single tile.
+  Size2DInt imgres = params_.imgres_per_level[0];
+  while (imgres.width > params_.tile_size.width || imgres.height > params_.tile_size.height) {
+    imgres = Size2DInt((imgres.width + 1) / 2, (imgres.height + 1) / 2);
+    Size2DInt tileres((imgres.width + params_.tile_size.width - 1) / params_.tile_size.width,
+                      (imgres.height + params_.tile_size.height - 1) / params_.tile_size.height);
+    params_.imgres_per_level.insert(params_.imgres_per_level.begin(), imgres);
+    params_.tileres_per_level.insert(params_.tileres_per_level.begin(), tileres);
+    params_.total_num_tiles += tileres.width * tileres.height;
+    num_added_levels_++;
+  }
+  params_.num_levels += num_added_levels_;
+
+  // A level counts as stored if its first tile is. Missing levels above the finest stored level
+  // are synthesized; below it there is nothing to synthesize them from.
+  level_is_synthesized_.assign(params_.num_levels, 0);
+  int finest_stored_level = -1;
+  int num_synthesized = 0;
+  for (int l = params_.num_levels - 1; l >= 0; --l) {
+    bool stored = false;
+    if (l >= num_added_levels_) {
+      const uchar* data = nullptr;
+      int length = 0;
+      if (storage_ == TileStorage_PACK)
+        stored = pack_->GetTile(l - num_added_levels_, 0, 0, &data, &length);
+      else if (storage_ == TileStorage_RAW)
+        stored = true;
+      else if (storage_ == TileStorage_TIFF)
+        stored = tiff_directory_per_level_[l - num_added_levels_] >= 0;
+      else
+        stored = QFileInfo::exists(QString::fromStdString(GetTileFilename(l, 0, 0)));
+    }
+    if (stored && finest_stored_level < 0) {
+      finest_stored_level = l;
+    } else if (!stored && finest_stored_level > l) {
+      level_is_synthesized_[l] = 1;
+      num_synthesized++;
+    }
+  }
+  if (num_synthesized == 0)
+    return;
+
+  // Next to the source if possible, else in the temporary directory.
+  coarse_cache_dir_ = storage_ == TileStorage_FILES ? params_.source_dir + "/_coarse_levels" :
+    params_.source_dir + ".coarse";
+  if (!QDir().mkpath(QString::fromStdString(coarse_cache_dir_))) {
+    QString name = QString("GigaPatchExplorer-coarse-%1")
+      .arg(qHash(QString::fromStdString(params_.source_dir)));
+    coarse_cache_dir_ = QDir::temp().filePath(name).toStdString();
+    QDir().mkpath(QString::fromStdString(coarse_cache_dir_));
+  }
+  ValidateCoarseCache();
+  printf("%d coarse levels (%d not listed in the source) are synthesized on demand, cached in "
+         "%s.\n", num_synthesized, num_added_levels_, coarse_cache_dir_.c_str());
+}
+
+std::string TiledImageObject::CoarseCacheStamp() {
+  QFileInfo source(QString::fromStdString(storage_ == TileStorage_FILES ?
+                                          params_.source_dir + "/_info.txt" : params_.source_dir));
+  std::stringstream stamp;
+  stamp << "source " << params_.source_dir << "\n"
+        << "size " << source.size() << "\n"
+        << "modified " << source.lastModified().toMSecsSinceEpoch() << "\n"
+        << "tiles " << params_.tile_size.width << " " << params_.tile_size.height << "\n";
+  // The same raw file shows a different image with a different layout.
+  if (storage_ == TileStorage_RAW)
+    stamp << "raw " << RawImageFormatToString(raw_image_->format()) << "\n";
+  return stamp.str();
+}
+
+void TiledImageObject::ValidateCoarseCache() {
+  const std::string stamp_filename = coarse_cache_dir_ + "/_source.txt";
+  const std::string stamp = CoarseCacheStamp();
+  std::ifstream in(stamp_filename.c_str());
+  if (in.is_open()) {
+    std::stringstream cached_stamp;
+    cached_stamp << in.rdbuf();
+    if (cached_stamp.str() == stamp)
+      return;
+    in.close();
+  }
+
+  QDir dir(QString::fromStdString(coarse_cache_dir_));
+  QStringList stale_tiles = dir.entryList(QStringList("*.jpg"), QDir::Files);
+  for (const QString& tile : stale_tiles) {
+    dir.remove(tile);
+  }
+  if (!stale_tiles.isEmpty()) {
+    printf("Removed %d cached coarse tiles of a different or older source.\n",
+           int(stale_tiles.size()));
+  }
+  std::ofstream out(stamp_filename.c_str());
+  out << stamp;
+}
+
+bool TiledImageObject::GetPackedTile(TileKey key, const uchar** data, int* length) {
+  if (pack_ == nullptr)
+    return false;
+  return pack_->GetTile(key.level() - num_added_levels_, key.tx(), key.ty(), data, length);
+}
+
+bool TiledImageObject::ReadTileImage(int level, int tx, int ty, QImage* image) {
+  if (IsSynthesizedLevel(level))
+    return SynthesizeTile(GetTileKey(level, tx, ty), image);
+  return ReadStoredTile(level, tx, ty, image);
+}
+
+bool TiledImageObject::ReadStoredTile(int level, int tx, int ty, QImage* image) {
+  if (storage_ == TileStorage_RAW) {
+    const Size2DInt tile_size = params_.tile_size;
+    const Size2DInt imgres = params_.imgres_per_level[level];
+    const int64_t x = int64_t(tx) * tile_size.width;
+    const int64_t y = int64_t(ty) * tile_size.height;
+    const int width = int(std::min<int64_t>(tile_size.width, imgres.width - x));
+    const int height = int(std::min<int64_t>(tile_size.height, imgres.height - y));
+    QImage region;
+    if (!raw_image_->ReadRegion(x, y, width, height, &region))
+      return false;
+    if (width == tile_size.width && height == tile_size.height) {
+      *image = region;
+      return true;
+    }
+    // Border tiles are padded with black to the tile size, as in the Gigapan layout.
+    *image = QImage(tile_size.width, tile_size.height, QImage::Format_RGB32);
+    image->fill(Qt::black);
+    for (int r = 0; r < height; ++r) {
+      memcpy(image->scanLine(r), region.constScanLine(r), size_t(width) * 4);
+    }
+    return true;
+  }
+  if (storage_ == TileStorage_TIFF) {
+    // Tiles at the right and bottom border are padded to the tile size in the file already.
+    const int d = tiff_directory_per_level_[level - num_added_levels_];
+    return tiff_->DecodeChunk(tiff_->directories()[d], tx, ty, image);
+  }
+  if (storage_ == TileStorage_FILES)
+    return QImageReader(QString::fromStdString(GetTileFilename(level, tx, ty))).read(image);
+
+  const uchar* data = nullptr;
+  int length = 0;
+  if (!GetPackedTile(GetTileKey(level, tx, ty), &data, &length))
+    return false;
+  QByteArray bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(data), length);
+  QBuffer buffer(&bytes);
+  buffer.open(QIODevice::ReadOnly);
+  return QImageReader(&buffer).read(image);
+}
+
+bool TiledImageObject::SynthesizeTile(TileKey key, QImage* image) {
+  const int level = key.level();
+  const int tx = key.tx();
+  const int ty = key.ty();
+  if (!IsSynthesizedLevel(level) || level + 1 >= params_.num_levels)
+    return false;
+
+  QString cache_filename = QString::fromStdString(GetTileFilename(level, tx, ty));
+  if (QFileInfo::exists(cache_filename) && QImageReader(cache_filename).read(image))
+    return true;
+
+  {
+    QMutexLocker locker(&synthesis_mutex_);
+    while (tiles_being_synthesized_.count(key) > 0) {
+      synthesis_done_.wait(&synthesis_mutex_);
+    }
+    tiles_being_synthesized_.insert(key);
+  }
+  // The thread we waited for has usually cached the tile; if its children were unreadable, we
+  // try again ourselves.
+  bool ok = QFileInfo::exists(cache_filename) && QImageReader(cache_filename).read(image);
+  if (!ok)
+    ok = ComputeSynthesizedTile(key, image);
+
+  QMutexLocker locker(&synthesis_mutex_);
+  tiles_being_synthesized_.erase(key);
+  synthesis_done_.wakeAll();
+  return ok;
+}
+
+bool TiledImageObject::ComputeSynthesizedTile(TileKey key, QImage* image) {
+  const int level = key.level();
+  const int tx = key.tx();
+  const int ty = key.ty();
+
+  // The four children cover twice the tile size at the next finer level. Like stored tiles,
+  // border tiles keep the full tile size and are padded with black beyond the image.
+  const Size2DInt tile_size = params_.tile_size;
+  const Size2DInt child_tileres = params_.tileres_per_level[level + 1];
+  if (2 * tx >= child_tileres.width || 2 * ty >= child_tileres.height)
+    return false;
+  QImage canvas(2 * tile_size.width, 2 * tile_size.height, QImage::Format_RGB32);
+  canvas.fill(Qt::black);
+
+  int num_children = 0;
+  int num_read = 0;
+  for (int dy = 0; dy < 2; ++dy) {
+    for (int dx = 0; dx < 2; ++dx) {
+      const int child_tx = 2 * tx + dx;
+      const int child_ty = 2 * ty + dy;
+      if (child_tx >= child_tileres.width || child_ty >= child_tileres.height)
+        continue;
+      num_children++;
+      QImage child;
+      if (!ReadTileImage(level + 1, child_tx, child_ty, &child))
+        continue;
+      child = child.convertToFormat(QImage::Format_RGB32);
+      const int x0 = dx * tile_size.width;
+      const int y0 = dy * tile_size.height;
+      const int width = std::min(child.width(), tile_size.width);
+      const int height = std::min(child.height(), tile_size.height);
+      for (int y = 0; y < height; ++y) {
+        memcpy(canvas.scanLine(y0 + y) + x0 * 4, child.constScanLine(y), size_t(width) * 4);
+      }
+      num_read++;
+    }
+  }
+  if (num_read == 0)
+    return false;
+
+  QImage tile = Downsample2x2(canvas);
+
+  // Tiles with unreadable children are not cached, so that they are tried again next time.
+  // The file is replaced atomically, so that readers never see it half written.
+  if (num_read == num_children) {
+    QSaveFile file(QString::fromStdString(GetTileFilename(level, tx, ty)));
+    if (file.open(QIODevice::WriteOnly) && tile.save(&file, "JPG", kCoarseTileJpegQuality))
+      file.commit();
+  }
+  *image = tile;
+  return true;
+}
+
 std::string TiledImageObject::GetTileFilename(int level, int tx, int ty) {
   std::stringstream tilefname;
-  tilefname << params_.source_dir << "/";
+  if (IsSynthesizedLevel(level)) {
+    tilefname << coarse_cache_dir_ << "/";
+  } else {
+    tilefname << params_.source_dir << (storage_ == TileStorage_FILES ? "/" : "#");
+    level -= num_added_levels_;
+  }
   tilefname << std::setw(4) << std::setfill('0') << level << "-"
     << std::setw(4) << std::setfill('0') << tx << "-"
     << std::setw(4) << std::setfill('0') << ty << ".jpg";
@@ -88,9 +495,9 @@ std::string TiledImageObject::GetTileFilename(int level, int tx, int ty) {
 }
 
 std::string TiledImageObject::GetTileFilenameFromGlobalCoords(int level, 
-                                                              int global_x, int global_y) {
-  int tx = global_x / tile_size().width;
-  int ty = global_y / tile_size().height;
+                                                              int64_t global_x, int64_t global_y) {
+  int tx = int(global_x / tile_size().width);
+  int ty = int(global_y / tile_size().height);
   return GetTileFilename(level, tx, ty);
 }
 
@@ -1,9 +1,14 @@
 #ifndef GIGAPATCHEXPLORER_IMAGE_TILEDIMAGE_H_
 #define GIGAPATCHEXPLORER_IMAGE_TILEDIMAGE_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <QImage>
+#include <QMutex>
+#include <QWaitCondition>
+
 #include "common.h"
 #include "imagesources/imagesource.h"
 
@@ -16,9 +21,22 @@ struct TiledImageParams {
   Size2DInt tile_size;							        // Size of a single tile along x and y.
   int num_levels;								            // Number of resolution levels.
   int total_num_tiles;						          // Total number of tiles.
-  std::string source_dir;					          // Source directory for image.
+  std::string source_dir;					          // Source directory (or pack file) for image.
+};
+
+// Where the tiles of a TiledImageObject are read from.
+enum TileStorage {
+  TileStorage_FILES,  // One file per tile in the source directory.
+  TileStorage_PACK,   // A single memory mapped tile pack (see TilePack).
+  TileStorage_RAW,    // A memory mapped flat raw image that tiles are cut from.
+  TileStorage_TIFF    // The tiled images of a pyramidal TIFF or BigTIFF file.
 };
 
+class RawImageFile;
+struct RawImageFormat;
+class TiffReader;
+class TilePack;
+
 // Encapsulates an out-of-core, multi-resolution, tiled image data that resides in a single source
 // directory i.e. all tiled images, and information are in source directory.
 class TiledImageObject : public ImageSourceObject {
@@ -27,11 +45,53 @@ public:
   TiledImageObject();
   ~TiledImageObject();
 
-  // Initializes to the image data found in sourceDir. Uses _info.txt inside sourceDir.
+  // Initializes to the image data found in sourceDir. Uses _info.txt inside sourceDir. If
+  // sourceDir is a file rather than a directory, it is opened as a TIFF file if it is one (see
+  // InitTiff()), and as a tile pack otherwise. Coarse levels that are missing (from _info.txt
+  // or from the tiles) are synthesized, see SynthesizeTile().
   // Returns true when successful.
   bool Init(std::string sourceDir);
+  // Initializes to a flat raw image of the given format. Only the full resolution level is
+  // stored; all coarser levels are synthesized. Returns true when successful.
+  bool InitRaw(const std::string& filename, const RawImageFormat& format,
+               Size2DInt tile_size = Size2DInt(256, 256));
+  // Initializes to a pyramidal (Big)TIFF file: its largest tiled image is the finest level,
+  // and its tiled images at power of two reductions of it (with the same tile size) are the
+  // coarser levels. Levels the file lacks are synthesized. Tiles are read with positioned reads
+  // straight from the file. Returns true when successful.
+  bool InitTiff(const std::string& filename);
+  TileStorage storage() { return storage_; }
+  // Points data at the encoded tile in the pack's mapping (no copy). Only for TileStorage_PACK;
+  // the data stays valid as long as this object lives. Returns false if the tile is missing.
+  bool GetPackedTile(TileKey key, const uchar** data, int* length);
+  // True for coarse levels whose tiles are not stored but computed from the tiles below them.
+  bool IsSynthesizedLevel(int level) {
+    return level >= 0 && level < int(level_is_synthesized_.size()) &&
+      level_is_synthesized_[level];
+  }
+  // Reads a tile of a synthesized level from the coarse level cache, or else computes it by
+  // downsampling its four child tiles (recursively, if they are synthesized as well) and writes
+  // it to the cache. Meant to run on the loader threads; safe to call from several at once. A
+  // thread that asks for a tile another thread is synthesizing waits for it and reads it from
+  // the cache, so overlapping requests (e.g. a tile and its parent) share the work.
+  bool SynthesizeTile(TileKey key, QImage* image);
+  // Reads any tile as an image: decodes stored tiles, cuts raw tiles, and synthesizes the
+  // others. Border tiles have the full tile size. Beyond the image, raw and synthesized tiles
+  // are black, and stored tiles hold whatever padding the source has. Thread-safe.
+  bool ReadTileImage(TileKey key, QImage* image) {
+    return ReadTileImage(key.level(), key.tx(), key.ty(), image);
+  }
+  // Tiles are identified by keys everywhere but in the loader, which needs the filename to read
+  // the tile. For packs the name only identifies the tile in messages; for synthesized levels it
+  // is the file in the coarse level cache.
+  TileKey GetTileKey(int level, int tx, int ty) {
+    return TileKey(source_id_, level, tx, ty);
+  }
   std::string GetTileFilename(int level, int tx, int ty);
-  std::string GetTileFilenameFromGlobalCoords(int level, int global_x, int global_y);
+  std::string GetTileFilename(TileKey key) {
+    return GetTileFilename(key.level(), key.tx(), key.ty());
+  }
+  std::string GetTileFilenameFromGlobalCoords(int level, int64_t global_x, int64_t global_y);
   void ConvertGlobalXYPosToLocalTileXYPos(PatchCoords &patch_coords);
   TiledImageParams GetParamsCopy() { return params_; }
   std::string source_dir() { return params_.source_dir; }
@@ -44,9 +104,40 @@ public:
   int total_num_images() {
     return params_.total_num_tiles;
   };
+  // Distinguishes the tile keys of different objects (ids repeat after 256 objects).
+  int source_id() { return source_id_; }
 
 private:
+  // Adds the levels that _info.txt is missing above its coarsest level, finds the coarse levels
+  // whose tiles are missing, and sets up the cache for them.
+  void CompletePyramid();
+  // What the synthesized tiles depend on: the source's size and modification time (for tile
+  // directories, those of _info.txt), the tile size, and the layout of raw images.
+  std::string CoarseCacheStamp();
+  // Empties the coarse level cache if it was filled from a different or older source, and
+  // records the current source in it.
+  void ValidateCoarseCache();
+  // Reads a tile of any level: stored tiles from their file or the pack, others synthesized.
+  bool ReadTileImage(int level, int tx, int ty, QImage* image);
+  bool ReadStoredTile(int level, int tx, int ty, QImage* image);
+  // Downsamples the four children of the tile into it and writes it to the cache.
+  bool ComputeSynthesizedTile(TileKey key, QImage* image);
+
   TiledImageParams params_;
+  TileStorage storage_;
+  std::shared_ptr<TilePack> pack_;
+  std::shared_ptr<RawImageFile> raw_image_;
+  std::shared_ptr<TiffReader> tiff_;
+  std::vector<int> tiff_directory_per_level_;  // -1 for levels the TIFF file lacks.
+  int num_added_levels_;          // Levels added above the coarsest level the source lists;
+                                  // stored level l is level l + num_added_levels_.
+  std::vector<char> level_is_synthesized_;
+  std::string coarse_cache_dir_;  // Where synthesized tiles are kept.
+  QMutex synthesis_mutex_;
+  QWaitCondition synthesis_done_;
+  TileKeySet tiles_being_synthesized_;  // Guarded by synthesis_mutex_.
+  int source_id_;
+  static int next_source_id_;
 };
 
 #endif  // GIGAPATCHEXPLORER_IMAGE_TILEDIMAGE_H_
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <cstring>
+
+#include <QElapsedTimer>
+#include <QtEndian>
+
+#include "imagesources/tilepack.h"
+
+const char TilePack::kMagic[8] = { 'G', 'P', 'X', 'P', 'A', 'C', 'K', '1' };
+
+namespace {
+
+struct PackedTile {
+  int tx;
+  int ty;
+  uint64_t morton;
+};
+
+void PutUint32(uint32_t value, uchar* dst) { qToLittleEndian<quint32>(value, dst); }
+void PutUint64(uint64_t value, uchar* dst) { qToLittleEndian<quint64>(value, dst); }
+uint32_t GetUint32(const uchar* src) { return qFromLittleEndian<quint32>(src); }
+uint64_t GetUint64(const uchar* src) { return qFromLittleEndian<quint64>(src); }
+
+}  // namespace
+
+TilePack::TilePack() : data_(nullptr), size_(0), index_(nullptr) {}
+
+TilePack::~TilePack() {
+  Close();
+}
+
+bool TilePack::Open(const std::string& pack_path, TiledImageParams* params) {
+  Close();
+  file_.setFileName(QString::fromStdString(pack_path));
+  if (!file_.open(QIODevice::ReadOnly)) {
+    printf("ERROR: Cannot open tile pack %s.\n", pack_path.c_str());
+    return false;
+  }
+  size_ = file_.size();
+  if (size_ < kHeaderBytes) {
+    printf("ERROR: %s is not a tile pack.\n", pack_path.c_str());
+    Close();
+    return false;
+  }
+  data_ = file_.map(0, size_);
+  if (data_ == nullptr) {
+    printf("ERROR: Cannot map tile pack %s.\n", pack_path.c_str());
+    Close();
+    return false;
+  }
+  if (memcmp(data_, kMagic, sizeof(kMagic)) != 0 || GetUint32(data_ + 8) != kVersion) {
+    printf("ERROR: %s is not a tile pack of version %u.\n", pack_path.c_str(), kVersion);
+    Close();
+    return false;
+  }
+
+  TiledImageParams p;
+  p.source_dir = pack_path;
+  p.tile_size = Size2DInt(int(GetUint32(data_ + 12)), int(GetUint32(data_ + 16)));
+  p.num_levels = int(GetUint32(data_ + 20));
+  uint64_t index_offset = GetUint64(data_ + 24);
+  uint64_t num_entries = GetUint64(data_ + 32);
+  if (p.tile_size.width <= 0 || p.tile_size.height <= 0 || p.num_levels <= 0 ||
+      p.num_levels > (1 << TileKey::kLevelBits) ||
+      kHeaderBytes + uint64_t(p.num_levels) * kLevelBytes > uint64_t(size_)) {
+    printf("ERROR: Tile pack %s has an invalid header.\n", pack_path.c_str());
+    Close();
+    return false;
+  }
+
+  p.total_num_tiles = 0;
+  uint64_t entries = 0;
+  for (int l = 0; l < p.num_levels; ++l) {
+    const uchar* level = data_ + kHeaderBytes + l * kLevelBytes;
+    Size2DInt tileres(int(GetUint32(level)), int(GetUint32(level + 4)));
+    Size2DInt imgres(int(GetUint32(level + 8)), int(GetUint32(level + 12)));
+    p.tileres_per_level.push_back(tileres);
+    p.imgres_per_level.push_back(imgres);
+    level_first_entry_.push_back(entries);
+    entries += uint64_t(tileres.width) * uint64_t(tileres.height);
+  }
+  p.total_num_tiles = int(entries);
+  if (entries != num_entries || index_offset > uint64_t(size_) ||
+      num_entries * kIndexEntryBytes > uint64_t(size_) - index_offset) {
+    printf("ERROR: Tile pack %s has an invalid index.\n", pack_path.c_str());
+    Close();
+    return false;
+  }
+  index_ = data_ + index_offset;
+  tileres_per_level_ = p.tileres_per_level;
+  *params = p;
+
+  printf("\nTilePack %s mapped: %lld bytes, %llu tiles.\n", pack_path.c_str(),
+         (long long)size_, (unsigned long long)num_entries);
+  return true;
+}
+
+void TilePack::Close() {
+  if (data_ != nullptr) {
+    file_.unmap(const_cast<uchar*>(data_));
+  }
+  if (file_.isOpen()) {
+    file_.close();
+  }
+  data_ = nullptr;
+  index_ = nullptr;
+  size_ = 0;
+  tileres_per_level_.clear();
+  level_first_entry_.clear();
+}
+
+bool TilePack::GetTile(int level, int tx, int ty, const uchar** data, int* length) const {
+  if (!is_open() || level < 0 || level >= int(tileres_per_level_.size()))
+    return false;
+  const Size2DInt& tileres = tileres_per_level_[level];
+  if (tx < 0 || ty < 0 || tx >= tileres.width || ty >= tileres.height)
+    return false;
+
+  const uchar* entry = index_ +
+    (level_first_entry_[level] + uint64_t(ty) * tileres.width + tx) * kIndexEntryBytes;
+  uint64_t offset = GetUint64(entry);
+  uint32_t tile_length = GetUint32(entry + 8);
+  if (tile_length == 0 || offset > uint64_t(size_) || tile_length > uint64_t(size_) - offset)
+    return false;
+  *data = data_ + offset;
+  *length = int(tile_length);
+  return true;
+}
+
+uint64_t TilePack::MortonCode(uint32_t x, uint32_t y) {
+  uint64_t code = 0;
+  for (int b = 0; b < 32; ++b) {
+    code |= uint64_t((x >> b) & 1) << (2 * b);
+    code |= uint64_t((y >> b) & 1) << (2 * b + 1);
+  }
+  return code;
+}
+
+bool TilePack::PackTileDirectory(const std::string& source_dir, const std::string& pack_path) {
+  TiledImageObject source;
+  if (!source.Init(source_dir))
+    return false;
+  TiledImageParams params = source.GetParamsCopy();
+
+  QFile out(QString::fromStdString(pack_path));
+  if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    printf("ERROR: Cannot write tile pack %s.\n", pack_path.c_str());
+    return false;
+  }
+
+  uint64_t num_entries = 0;
+  for (int l = 0; l < params.num_levels; ++l) {
+    num_entries += uint64_t(params.tileres_per_level[l].width) *
+      uint64_t(params.tileres_per_level[l].height);
+  }
+  const uint64_t index_offset = kHeaderBytes + uint64_t(params.num_levels) * kLevelBytes;
+  std::vector<uchar> header(size_t(index_offset), 0);
+  memcpy(header.data(), kMagic, sizeof(kMagic));
+  PutUint32(kVersion, header.data() + 8);
+  PutUint32(uint32_t(params.tile_size.width), header.data() + 12);
+  PutUint32(uint32_t(params.tile_size.height), header.data() + 16);
+  PutUint32(uint32_t(params.num_levels), header.data() + 20);
+  PutUint64(index_offset, header.data() + 24);
+  PutUint64(num_entries, header.data() + 32);
+  for (int l = 0; l < params.num_levels; ++l) {
+    uchar* level = header.data() + kHeaderBytes + l * kLevelBytes;
+    PutUint32(uint32_t(params.tileres_per_level[l].width), level);
+    PutUint32(uint32_t(params.tileres_per_level[l].height), level + 4);
+    PutUint32(uint32_t(params.imgres_per_level[l].width), level + 8);
+    PutUint32(uint32_t(params.imgres_per_level[l].height), level + 12);
+  }
+  // The index is written once all payload offsets are known.
+  std::vector<uchar> index(size_t(num_entries * kIndexEntryBytes), 0);
+  if (out.write((const char*)header.data(), header.size()) != qint64(header.size()) ||
+      out.write((const char*)index.data(), index.size()) != qint64(index.size())) {
+    printf("ERROR: Cannot write tile pack %s.\n", pack_path.c_str());
+    return false;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+  uint64_t offset = index_offset + index.size();
+  uint64_t first_entry = 0;
+  int num_packed = 0;
+  int num_missing = 0;
+  for (int l = 0; l < params.num_levels; ++l) {
+    Size2DInt tileres = params.tileres_per_level[l];
+    std::vector<PackedTile> tiles;
+    tiles.reserve(size_t(tileres.width) * tileres.height);
+    for (int ty = 0; ty < tileres.height; ++ty) {
+      for (int tx = 0; tx < tileres.width; ++tx) {
+        PackedTile tile = { tx, ty, MortonCode(uint32_t(tx), uint32_t(ty)) };
+        tiles.push_back(tile);
+      }
+    }
+    std::sort(tiles.begin(), tiles.end(), [](const PackedTile& a, const PackedTile& b) {
+      return a.morton < b.morton;
+    });
+
+    for (const PackedTile& tile : tiles) {
+      QFile tile_file(QString::fromStdString(source.GetTileFilename(l, tile.tx, tile.ty)));
+      QByteArray bytes;
+      if (tile_file.open(QIODevice::ReadOnly))
+        bytes = tile_file.readAll();
+      if (bytes.isEmpty()) {
+        num_missing++;
+        continue;
+      }
+      if (out.write(bytes) != bytes.size()) {
+        printf("ERROR: Cannot write tile pack %s.\n", pack_path.c_str());
+        return false;
+      }
+      uchar* entry = index.data() +
+        (first_entry + uint64_t(tile.ty) * tileres.width + tile.tx) * kIndexEntryBytes;
+      PutUint64(offset, entry);
+      PutUint32(uint32_t(bytes.size()), entry + 8);
+      offset += uint64_t(bytes.size());
+      num_packed++;
+    }
+    first_entry += uint64_t(tileres.width) * tileres.height;
+    printf("Level %d packed (%d tiles so far, %.1f s).\n", l, num_packed,
+           timer.elapsed() / 1000.0);
+  }
+
+  if (!out.seek(qint64(index_offset)) ||
+      out.write((const char*)index.data(), index.size()) != qint64(index.size())) {
+    printf("ERROR: Cannot write the index of tile pack %s.\n", pack_path.c_str());
+    return false;
+  }
+  out.close();
+  printf("Packed %d tiles (%d missing) into %s: %.1f MB.\n", num_packed, num_missing,
+         pack_path.c_str(), offset / (1024.0 * 1024.0));
+  return true;
+}
@@ -0,0 +1,66 @@
+#ifndef GIGAPATCHEXPLORER_IMAGE_TILEPACK_H_
+#define GIGAPATCHEXPLORER_IMAGE_TILEPACK_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <QFile>
+
+#include "imagesources/tiledimage.h"
+
+// A tiled image packed into a single file, so that opening it and reading tiles costs no
+// directory lookups or per-tile file opens. All numbers are little endian:
+//
+//   Header       magic "GPXPACK1", version, tile width and height, number of levels, index
+//                offset, number of index entries, then per level the tiles and pixels in x and y
+//                (i.e. the same metadata as _info.txt).
+//   Index        One entry per tile, level by level and row by row within a level:
+//                payload offset (8 bytes), payload length (4 bytes), reserved (4 bytes). Missing
+//                tiles have length 0.
+//   Payloads     The tiles' encoded files (JPEG for Gigapan images), level by level, and within
+//                a level in Z-order (Morton order), so that tiles that are close in the image are
+//                close in the file and a view's tiles are read from a few runs of the file.
+//
+// The whole file is memory mapped: the index is read in place and tiles are handed out as
+// pointers into the mapping.
+class TilePack {
+public:
+  static const char kMagic[8];
+  static const uint32_t kVersion = 1;
+
+  TilePack();
+  ~TilePack();
+
+  // Maps the pack file and fills params (source_dir is set to pack_path). Returns false if the
+  // file cannot be mapped or is not a valid pack.
+  bool Open(const std::string& pack_path, TiledImageParams* params);
+  void Close();
+  bool is_open() const { return data_ != nullptr; }
+
+  // Points data at the encoded tile inside the mapping. Returns false if the tile is outside the
+  // image or missing from the pack. Safe to call from any thread while the pack is open.
+  bool GetTile(int level, int tx, int ty, const uchar** data, int* length) const;
+
+  // Writes the tiles of the tile directory source_dir (as read by TiledImageObject::Init())
+  // into a pack. Missing tiles are recorded as such. Prints progress and returns true if the
+  // pack was written.
+  static bool PackTileDirectory(const std::string& source_dir, const std::string& pack_path);
+
+  // Interleaves the bits of x and y (x in the even bits).
+  static uint64_t MortonCode(uint32_t x, uint32_t y);
+
+private:
+  static const int kHeaderBytes = 40;      // Up to the per-level table.
+  static const int kLevelBytes = 16;
+  static const int kIndexEntryBytes = 16;
+
+  QFile file_;
+  const uchar* data_;                     // The mapping of the whole file.
+  qint64 size_;
+  const uchar* index_;
+  std::vector<Size2DInt> tileres_per_level_;
+  std::vector<uint64_t> level_first_entry_;  // Index entry of each level's tile (0, 0).
+};
+
+#endif  // GIGAPATCHEXPLORER_IMAGE_TILEPACK_H_
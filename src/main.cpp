@@ -1,8 +1,49 @@
+#include <cstring>
+
 #include <QApplication>
 
+#include "drawing/tileencoder.h"
+#include "imagesources/tilepack.h"
 #include "mainapplication.h"
 
+// Checks the tile texture encoders without opening a window:
+//   --check-tile-encoders                            Built-in reference buffers.
+//   --check-tile-encoders <format> <image> <ref>     Encodes image and compares it with ref.
+//   --encode-tile <format> <image> <output>          Writes the encoded image, e.g. as a ref.
+static int RunTileEncoderCommand(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);  // For the image format plugins.
+  const bool check = strcmp(argv[1], "--check-tile-encoders") == 0;
+  if (check && argc == 2)
+    return CheckTileEncoders() ? 0 : 1;
+
+  TileTextureFormat format = TileTextureFormat_RGBA8;
+  if (argc != 5 || !ParseTileTextureFormat(argv[2], &format)) {
+    printf("Usage: %s --check-tile-encoders [rgba8|rgb8|rgb565|bc1 <image> <reference>]\n"
+           "       %s --encode-tile rgba8|rgb8|rgb565|bc1 <image> <output>\n", argv[0], argv[0]);
+    return 2;
+  }
+  if (!check)
+    return EncodeTileFile(format, argv[3], argv[4]) ? 0 : 1;
+  return CheckTileEncoderAgainstReference(format, argv[3], argv[4]) ? 0 : 1;
+}
+
+// Converts a tile directory into a single tile pack file:
+//   --pack-tiles <tile directory> <pack file>
+static int RunPackTilesCommand(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  if (argc != 4) {
+    printf("Usage: %s --pack-tiles <tile directory> <pack file>\n", argv[0]);
+    return 2;
+  }
+  return TilePack::PackTileDirectory(argv[2], argv[3]) ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
+  if (argc >= 2 && strcmp(argv[1], "--pack-tiles") == 0)
+    return RunPackTilesCommand(argc, argv);
+  if (argc >= 2 && (strcmp(argv[1], "--check-tile-encoders") == 0 ||
+                    strcmp(argv[1], "--encode-tile") == 0))
+    return RunTileEncoderCommand(argc, argv);
   
   QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts);
   QApplication app(argc, argv);
@@ -1,12 +1,24 @@
 #include <QtWidgets>
 
+#include "imagesources/rawimage.h"
 #include "mainapplication.h"
 
 MainApplication::MainApplication() {
   // Create the default TiledImageExplorer for the central widget.
   central_tiled_image_explorer_ = std::make_shared<TiledImageExplorer>();
   const bool display_tile_filenames = false;
-  texture_cache_ = std::make_shared<QTextureCache>(display_tile_filenames);  // TODO: Change this initial limit.
+  // Number of tile decoding threads; 0 (default) uses one thread per core.
+  QSettings settings("KAUST", "GigaPatchExplorer");
+  const int num_loader_threads = settings.value("tileLoaderThreads", 0).toInt();
+  // Texture memory budget of the tile cache; 0 (default) derives it from the free video memory.
+  const long long texture_cache_bytes =
+    settings.value("textureCacheMegabytes", 0).toLongLong() * 1024 * 1024;
+  // System memory budget for decoded tiles, so that tiles evicted from video memory are not
+  // decoded again.
+  const long long decoded_tile_cache_bytes =
+    settings.value("decodedTileCacheMegabytes", 1024).toLongLong() * 1024 * 1024;
+  texture_cache_ = std::make_shared<QTextureCache>(display_tile_filenames, num_loader_threads,
+                                                   texture_cache_bytes, decoded_tile_cache_bytes);
   central_tiled_image_explorer_->UseTextureCache(texture_cache_.get());
   central_tiled_image_explorer_->setFocusPolicy(Qt::StrongFocus);
 
@@ -33,7 +45,8 @@ MainApplication::~MainApplication() {
 
 void MainApplication::DisplayOpenPrompt() {
   QMessageBox::about(this, tr("GigapatchExplorer"),
-                     tr("Press <b> o </b> to open an image."));
+                     tr("Press <b> o </b> to open an image, <b> Shift+o </b> to open a tile "
+                        "pack or pyramidal TIFF file, or <b> Shift+r </b> to open a raw image."));
 }
 
 void MainApplication::closeEvent(QCloseEvent * event) {
@@ -70,6 +83,16 @@ void MainApplication::CreateActions() {
   open_action_->setShortcut(Qt::Key_O);
   connect(open_action_, SIGNAL(triggered()), this, SLOT(OpenTiledImage()));
   addAction(open_action_);
+
+  open_pack_action_ = new QAction(tr("Open tile &pack or TIFF file"), this);
+  open_pack_action_->setShortcut(QKeySequence(Qt::SHIFT + Qt::Key_O));
+  connect(open_pack_action_, SIGNAL(triggered()), this, SLOT(OpenTilePack()));
+  addAction(open_pack_action_);
+
+  open_raw_action_ = new QAction(tr("Open &raw image"), this);
+  open_raw_action_->setShortcut(QKeySequence(Qt::SHIFT + Qt::Key_R));
+  connect(open_raw_action_, SIGNAL(triggered()), this, SLOT(OpenRawImage()));
+  addAction(open_raw_action_);
 }
 
 void MainApplication::CreateToolBars() {}
@@ -84,11 +107,62 @@ void MainApplication::OpenTiledImage() {
                                                              QFileDialog::DontResolveSymlinks);
   if (directory_name.isEmpty())
     return;
+  AttachTiledImage(directory_name.toStdString());
+}
+
+void MainApplication::OpenTilePack() {
+  QString file_name = QFileDialog::getOpenFileName(
+    this, tr("Choose a tile pack or pyramidal TIFF file"), ".",
+    tr("Tile packs and TIFF files (*.gpxpack *.tif *.tiff *.btf *.svs);;All files (*)"));
+  if (file_name.isEmpty())
+    return;
+  AttachTiledImage(file_name.toStdString());
+}
+
+void MainApplication::OpenRawImage() {
+  QString file_name = QFileDialog::getOpenFileName(this, tr("Choose a raw image"), ".",
+                                                   tr("Raw images (*.raw *.bin);;All files (*)"));
+  if (file_name.isEmpty())
+    return;
+
+  // The layout is remembered per file, so that reopening a dump needs no typing.
+  QSettings settings("KAUST", "GigaPatchExplorer");
+  const QString settings_key = "rawImageFormat/" + QString(QCryptographicHash::hash(
+    file_name.toUtf8(), QCryptographicHash::Md5).toHex());
+  QString text = settings.value(settings_key, "50000 50000 gray16 0").toString();
+  RawImageFormat format;
+  while (true) {
+    bool ok = false;
+    text = QInputDialog::getText(this, tr("Raw image layout"),
+                                 tr("Width, height, pixel type (gray8, rgb8, rgba8, gray16 or "
+                                    "gray16:<bits>) and header bytes:"),
+                                 QLineEdit::Normal, text, &ok);
+    if (!ok)
+      return;
+    if (ParseRawImageFormat(text.toStdString(), &format))
+      break;
+    QMessageBox::warning(this, tr("GigapatchExplorer"), tr("Cannot parse the layout."));
+  }
 
   std::shared_ptr<TiledImageObject> tio = std::make_shared<TiledImageObject>();
-  if (!tio->Init(directory_name.toStdString())) {
+  if (!tio->InitRaw(file_name.toStdString(), format)) {
+    QMessageBox::warning(this, tr("GigapatchExplorer"),
+                         tr("The file is too small for this layout or cannot be read."));
     return;
   }
+  settings.setValue(settings_key, QString::fromStdString(RawImageFormatToString(format)));
+  AttachTiledImageObject(tio);
+}
+
+void MainApplication::AttachTiledImage(const std::string& path) {
+  std::shared_ptr<TiledImageObject> tio = std::make_shared<TiledImageObject>();
+  if (!tio->Init(path)) {
+    return;
+  }
+  AttachTiledImageObject(tio);
+}
+
+void MainApplication::AttachTiledImageObject(std::shared_ptr<TiledImageObject> tio) {
   if (!central_tiled_image_explorer_->AttachTiledImageObject(tio))
     return;
 }
\ No newline at end of file
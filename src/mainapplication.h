@@ -30,6 +30,8 @@ public:
 private slots:
   void ShowHelp(); 
   void OpenTiledImage();
+  void OpenTilePack();
+  void OpenRawImage();
 
 private:
   void CreateActions();
@@ -37,10 +39,14 @@ private:
   void CreateDockWindows();
   void LoadSettings();
   void DisplayOpenPrompt();
+  void AttachTiledImage(const std::string& path);
+  void AttachTiledImageObject(std::shared_ptr<TiledImageObject> tio);
 
 
   QToolBar *main_tool_bar_;
   QAction *open_action_;
+  QAction *open_pack_action_;
+  QAction *open_raw_action_;
   QAction *show_help_action_;
   QAction *quit_action;
   
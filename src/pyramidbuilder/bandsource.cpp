@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include "imagesources/pixelrows.h"
+#include "pyramidbuilder/bandsource.h"
+#include "pyramidbuilder/parallelfor.h"
+
+RawBandSource::RawBandSource() : channels_(0), header_bytes_(0) {}
+
+bool RawBandSource::Open(const std::string& filename, int width, int height, int channels,
+                         int64_t header_bytes) {
+  if (width <= 0 || height <= 0 || (channels != 1 && channels != 3 && channels != 4)) {
+    printf("ERROR: Raw images need a size and 1, 3 or 4 channels.\n");
+    return false;
+  }
+  file_.setFileName(QString::fromStdString(filename));
+  if (!file_.open(QIODevice::ReadOnly)) {
+    printf("ERROR: Cannot open %s.\n", filename.c_str());
+    return false;
+  }
+  const int64_t expected_bytes = header_bytes + int64_t(width) * height * channels;
+  if (file_.size() < expected_bytes) {
+    printf("ERROR: %s has %lld bytes, but a %d x %d image with %d channels needs %lld.\n",
+           filename.c_str(), (long long)file_.size(), width, height, channels,
+           (long long)expected_bytes);
+    return false;
+  }
+  width_ = width;
+  height_ = height;
+  channels_ = channels;
+  header_bytes_ = header_bytes;
+  row_buffer_.resize(width * channels);
+  return true;
+}
+
+bool RawBandSource::ReadRows(int y, int count, uchar* dst, int bytes_per_line) {
+  const int row_bytes = width_ * channels_;
+  if (!file_.seek(header_bytes_ + int64_t(y) * row_bytes))
+    return false;
+  for (int r = 0; r < count; ++r) {
+    if (file_.read(row_buffer_.data(), row_bytes) != row_bytes)
+      return false;
+    ConvertRowToRgb32(reinterpret_cast<const uchar*>(row_buffer_.constData()), width_, channels_,
+                      false, dst + int64_t(r) * bytes_per_line);
+  }
+  return true;
+}
+
+TiffBandSource::TiffBandSource(QThreadPool* pool) : pool_(pool), cached_chunk_row_(-1) {}
+
+bool TiffBandSource::Open(const std::string& filename) {
+  if (!reader_.Open(filename))
+    return false;
+  dir_ = reader_.directories()[0];
+  std::string reason;
+  if (!TiffReader::CanDecode(dir_, &reason)) {
+    printf("ERROR: Cannot read %s: %s.\n", filename.c_str(), reason.c_str());
+    return false;
+  }
+  if (dir_.width > (1 << 30) || dir_.height > (1 << 30)) {
+    printf("ERROR: %s is too large (%lld x %lld).\n", filename.c_str(), (long long)dir_.width,
+           (long long)dir_.height);
+    return false;
+  }
+  width_ = int(dir_.width);
+  height_ = int(dir_.height);
+  if (!reads_rows_directly() && dir_.decoded_chunk_bytes() > kTiffMaxDecodedChunkBytes) {
+    printf("ERROR: Cannot read %s: its %s of %d x %d pixels would take %lld MB decoded, more "
+           "than the limit of %lld MB. Rewrite it tiled or with fewer rows per strip.\n",
+           filename.c_str(), dir_.tiled() ? "tiles" : "strips", dir_.chunk_width(),
+           dir_.chunk_height(), (long long)(dir_.decoded_chunk_bytes() >> 20),
+           (long long)(kTiffMaxDecodedChunkBytes >> 20));
+    return false;
+  }
+  printf("%s: %s %d x %d, %s of %d x %d, compression %d, %d samples per pixel.\n",
+         filename.c_str(), reader_.bigtiff() ? "BigTIFF" : "TIFF", width_, height_,
+         dir_.tiled() ? "tiles" : "strips", dir_.chunk_width(), dir_.chunk_height(),
+         dir_.compression, dir_.samples_per_pixel);
+  return true;
+}
+
+bool TiffBandSource::DecodeChunkRow(int cy) {
+  const int chunk_width = dir_.chunk_width();
+  const int rows = int(std::min<int64_t>(dir_.chunk_height(),
+                                         dir_.height - int64_t(cy) * dir_.chunk_height()));
+  if (chunk_row_.width() != width_ || chunk_row_.height() != dir_.chunk_height())
+    chunk_row_ = QImage(width_, dir_.chunk_height(), QImage::Format_RGB32);
+
+  // Computed up front: scanLine() is not safe to call from several threads.
+  uchar* dst = chunk_row_.bits();
+  const int dst_bytes_per_line = chunk_row_.bytesPerLine();
+  std::atomic<bool> ok(true);
+  ParallelFor(pool_, dir_.chunks_across(), [&](int begin, int end) {
+    for (int cx = begin; cx < end; ++cx) {
+      QImage chunk;
+      if (!reader_.DecodeChunk(dir_, cx, cy, &chunk)) {
+        ok = false;
+        continue;
+      }
+      // Tiles at the right and bottom border are padded beyond the image.
+      const int x0 = cx * chunk_width;
+      const int copy_width = std::min(chunk.width(), width_ - x0);
+      const int copy_rows = std::min(chunk.height(), rows);
+      for (int r = 0; r < copy_rows; ++r) {
+        memcpy(dst + int64_t(r) * dst_bytes_per_line + int64_t(x0) * 4, chunk.constScanLine(r),
+               size_t(copy_width) * 4);
+      }
+    }
+  });
+  if (!ok) {
+    printf("ERROR: Cannot decode chunk row %d.\n", cy);
+    return false;
+  }
+  cached_chunk_row_ = cy;
+  return true;
+}
+
+bool TiffBandSource::ReadRows(int y, int count, uchar* dst, int bytes_per_line) {
+  if (reads_rows_directly()) {
+    return ReadUncompressedRows(y, count, dst, bytes_per_line);
+  }
+  for (int r = 0; r < count; ++r) {
+    const int row = y + r;
+    const int cy = row / dir_.chunk_height();
+    if (cy != cached_chunk_row_ && !DecodeChunkRow(cy))
+      return false;
+    memcpy(dst + int64_t(r) * bytes_per_line,
+           chunk_row_.constScanLine(row - cy * dir_.chunk_height()), size_t(width_) * 4);
+  }
+  return true;
+}
+
+bool TiffBandSource::reads_rows_directly() const {
+  return !dir_.tiled() && dir_.compression == 1 && dir_.predictor == 1;
+}
+
+bool TiffBandSource::ReadUncompressedRows(int y, int count, uchar* dst, int bytes_per_line) {
+  const int row_bytes = width_ * dir_.samples_per_pixel;
+  row_buffer_.resize(row_bytes);
+  for (int r = 0; r < count; ++r) {
+    const int row = y + r;
+    const int strip = row / dir_.rows_per_strip;
+    const uint64_t offset = dir_.chunk_offsets[strip] +
+      uint64_t(row - strip * dir_.rows_per_strip) * row_bytes;
+    if (!reader_.ReadBytes(offset, size_t(row_bytes), row_buffer_.data()))
+      return false;
+    ConvertRowToRgb32(reinterpret_cast<const uchar*>(row_buffer_.constData()), width_,
+                      dir_.samples_per_pixel, dir_.photometric == 0,
+                      dst + int64_t(r) * bytes_per_line);
+  }
+  return true;
+}
@@ -0,0 +1,78 @@
+#ifndef GIGAPATCHEXPLORER_PYRAMIDBUILDER_BANDSOURCE_H_
+#define GIGAPATCHEXPLORER_PYRAMIDBUILDER_BANDSOURCE_H_
+
+#include <cstdint>
+#include <string>
+
+#include <QFile>
+#include <QImage>
+#include <QThreadPool>
+
+#include "imagesources/tiffreader.h"
+
+// A source image that is read from top to bottom in bands of full rows, so that images of any
+// height can be processed in bounded memory.
+class BandSource {
+public:
+  virtual ~BandSource() {}
+  int width() const { return width_; }
+  int height() const { return height_; }
+  // Reads count rows starting at row y as RGB32 pixels into dst, whose rows are bytes_per_line
+  // apart. Rows are read in increasing order.
+  virtual bool ReadRows(int y, int count, uchar* dst, int bytes_per_line) = 0;
+  // Bytes the source holds on to between reads.
+  virtual int64_t buffer_bytes() const { return 0; }
+
+protected:
+  BandSource() : width_(0), height_(0) {}
+  int width_;
+  int height_;
+};
+
+// A flat file of 8-bit pixels with 1 (gray), 3 (RGB) or 4 (RGBA) interleaved channels, stored
+// row by row after a header of header_bytes.
+class RawBandSource : public BandSource {
+public:
+  RawBandSource();
+  bool Open(const std::string& filename, int width, int height, int channels,
+            int64_t header_bytes);
+  bool ReadRows(int y, int count, uchar* dst, int bytes_per_line) Q_DECL_OVERRIDE;
+  int64_t buffer_bytes() const Q_DECL_OVERRIDE { return row_buffer_.size(); }
+
+private:
+  QFile file_;
+  int channels_;
+  int64_t header_bytes_;
+  QByteArray row_buffer_;
+};
+
+// The full resolution image (the first directory) of a TIFF or BigTIFF file. Decodes one row of
+// chunks (tiles or strips) at a time, with the chunks of a row decoded in parallel on pool.
+// Uncompressed strips are read row by row; compressed ones are decoded whole, so files whose
+// chunks exceed kTiffMaxDecodedChunkBytes decoded are rejected, which bounds the memory of a
+// chunk row to the image width times the chunk height.
+class TiffBandSource : public BandSource {
+public:
+  explicit TiffBandSource(QThreadPool* pool);
+  bool Open(const std::string& filename);
+  bool ReadRows(int y, int count, uchar* dst, int bytes_per_line) Q_DECL_OVERRIDE;
+  int64_t buffer_bytes() const Q_DECL_OVERRIDE {
+    return int64_t(chunk_row_.bytesPerLine()) * chunk_row_.height();
+  }
+
+private:
+  // Uncompressed strips are read row by row rather than strip by strip, as some files store the
+  // whole image in a single strip.
+  bool reads_rows_directly() const;
+  bool ReadUncompressedRows(int y, int count, uchar* dst, int bytes_per_line);
+  bool DecodeChunkRow(int cy);
+
+  QThreadPool* pool_;
+  TiffReader reader_;
+  TiffDirectory dir_;
+  QImage chunk_row_;     // The decoded chunk row cached_chunk_row_.
+  int cached_chunk_row_;
+  QByteArray row_buffer_;
+};
+
+#endif  // GIGAPATCHEXPLORER_PYRAMIDBUILDER_BANDSOURCE_H_
@@ -0,0 +1,70 @@
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include <QCoreApplication>
+
+#include "pyramidbuilder/bandsource.h"
+#include "pyramidbuilder/pyramidbuilder.h"
+
+static void PrintUsage(const char* program) {
+  printf("Usage: %s <input> <output directory> [options]\n"
+         "Builds a tiled image pyramid (as GigaPatchExplorer opens) from a TIFF/BigTIFF or raw "
+         "image.\n"
+         "  --raw <width> <height> <channels> [<header bytes>]\n"
+         "                      Input is a flat 8-bit raw file with 1, 3 or 4 interleaved\n"
+         "                      channels. Otherwise the input is read as TIFF.\n"
+         "  --tile <size>       Tile width and height (default 256).\n"
+         "  --quality <0-100>   JPEG quality (default 90).\n"
+         "  --threads <n>       Downsampling and encoding threads (default: one per core).\n",
+         program);
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);  // For the image format plugins.
+  if (argc < 3) {
+    PrintUsage(argv[0]);
+    return 2;
+  }
+
+  std::string input = argv[1];
+  PyramidBuildOptions options;
+  options.output_dir = argv[2];
+  bool raw = false;
+  int raw_width = 0, raw_height = 0, raw_channels = 0;
+  long long raw_header_bytes = 0;
+  for (int i = 3; i < argc; ++i) {
+    if (strcmp(argv[i], "--raw") == 0 && i + 3 < argc) {
+      raw = true;
+      raw_width = atoi(argv[++i]);
+      raw_height = atoi(argv[++i]);
+      raw_channels = atoi(argv[++i]);
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+        raw_header_bytes = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+      options.tile_width = options.tile_height = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--quality") == 0 && i + 1 < argc) {
+      options.jpeg_quality = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      options.num_threads = atoi(argv[++i]);
+    } else {
+      PrintUsage(argv[0]);
+      return 2;
+    }
+  }
+
+  PyramidBuilder builder(options);
+  std::unique_ptr<BandSource> source;
+  if (raw) {
+    std::unique_ptr<RawBandSource> raw_source(new RawBandSource());
+    if (!raw_source->Open(input, raw_width, raw_height, raw_channels, raw_header_bytes))
+      return 1;
+    source = std::move(raw_source);
+  } else {
+    std::unique_ptr<TiffBandSource> tiff_source(new TiffBandSource(builder.thread_pool()));
+    if (!tiff_source->Open(input))
+      return 1;
+    source = std::move(tiff_source);
+  }
+  return builder.Build(source.get()) ? 0 : 1;
+}
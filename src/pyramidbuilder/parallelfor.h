@@ -0,0 +1,45 @@
+#ifndef GIGAPATCHEXPLORER_PYRAMIDBUILDER_PARALLELFOR_H_
+#define GIGAPATCHEXPLORER_PYRAMIDBUILDER_PARALLELFOR_H_
+
+#include <algorithm>
+#include <functional>
+
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+
+// Runs body(begin, end) over [0, count) split into one range per pool thread, with the first
+// range on the calling thread, and returns when all ranges are done. The ranges are queued with
+// a high priority, so that they overtake other work waiting in the pool.
+inline void ParallelFor(QThreadPool* pool, int count,
+                        const std::function<void(int begin, int end)>& body) {
+  class RangeRunnable : public QRunnable {
+  public:
+    RangeRunnable(const std::function<void(int, int)>& body, int begin, int end,
+                  QSemaphore* done)
+        : body_(body), begin_(begin), end_(end), done_(done) {}
+    void run() Q_DECL_OVERRIDE {
+      body_(begin_, end_);
+      done_->release();
+    }
+
+  private:
+    const std::function<void(int, int)>& body_;
+    int begin_;
+    int end_;
+    QSemaphore* done_;
+  };
+
+  const int num_ranges = std::max(1, std::min(count, pool->maxThreadCount()));
+  const int range_size = (count + num_ranges - 1) / std::max(1, num_ranges);
+  QSemaphore done;
+  int num_queued = 0;
+  for (int begin = range_size; begin < count; begin += range_size) {
+    pool->start(new RangeRunnable(body, begin, std::min(count, begin + range_size), &done), 1);
+    num_queued++;
+  }
+  body(0, std::min(count, range_size));
+  done.acquire(num_queued);
+}
+
+#endif  // GIGAPATCHEXPLORER_PYRAMIDBUILDER_PARALLELFOR_H_
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <QRunnable>
+
+#include "imagesources/pixelrows.h"
+#include "pyramidbuilder/parallelfor.h"
+#include "pyramidbuilder/pyramidbuilder.h"
+
+namespace {
+
+class TileEncodeRunnable : public QRunnable {
+public:
+  TileEncodeRunnable(const QImage& tile, const std::string& filename, int quality,
+                     QAtomicInt* written, QAtomicInt* failed, QSemaphore* pending)
+      : tile_(tile), filename_(filename), quality_(quality), written_(written), failed_(failed),
+        pending_(pending) {}
+
+  void run() Q_DECL_OVERRIDE {
+    if (tile_.save(QString::fromStdString(filename_), "JPG", quality_)) {
+      written_->fetchAndAddRelaxed(1);
+    } else {
+      printf("Warning! Cannot write tile %s.\n", filename_.c_str());
+      failed_->fetchAndAddRelaxed(1);
+    }
+    tile_ = QImage();
+    pending_->release();
+  }
+
+private:
+  QImage tile_;
+  std::string filename_;
+  int quality_;
+  QAtomicInt* written_;
+  QAtomicInt* failed_;
+  QSemaphore* pending_;
+};
+
+}  // namespace
+
+PyramidBuilder::PyramidBuilder(const PyramidBuildOptions& options)
+    : options_(options),
+      tiles_written_(0),
+      tiles_failed_(0),
+      downsample_secs_(0.0) {
+  if (options_.num_threads > 0)
+    pool_.setMaxThreadCount(options_.num_threads);
+  if (options_.max_pending_tiles <= 0)
+    options_.max_pending_tiles = std::max(16, 4 * pool_.maxThreadCount());
+  pending_tiles_.release(options_.max_pending_tiles);
+}
+
+PyramidBuilder::~PyramidBuilder() {
+  pool_.waitForDone();
+}
+
+void PyramidBuilder::InitLevels(int width, int height) {
+  // From the finest level down to the first that fits into a single tile.
+  std::vector<LevelBand> levels;
+  while (true) {
+    LevelBand band;
+    band.width = width;
+    band.height = height;
+    band.filled = 0;
+    band.band_y = 0;
+    levels.push_back(band);
+    if (width <= options_.tile_width && height <= options_.tile_height)
+      break;
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+  }
+  levels_.assign(levels.rbegin(), levels.rend());
+  for (LevelBand& band : levels_) {
+    band.rows = QImage(band.width, options_.tile_height, QImage::Format_RGB32);
+  }
+}
+
+std::string PyramidBuilder::TileFilename(int level, int tx, int ty) const {
+  std::stringstream filename;
+  filename << options_.output_dir << "/";
+  filename << std::setw(4) << std::setfill('0') << level << "-"
+    << std::setw(4) << std::setfill('0') << tx << "-"
+    << std::setw(4) << std::setfill('0') << ty << ".jpg";
+  return filename.str();
+}
+
+bool PyramidBuilder::Build(BandSource* source) {
+  if (source->width() <= 0 || source->height() <= 0 || options_.tile_width <= 0 ||
+      options_.tile_height <= 0 || options_.tile_height % 2 != 0) {
+    printf("ERROR: Invalid image or tile size (tile height must be even).\n");
+    return false;
+  }
+  if (!QDir().mkpath(QString::fromStdString(options_.output_dir))) {
+    printf("ERROR: Cannot create %s.\n", options_.output_dir.c_str());
+    return false;
+  }
+
+  QElapsedTimer timer;
+  timer.start();
+  InitLevels(source->width(), source->height());
+  const int finest = int(levels_.size()) - 1;
+  int64_t band_bytes = 0;
+  for (const LevelBand& band : levels_) {
+    band_bytes += int64_t(band.rows.bytesPerLine()) * band.rows.height();
+  }
+  printf("Building %d levels of %d x %d tiles from a %d x %d image with %d threads.\n",
+         int(levels_.size()), options_.tile_width, options_.tile_height, source->width(),
+         source->height(), pool_.maxThreadCount());
+
+  double read_secs = 0.0;
+  const int height = source->height();
+  const int num_bands = (height + options_.tile_height - 1) / options_.tile_height;
+  for (int b = 0; b < num_bands; ++b) {
+    LevelBand& band = levels_[finest];
+    const int count = std::min(options_.tile_height, height - band.band_y);
+    qint64 read_start = timer.nsecsElapsed();
+    if (!source->ReadRows(band.band_y, count, band.rows.bits(), band.rows.bytesPerLine())) {
+      printf("ERROR: Cannot read rows %d to %d of the source.\n", band.band_y,
+             band.band_y + count - 1);
+      pool_.waitForDone();
+      return false;
+    }
+    read_secs += (timer.nsecsElapsed() - read_start) / 1e9;
+    band.filled = count;
+    FlushBand(finest);
+
+    if ((b + 1) % 16 == 0 || b + 1 == num_bands) {
+      double secs = timer.elapsed() / 1000.0;
+      double megapixels = double(source->width()) * band.band_y / 1e6;
+      printf("Rows %d / %d (%.0f%%), %.1f MP/s.\n", band.band_y, height,
+             100.0 * band.band_y / height, secs > 0.0 ? megapixels / secs : 0.0);
+    }
+  }
+  pool_.waitForDone();
+  if (!WriteInfoFile())
+    return false;
+
+  const double secs = timer.elapsed() / 1000.0;
+  const double megapixels = double(source->width()) * double(height) / 1e6;
+  const int64_t tile_bytes = int64_t(options_.max_pending_tiles) * options_.tile_width *
+    options_.tile_height * 4;
+  printf("\nWrote %d tiles (%d failed) of %d levels to %s.\n", tiles_written_.load(),
+         tiles_failed_.load(), int(levels_.size()), options_.output_dir.c_str());
+  printf("%.1f megapixels in %.2f s: %.1f MP/s (reading %.2f s, downsampling %.2f s).\n",
+         megapixels, secs, secs > 0.0 ? megapixels / secs : 0.0, read_secs, downsample_secs_);
+  printf("Pixel buffers: %.1f MB for bands, %.1f MB for tiles being encoded, %.1f MB for the "
+         "source.\n", band_bytes / (1024.0 * 1024.0), tile_bytes / (1024.0 * 1024.0),
+         source->buffer_bytes() / (1024.0 * 1024.0));
+  return tiles_failed_.load() == 0;
+}
+
+void PyramidBuilder::FlushBand(int level) {
+  LevelBand& band = levels_[level];
+  const int ty = band.band_y / options_.tile_height;
+  for (int x0 = 0, tx = 0; x0 < band.width; x0 += options_.tile_width, ++tx) {
+    const int width = std::min(options_.tile_width, band.width - x0);
+    if (width == options_.tile_width && band.filled == options_.tile_height) {
+      QueueTileEncode(level, tx, ty, band.rows.copy(x0, 0, width, band.filled));
+      continue;
+    }
+    // As in the Gigapan layout, border tiles have the full tile size, padded with black.
+    QImage tile(options_.tile_width, options_.tile_height, QImage::Format_RGB32);
+    tile.fill(Qt::black);
+    for (int r = 0; r < band.filled; ++r) {
+      memcpy(tile.scanLine(r), band.rows.constScanLine(r) + int64_t(x0) * 4, size_t(width) * 4);
+    }
+    QueueTileEncode(level, tx, ty, tile);
+  }
+
+  if (level > 0) {
+    LevelBand& coarser = levels_[level - 1];
+    const int out_rows = (band.filled + 1) / 2;
+    const int last_row = band.filled - 1;
+    // Computed up front: scanLine() is not safe to call from several threads.
+    uchar* dst = coarser.rows.bits() + int64_t(coarser.filled) * coarser.rows.bytesPerLine();
+    const int dst_bytes_per_line = coarser.rows.bytesPerLine();
+    const QImage& src = band.rows;
+    QElapsedTimer timer;
+    timer.start();
+    ParallelFor(&pool_, out_rows, [&](int begin, int end) {
+      for (int r = begin; r < end; ++r) {
+        const uchar* row0 = src.constScanLine(2 * r);
+        const uchar* row1 = src.constScanLine(std::min(2 * r + 1, last_row));
+        Downsample2x2Row(row0, row1, band.width, dst + int64_t(r) * dst_bytes_per_line);
+      }
+    });
+    downsample_secs_ += timer.nsecsElapsed() / 1e9;
+    coarser.filled += out_rows;
+  }
+
+  band.band_y += band.filled;
+  band.filled = 0;
+
+  if (level > 0) {
+    LevelBand& coarser = levels_[level - 1];
+    if (coarser.filled == options_.tile_height ||
+        coarser.band_y + coarser.filled == coarser.height)
+      FlushBand(level - 1);
+  }
+}
+
+void PyramidBuilder::QueueTileEncode(int level, int tx, int ty, const QImage& tile) {
+  pending_tiles_.acquire();
+  pool_.start(new TileEncodeRunnable(tile, TileFilename(level, tx, ty), options_.jpeg_quality,
+                                     &tiles_written_, &tiles_failed_, &pending_tiles_));
+}
+
+bool PyramidBuilder::WriteInfoFile() {
+  std::string filename = options_.output_dir + "/_info.txt";
+  std::ofstream f(filename.c_str());
+  if (!f.is_open()) {
+    printf("ERROR: Cannot write %s.\n", filename.c_str());
+    return false;
+  }
+  f << options_.tile_width << " " << options_.tile_height << "\n";
+  f << levels_.size() << "\n";
+  for (const LevelBand& band : levels_) {
+    f << (band.width + options_.tile_width - 1) / options_.tile_width << " "
+      << (band.height + options_.tile_height - 1) / options_.tile_height << " "
+      << band.width << " " << band.height << "\n";
+  }
+  return f.good();
+}
@@ -0,0 +1,74 @@
+#ifndef GIGAPATCHEXPLORER_PYRAMIDBUILDER_PYRAMIDBUILDER_H_
+#define GIGAPATCHEXPLORER_PYRAMIDBUILDER_PYRAMIDBUILDER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <QAtomicInt>
+#include <QImage>
+#include <QSemaphore>
+#include <QThreadPool>
+
+#include "pyramidbuilder/bandsource.h"
+
+struct PyramidBuildOptions {
+  std::string output_dir;
+  int tile_width;
+  int tile_height;
+  int jpeg_quality;
+  int num_threads;          // 0 uses one thread per core.
+  int max_pending_tiles;    // Tiles waiting to be encoded; bounds their memory. 0 derives it
+                            // from the number of threads.
+  PyramidBuildOptions()
+      : tile_width(256), tile_height(256), jpeg_quality(90), num_threads(0),
+        max_pending_tiles(0) {}
+};
+
+// Builds all levels of a tiled image pyramid in the Gigapan layout (level 0 is the coarsest, one
+// JPEG file per tile, and _info.txt) from a source image that is read in bands of tile rows.
+//
+// Every level keeps one band of tile_height rows. Once a band is full, its tiles are queued for
+// encoding on the thread pool, and the band is downsampled 2x2 (in parallel, with SIMD) into the
+// next coarser level's band, which fills up after two bands. Memory thus grows with the image
+// width but not with its height: about two finest-level bands plus the tiles being encoded, and
+// what the source buffers (for TIFF, a row of chunks of at most kTiffMaxDecodedChunkBytes each).
+class PyramidBuilder {
+public:
+  explicit PyramidBuilder(const PyramidBuildOptions& options);
+  ~PyramidBuilder();
+
+  // The pool the builder encodes and downsamples on, e.g. for the source to decode on.
+  QThreadPool* thread_pool() { return &pool_; }
+
+  // Reads the whole source and writes the pyramid. Prints progress and throughput, and returns
+  // false if the source cannot be read or tiles cannot be written.
+  bool Build(BandSource* source);
+
+private:
+  struct LevelBand {
+    int width;
+    int height;
+    QImage rows;        // tile_height rows of the level's full width.
+    int filled;         // Rows of the current band written so far.
+    int band_y;         // First row of the current band.
+  };
+
+  void InitLevels(int width, int height);
+  // Called when the band of level has all its rows: queues its tiles for encoding and passes it
+  // downsampled to the next coarser level.
+  void FlushBand(int level);
+  void QueueTileEncode(int level, int tx, int ty, const QImage& tile);
+  bool WriteInfoFile();
+  std::string TileFilename(int level, int tx, int ty) const;
+
+  PyramidBuildOptions options_;
+  QThreadPool pool_;
+  QSemaphore pending_tiles_;   // Free places for tiles waiting to be encoded.
+  QAtomicInt tiles_written_;
+  QAtomicInt tiles_failed_;
+  std::vector<LevelBand> levels_;
+  double downsample_secs_;
+};
+
+#endif  // GIGAPATCHEXPLORER_PYRAMIDBUILDER_PYRAMIDBUILDER_H_
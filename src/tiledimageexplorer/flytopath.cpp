@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <cmath>
+
+#include "tiledimageexplorer/flytopath.h"
+
+// Trade-off between zooming out and panning (sqrt(2) is what users found most natural in the
+// paper). Larger values zoom out further.
+const double kZoomPanTradeoff = 1.41421356;
+
+FlyToPath::FlyToPath()
+    : window_width_(1.0),
+      distance_(0.0),
+      r0_(0.0),
+      length_(0.0),
+      zoom_only_(true) {}
+
+void FlyToPath::Init(const CameraView& from, const CameraView& to, double window_width) {
+  from_ = from;
+  to_ = to;
+  window_width_ = std::max(1.0, window_width);
+  QPointF delta = to.center - from.center;
+  distance_ = std::sqrt(delta.x() * delta.x() + delta.y() * delta.y());
+
+  const double rho = kZoomPanTradeoff;
+  const double rho2 = rho * rho;
+  double w0 = ViewWidth(from.level_exact);
+  double w1 = ViewWidth(to.level_exact);
+  zoom_only_ = distance_ < 1e-6 * std::max(w0, w1);
+  if (zoom_only_) {
+    r0_ = 0.0;
+    length_ = std::fabs(std::log(w1 / w0)) / rho;
+    return;
+  }
+
+  // r0 and r1 are the path parameters (in "hyperbolic" units) at the two end points.
+  double b0 = (w1 * w1 - w0 * w0 + rho2 * rho2 * distance_ * distance_) /
+    (2.0 * w0 * rho2 * distance_);
+  double b1 = (w1 * w1 - w0 * w0 - rho2 * rho2 * distance_ * distance_) /
+    (2.0 * w1 * rho2 * distance_);
+  r0_ = std::log(-b0 + std::sqrt(b0 * b0 + 1.0));
+  double r1 = std::log(-b1 + std::sqrt(b1 * b1 + 1.0));
+  length_ = (r1 - r0_) / rho;
+}
+
+CameraView FlyToPath::ViewAt(double t) const {
+  if (t <= 0.0)
+    return from_;
+  if (t >= 1.0)
+    return to_;
+
+  if (zoom_only_) {
+    return CameraView(from_.center + (to_.center - from_.center) * t,
+                      from_.level_exact + (to_.level_exact - from_.level_exact) * t);
+  }
+
+  const double rho = kZoomPanTradeoff;
+  const double rho2 = rho * rho;
+  double s = t * length_;
+  double w0 = ViewWidth(from_.level_exact);
+  // u is the distance travelled along the line between the centers, w the view width.
+  double u = w0 / rho2 * (std::cosh(r0_) * std::tanh(rho * s + r0_) - std::sinh(r0_));
+  double w = w0 * std::cosh(r0_) / std::cosh(rho * s + r0_);
+  return CameraView(from_.center + (to_.center - from_.center) * (u / distance_),
+                    LevelForViewWidth(w));
+}
+
+double FlyToPath::EaseInOut(double t) {
+  t = std::min(1.0, std::max(0.0, t));
+  return t * t * (3.0 - 2.0 * t);
+}
+
+double FlyToPath::ViewWidth(double level_exact) const {
+  return window_width_ / std::pow(2.0, level_exact);
+}
+
+double FlyToPath::LevelForViewWidth(double view_width) const {
+  return std::log(window_width_ / view_width) / std::log(2.0);
+}
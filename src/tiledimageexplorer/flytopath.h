@@ -0,0 +1,46 @@
+#ifndef GIGAPATCHEXPLORER_EXPLORER_FLYTOPATH_H_
+#define GIGAPATCHEXPLORER_EXPLORER_FLYTOPATH_H_
+
+#include <QPointF>
+
+// A point of view on a tiled image: the image position shown at the window center, in pixels of
+// the coarsest level (level 0), and the exact resolution level being viewed.
+struct CameraView {
+  QPointF center;
+  double level_exact;
+  CameraView() : level_exact(0.0) {}
+  CameraView(QPointF _center, double _level_exact) : center(_center), level_exact(_level_exact) {}
+};
+
+// Smooth zoom and pan path between two views (van Wijk and Nuij, "Smooth and efficient zooming
+// and panning", 2003). Views that are far apart are connected by zooming out, panning and zooming
+// back in, so that the image appears to move at a constant speed along the whole path.
+class FlyToPath {
+public:
+  FlyToPath();
+
+  // window_width is the width of the window in pixels.
+  void Init(const CameraView& from, const CameraView& to, double window_width);
+  // View at fraction t (in [0, 1]) of the path length.
+  CameraView ViewAt(double t) const;
+  // Path length in units of the path parameter; proportional to how long the flight feels.
+  double length() const { return length_; }
+
+  // Slow start and stop for a linear animation time t in [0, 1].
+  static double EaseInOut(double t);
+
+private:
+  // Width of the window in level 0 pixels when viewing level_exact.
+  double ViewWidth(double level_exact) const;
+  double LevelForViewWidth(double view_width) const;
+
+  CameraView from_;
+  CameraView to_;
+  double window_width_;
+  double distance_;   // Distance between the centers in level 0 pixels.
+  double r0_;         // Path parameters, see Init().
+  double length_;
+  bool zoom_only_;    // Centers coincide, so the path only zooms.
+};
+
+#endif  // GIGAPATCHEXPLORER_EXPLORER_FLYTOPATH_H_
@@ -1,43 +1,29 @@
 #ifndef GIGAPATCHEXPLORER_EXPLORER_TILEDIMAGEDATA_H_
 #define GIGAPATCHEXPLORER_EXPLORER_TILEDIMAGEDATA_H_
 
-#include <memory>
+#include <QPointF>
+#include <QRect>
+#include <QSize>
 
-#include <QOpenGLTexture>
-#include <QOpenGLWidget>
-
-QT_FORWARD_DECLARE_CLASS(QOpenGLTexture)
-
-typedef std::shared_ptr<QOpenGLTexture> TexturePtr;
-
-// Contains the data needed for a single 2D array of tiles e.g. textures, etc. for the OpenGL 
-// context of its parent QOpenGLWidget.
+// The 2D array of tiles of a single level: its tile size and resolution, and which of its tiles
+// the window shows. The tile textures themselves are resident in the QTextureCache.
 class TiledImageData {
 
 public:
-  TiledImageData() {}
-  TiledImageData(QOpenGLWidget* parent, QSize tile_size);
-  ~TiledImageData();
-  TiledImageData& operator=(const TiledImageData&);
+  TiledImageData() : tile_res_(QSize(-1, -1)) {}
+  explicit TiledImageData(QSize tile_size);
 
   QSize tile_res() { return tile_res_; }
-  // Deletes the old textures and creates a new empty one with the new resolution.
-  void ResizeTextures(QSize _tile_res);
-  // Deletes all textures (keeps resolution).
-  void ClearTextures();
-  bool TexturesIsEmpty();
-  void RemoveTexture(int tx, int ty);
-  TexturePtr ReplaceTexture(int tx, int ty, TexturePtr texture);
-  TexturePtr GetTexture(int tx, int ty);
+  void set_tile_res(QSize tile_res) { tile_res_ = tile_res; }
   QRect GetVisibleTileRange(QPointF view_offset, QSize view_size, QPointF draw_scale);
-  // We make the clean up function public so that the parent can call it anytime.
-  void CleanupGL();
+  // Range of tiles (out of tile_res) that overlap the window when drawn with the given offset
+  // and scale. The range is empty (left > right or top > bottom) if none is visible.
+  static QRect ComputeVisibleTileRange(QSize tile_size, QSize tile_res, QPointF view_offset,
+                                       QSize view_size, QPointF draw_scale);
 
 private:
-  QOpenGLWidget* parent_;
   QSize tile_size_;
   QSize tile_res_;
-  std::vector<TexturePtr> textures_;
 };
 
 #endif  // GIGAPATCHEXPLORER_EXPLORER_TILEDIMAGEDATA_H_
@@ -1,11 +1,17 @@
+#include <cmath>
+
+#include <QHash>
 #include <QMessageBox>
 #include <QMouseEvent>
+#include <QSettings>
+#include <QUrl>
 
 #include "tiledimageexplorer/tiledimageexplorer.h"
 
-// For buffering the display, we use two TiledImageData levels, one for the currently viewed level
-// and another for the previous level. We do this so that we can display the previous level's tile
-// temporarily in place of missing tiles for the current level, while they are not loaded yet.
+// The TiledImageData of the currently viewed level tells which of its tiles are visible. While
+// tiles of the current level are not loaded yet, we display cached tiles of any other level in
+// their place: the matching part of the nearest cached
+// coarser tile, and on top of it, any cached finer tiles (e.g. the ones we just zoomed out of).
 // 
 // For figuring out the levels and scale factors, we keep track of view_params_.cur_level_exact 
 // which the mouse basically changes when zooming in/out.
@@ -15,7 +21,22 @@
 // initialization, we make sure CleanupGL() is called when the OpenGL context is about to be 
 // destroyed.
 
-const int EXTRA_TILES_TO_LOAD = 4;
+const int EXTRA_TILES_TO_LOAD = 2;
+// Missing tiles are drawn from cached tiles up to this many levels finer (4^depth tiles each).
+// The tile textures have no mipmaps, so deeper descendants would alias when drawn at 1/4 size.
+const int MAX_FALLBACK_DESCENDANT_DEPTH = 1;
+// Pan velocity is considered zero if the mouse did not move for this long.
+const int PAN_VELOCITY_TIMEOUT_MILLISECS = 100;
+// The coarsest levels are kept in the texture cache for good, as long as they have at most this
+// many tiles in total, so that there is always something to fall back to.
+const int MAX_PINNED_TILES = 64;
+// Number of simulated frames timed by BenchmarkTileLoop().
+const int BENCHMARK_FRAMES = 1000;
+// Number of views along a fly-to path (besides the destination) whose tiles are prefetched.
+const int FLY_TO_WAYPOINTS = 8;
+// Length of the input script of RunScriptedInputBenchmark() and the interval of its events.
+const int SCRIPTED_INPUT_MILLISECS = 6000;
+const int SCRIPTED_INPUT_TICK_MILLISECS = 16;
 
 TiledImageExplorer::TiledImageExplorer(QWidget *parent)
     : QOpenGLWidget(parent),
@@ -26,7 +47,6 @@ TiledImageExplorer::TiledImageExplorer(QWidget *parent)
       display_patch_pointers_for_fine_levels_(true),
       lookahead_depth_(0),
       opengl_functions_ptr_(nullptr),
-      texture_placeholder_(nullptr),
       tiled_image_object_(nullptr),
       draw_on_window_(std::make_shared<DrawOnWindow>(this)),
       draw_focus_patch_on_window_(std::make_shared<DrawOnWindow>(this)),
@@ -37,13 +57,31 @@ TiledImageExplorer::TiledImageExplorer(QWidget *parent)
       coarse_patch_pointers_color_(QColor(44, 123,182, 220)),
       current_patch_pointers_color_(QColor(255, 255, 0, 220)),
       fine_patch_pointers_color_(QColor(215, 25, 28, 100)),
-      draw_current_level_(true){
+      texture_cache_(nullptr),
+      focus_on_cursor_(false),
+      zoom_direction_(0),
+      draw_current_level_(true),
+      frames_painted_(0),
+      input_events_(0),
+      view_updates_(0),
+      zoom_speed_(0.0f),
+      flying_(false),
+      fly_to_duration_millisecs_(0) {
 
   patch_pointer_min_size_ = QSize(16, 16);
   patch_pointer_target_size_ = QSize(64, 64);
   view_params_.cur_level_exact = 0.0f;
   focus_patch_params_.enabled = false;
+  tile_request_scheduler_.SetPrefetchMargin(extra_tiles_);
   image_selection_.rect = new QRubberBand(QRubberBand::Rectangle, this);
+  connect(this, &QOpenGLWidget::frameSwapped, this, &TiledImageExplorer::OnFrameSwapped);
+  // The pan and zoom speeds drop to zero this long after the last input event.
+  motion_settled_timer_.setSingleShot(true);
+  motion_settled_timer_.setInterval(PAN_VELOCITY_TIMEOUT_MILLISECS + 10);
+  connect(&motion_settled_timer_, &QTimer::timeout, this, &TiledImageExplorer::OnMotionSettled);
+  scripted_input_timer_.setInterval(SCRIPTED_INPUT_TICK_MILLISECS);
+  connect(&scripted_input_timer_, &QTimer::timeout,
+          this, &TiledImageExplorer::OnScriptedInputTick);
 }
 
 TiledImageExplorer::~TiledImageExplorer() {
@@ -60,9 +98,255 @@ void TiledImageExplorer::keyPressEvent(QKeyEvent *event) {
   if (event->key() == Qt::Key_M) {
     TestMouse();
   }
+
+  if (event->key() == Qt::Key_S) {
+    PrintTileStats();
+  }
+
+  if (event->key() == Qt::Key_B) {
+    BenchmarkTileLoop();
+  }
+
+  if (event->key() == Qt::Key_F) {
+    CycleTextureFormat();
+  }
+
+  if (event->key() == Qt::Key_L) {
+    SetMotionAdaptiveLod(!tile_request_scheduler_.motion_adaptive_lod());
+  }
+
+  if (event->key() == Qt::Key_P) {
+    RunScriptedInputBenchmark();
+  }
+}
+
+void TiledImageExplorer::SetMotionAdaptiveLod(bool enabled) {
+  tile_request_scheduler_.SetMotionAdaptiveLod(enabled);
+  printf("Motion adaptive level of detail %s.\n", enabled ? "on" : "off");
+  update();
+}
+
+void TiledImageExplorer::RunScriptedInputBenchmark() {
+  if (tiled_image_object_ == nullptr || texture_cache_ == nullptr ||
+      scripted_input_timer_.isActive())
+    return;
+
+  // Every run starts from the same view with empty caches, so that runs can be compared.
+  ResetView();
+  texture_cache_->tile_loader()->CancelPendingRequests();
+  makeCurrent();
+  texture_cache_->Clear();
+  texture_cache_->InitGL(Size2DIntToQSize(tiled_image_object_->tile_size()));
+  doneCurrent();
+  texture_cache_->decoded_tile_cache()->Clear();
+  texture_cache_->tile_loader()->ResetStats();
+  tile_request_scheduler_.Invalidate();
+
+  printf("Scripted input: %d ms of panning and zooming, motion adaptive level of detail %s.\n",
+         SCRIPTED_INPUT_MILLISECS, tile_request_scheduler_.motion_adaptive_lod() ? "on" : "off");
+  scripted_input_clock_.start();
+  scripted_input_timer_.start();
+}
+
+void TiledImageExplorer::OnScriptedInputTick() {
+  qint64 elapsed = scripted_input_clock_.elapsed();
+  if (elapsed >= SCRIPTED_INPUT_MILLISECS) {
+    scripted_input_timer_.stop();
+    TileLoaderStats stats = texture_cache_->tile_loader()->GetStats();
+    double seconds = double(elapsed) / 1000.0;
+    printf("Scripted input done: %.1f tiles requested and %.1f decoded per second (%lld and %lld "
+           "in %.1f s); %lld obsolete requests dropped before decoding, %lld obsolete tiles "
+           "discarded after decoding.\n", double(stats.requested) / seconds,
+           double(stats.decoded) / seconds, stats.requested, stats.decoded, seconds,
+           stats.dropped_before_decode, stats.discarded_after_decode);
+    return;
+  }
+
+  // A third of the time each: pan left, zoom in around the center, then pan diagonally while
+  // zooming out. The events go through the same path as mouse and wheel events.
+  QPoint pan_delta;
+  int wheel_delta = 0;
+  int phase = int(elapsed * 3 / SCRIPTED_INPUT_MILLISECS);
+  if (phase == 0) {
+    pan_delta = QPoint(-40, 0);
+  } else if (phase == 1) {
+    wheel_delta = 30;
+  } else {
+    pan_delta = QPoint(30, 30);
+    wheel_delta = -30;
+  }
+
+  if (!pan_delta.isNull()) {
+    UpdatePanVelocity(pan_delta.x(), pan_delta.y());
+    pending_input_.pan_delta += pan_delta;
+  }
+  if (wheel_delta != 0) {
+    focus_on_cursor_ = true;
+    cursor_focus_pos_ = QPoint(width() / 2, height() / 2);
+    zoom_direction_ = (wheel_delta > 0) ? 1 : -1;
+    pending_input_.wheel_delta += wheel_delta;
+    pending_input_.zoom_center = cursor_focus_pos_;
+  }
+  input_events_++;
+  update();
+}
+
+void TiledImageExplorer::BenchmarkTileLoop() {
+  if (tiled_image_object_ == nullptr)
+    return;
+
+  const int level = view_params_.cur_level();
+  QRect tile_range = current_tiles.GetVisibleTileRange(view_params_.view_offset, size(),
+                                                       QPointF(view_params_.cur_draw_scale,
+                                                       view_params_.cur_draw_scale));
+  if (tile_range.isEmpty())
+    return;
+
+  // Both lookups find every visible tile, as in a frame where everything is loaded.
+  const int dummy_layer = 0;
+  QHash<QString, int> filename_cache;
+  std::unordered_map<TileKey, int, TileKeyHashFunc> key_cache;
+  for (int ty = tile_range.top(); ty <= tile_range.bottom(); ++ty) {
+    for (int tx = tile_range.left(); tx <= tile_range.right(); ++tx) {
+      filename_cache.insert(QString(tiled_image_object_->GetTileFilename(level, tx, ty).c_str()),
+                            dummy_layer);
+      key_cache[tiled_image_object_->GetTileKey(level, tx, ty)] = dummy_layer;
+    }
+  }
+
+  // Previous tile loop: build the filename, then Contains() + GetTexture() on a QString cache.
+  volatile size_t found = 0;
+  QElapsedTimer timer;
+  timer.start();
+  for (int frame = 0; frame < BENCHMARK_FRAMES; ++frame) {
+    for (int ty = tile_range.top(); ty <= tile_range.bottom(); ++ty) {
+      for (int tx = tile_range.left(); tx <= tile_range.right(); ++tx) {
+        QString tilename(tiled_image_object_->GetTileFilename(level, tx, ty).c_str());
+        if (filename_cache.contains(tilename)) {
+          found += size_t(filename_cache.value(tilename) >= 0);
+        }
+      }
+    }
+  }
+  double filename_microsecs = double(timer.nsecsElapsed()) / 1000.0 / double(BENCHMARK_FRAMES);
+
+  // Current tile loop: a single lookup by tile key.
+  timer.restart();
+  for (int frame = 0; frame < BENCHMARK_FRAMES; ++frame) {
+    for (int ty = tile_range.top(); ty <= tile_range.bottom(); ++ty) {
+      for (int tx = tile_range.left(); tx <= tile_range.right(); ++tx) {
+        auto it = key_cache.find(tiled_image_object_->GetTileKey(level, tx, ty));
+        if (it != key_cache.end()) {
+          found += size_t(it->second >= 0);
+        }
+      }
+    }
+  }
+  double key_microsecs = double(timer.nsecsElapsed()) / 1000.0 / double(BENCHMARK_FRAMES);
+
+  printf("Tile loop over %d visible tiles, averaged over %d frames: %.2f us with filenames, "
+         "%.2f us with tile keys (%.1fx).\n", int(key_cache.size()), BENCHMARK_FRAMES,
+         filename_microsecs, key_microsecs,
+         (key_microsecs > 0.0) ? filename_microsecs / key_microsecs : 0.0);
+}
+
+// Texture formats are remembered per image directory in the "textureFormats" settings group. The
+// directory is percent encoded because setting keys must not contain slashes.
+static QString TextureFormatSettingKey(const std::string& source_dir) {
+  return QString("textureFormats/") +
+    QString(QUrl::toPercentEncoding(QString::fromStdString(source_dir)));
+}
+
+void TiledImageExplorer::LoadTextureFormatSetting() {
+  if (texture_cache_ == nullptr || tiled_image_object_ == nullptr)
+    return;
+
+  QSettings settings("KAUST", "GigaPatchExplorer");
+  // Used for images without a format of their own.
+  QString default_format = settings.value("textureFormat", "rgba8").toString();
+  QString name = settings.value(TextureFormatSettingKey(tiled_image_object_->source_dir()),
+                                default_format).toString();
+  TileTextureFormat format = TileTextureFormat_RGBA8;
+  if (!ParseTileTextureFormat(name.toStdString(), &format)) {
+    printf("Warning! Unknown texture format %s, using rgba8.\n", name.toStdString().c_str());
+  }
+  texture_cache_->SetTextureFormat(format);
+}
+
+void TiledImageExplorer::SetTextureFormat(TileTextureFormat format) {
+  if (texture_cache_ == nullptr || tiled_image_object_ == nullptr)
+    return;
+
+  QSettings settings("KAUST", "GigaPatchExplorer");
+  settings.setValue(TextureFormatSettingKey(tiled_image_object_->source_dir()),
+                    QString(TileTextureFormatName(format)));
+  texture_cache_->SetTextureFormat(format);
+  makeCurrent();
+  texture_cache_->InitGL(QSize(tiled_image_object_->tile_size().width,
+                               tiled_image_object_->tile_size().height));
+  doneCurrent();
+  update();
+}
+
+void TiledImageExplorer::CycleTextureFormat() {
+  if (texture_cache_ == nullptr)
+    return;
+  SetTextureFormat(TileTextureFormat((texture_cache_->texture_format() + 1) %
+                                     TileTextureFormat_COUNT));
+}
+
+void TiledImageExplorer::PrintTileStats() {
+  if (texture_cache_ == nullptr)
+    return;
+  TileLoaderStats stats = texture_cache_->tile_loader()->GetStats();
+  printf("Tile loader: %lld requested, %lld decoded (%lld failed, %lld synthesized), "
+         "%lld from decoded cache, %lld reprioritized.\n", stats.requested, stats.decoded,
+         stats.failed, stats.synthesized, stats.served_from_cache, stats.reprioritized);
+  printf("Saved work: %lld obsolete requests dropped before decoding, "
+         "%lld obsolete tiles discarded after decoding.\n",
+         stats.dropped_before_decode, stats.discarded_after_decode);
+
+  TextureCacheStats cache_stats = texture_cache_->GetStats();
+  printf("Texture cache: %lld hits, %lld misses, %lld evictions, %.1f of %.1f MB resident "
+         "(%.1f MB allocated).\n", cache_stats.hits, cache_stats.misses, cache_stats.evictions,
+         double(cache_stats.resident_bytes) / (1024.0 * 1024.0),
+         double(cache_stats.budget_bytes) / (1024.0 * 1024.0),
+         double(cache_stats.allocated_bytes) / (1024.0 * 1024.0));
+  printf("Texture pool (%s): %d of %d slots used, %d free; %lld uploads (%lld streamed), "
+         "%lld into recycled slots.\n",
+         TileTextureFormatName(texture_cache_->texture_array()->format()),
+         cache_stats.used_slots, cache_stats.total_slots, cache_stats.free_slots,
+         cache_stats.uploads, cache_stats.streamed_uploads, cache_stats.slot_reuses);
+  printf("Upload budget: %.1f MB per frame (last frame %.1f ms); %lld uploads deferred to a "
+         "later frame, %lld dropped as obsolete.\n",
+         double(cache_stats.upload_bytes_per_frame) / (1024.0 * 1024.0),
+         cache_stats.last_frame_millisecs, cache_stats.deferred_uploads,
+         cache_stats.dropped_uploads);
+  printf("Last frame: %d tiles in one draw call.\n", draw_tile_->num_tiles());
+  printf("Frames: %lld painted, %lld with view updates merged from %lld input events.\n",
+         frames_painted_, view_updates_, input_events_);
+  printf("Motion adaptive level of detail %s; last ranking %d levels coarser than the view.\n",
+         tile_request_scheduler_.motion_adaptive_lod() ? "on" : "off",
+         tile_request_scheduler_.motion_lod_levels());
+  for (size_t level = 0; level < cache_stats.resident_bytes_per_level.size(); ++level) {
+    if (cache_stats.resident_tiles_per_level[level] == 0)
+      continue;
+    printf("  Level %d: %d tiles, %.1f MB.\n", int(level),
+           cache_stats.resident_tiles_per_level[level],
+           double(cache_stats.resident_bytes_per_level[level]) / (1024.0 * 1024.0));
+  }
+
+  DecodedTileCacheStats decoded_stats = texture_cache_->decoded_tile_cache()->GetStats();
+  printf("Decoded tile cache: %lld hits, %lld misses, %lld evictions, %d tiles, "
+         "%.1f of %.1f MB resident.\n", decoded_stats.hits, decoded_stats.misses,
+         decoded_stats.evictions, decoded_stats.resident_tiles,
+         double(decoded_stats.resident_bytes) / (1024.0 * 1024.0),
+         double(decoded_stats.budget_bytes) / (1024.0 * 1024.0));
 }
 
 void TiledImageExplorer::ResetView() {
+	StopFlyTo();
+	focus_on_cursor_ = false;
 	InitViewParams();
 	InitTiledImageData(); // Initialize empty tiled image data containers.
 	initializeGL();
@@ -77,56 +361,102 @@ void TiledImageExplorer::TestMouse() {
   mouseMoveEvent(test);
   update();
   */
-  ZoomToPosition(0, 0, 0, 20, 10);
+  ZoomToPosition(0, 0, 0);
 }
 
-void TiledImageExplorer::ZoomToPosition(int level, int global_x, int global_y, 
-                                        int num_steps, int millisecs_delay_per_step) {
+void TiledImageExplorer::ZoomToPosition(int level, int global_x, int global_y,
+                                        int duration_millisecs) {
+  if (tiled_image_object_ == nullptr)
+    return;
 
-  QPoint current_image_pos_centered = ConvertToImagePosInLevel(
-    QPoint(width() / 2, height() / 2), view_params_.cur_level());
+  ApplyPendingInput();
+  level = qBound(0, level, tiled_image_object_->num_levels() - 1);
+  CameraView target(QPointF(double(global_x), double(global_y)) / std::pow(2.0, double(level)),
+                    double(level));
+  fly_to_path_.Init(GetCameraView(), target, double(width()));
+  fly_to_duration_millisecs_ = qMax(1, duration_millisecs);
+
+  // The views the path passes through, so that their tiles load during the flight.
+  QPointF window_center(double(width()) / 2.0, double(height()) / 2.0);
+  fly_to_waypoints_.clear();
+  fly_to_waypoint_params_.clear();
+  for (int i = 1; i <= FLY_TO_WAYPOINTS + 1; ++i) {
+    double param = double(i) / double(FLY_TO_WAYPOINTS + 1);
+    CameraView view = fly_to_path_.ViewAt(param);
+    double level_exact = qBound(0.0, view.level_exact,
+                                double(tiled_image_object_->num_levels() - 1));
+    fly_to_waypoints_.push_back(ViewWaypoint(
+      window_center - view.center * std::pow(2.0, level_exact), level_exact));
+    fly_to_waypoint_params_.push_back(param);
+  }
+  tile_request_scheduler_.SetFlightPath(fly_to_waypoints_);
 
-  QPointF target_image_pos_centered(
-    float(global_x) * std::pow(2, view_params_.cur_level_exact - float(level)), 
-    float(global_y) * std::pow(2, view_params_.cur_level_exact - float(level)));
+  focus_on_cursor_ = false;
+  flying_ = true;
+  fly_to_timer_.start();
+  update();
+}
 
-  // Compute step size in zoom level.
-  float current_level = view_params_.cur_level_exact;
-  float target_level = float(level);
-  float total_zoom_diff = target_level - current_level;
-  float zoom_delta = total_zoom_diff / float(num_steps);
+void TiledImageExplorer::StopFlyTo() {
+  if (!flying_)
+    return;
+  flying_ = false;
+  fly_to_waypoints_.clear();
+  fly_to_waypoint_params_.clear();
+  tile_request_scheduler_.SetFlightPath(fly_to_waypoints_);
+}
 
-  // Compute step size in image space at current level.
-  float x_delta = (target_image_pos_centered.x() - float(current_image_pos_centered.x())) / 
-    float(num_steps);
-  float y_delta = float(target_image_pos_centered.y() - float(current_image_pos_centered.y())) /
-    float(num_steps);
+void TiledImageExplorer::AdvanceFlyTo() {
+  if (!flying_)
+    return;
 
-  // Do steps.
-  float prev_level_exact = view_params_.cur_level_exact;
-  for (int step = 0; step < num_steps; ++step) {
+  // Progress depends on the time since the start, not on the number of frames painted.
+  double t = double(fly_to_timer_.elapsed()) / double(fly_to_duration_millisecs_);
+  double param = FlyToPath::EaseInOut(t);
+  SetCameraView(fly_to_path_.ViewAt(param));
 
-    // Translate. To move the center point to one direction, we need to add offsets with the opposite
-    // sign.
-    AdjustGlobalTranslation(QPointF(-x_delta, -y_delta));
+  // Waypoints that were passed are not worth loading any more.
+  size_t passed = 0;
+  while (passed + 1 < fly_to_waypoint_params_.size() && fly_to_waypoint_params_[passed] <= param) {
+    passed++;
+  }
+  if (passed > 0) {
+    fly_to_waypoints_.erase(fly_to_waypoints_.begin(), fly_to_waypoints_.begin() + passed);
+    fly_to_waypoint_params_.erase(fly_to_waypoint_params_.begin(),
+                                  fly_to_waypoint_params_.begin() + passed);
+    tile_request_scheduler_.SetFlightPath(fly_to_waypoints_);
+  }
 
-    // Zoom. Always use the center of the window as zoom center pos.
-    UpdateViewParams(zoom_delta, QPoint(width()/2, height()/2));
+  if (t >= 1.0) {
+    StopFlyTo();
+  }
+}
 
-    // Adjust x and y delta based on new level
-    x_delta = x_delta * std::pow(2, view_params_.cur_level_exact - prev_level_exact);
-    y_delta = y_delta * std::pow(2, view_params_.cur_level_exact - prev_level_exact);
-    prev_level_exact = view_params_.cur_level_exact;
+CameraView TiledImageExplorer::GetCameraView() {
+  QPointF window_center(double(width()) / 2.0, double(height()) / 2.0);
+  double level_exact = view_params_.cur_level_exact;
+  return CameraView((window_center - view_params_.view_offset) / std::pow(2.0, level_exact),
+                    level_exact);
+}
 
-    QTDelay(millisecs_delay_per_step);
-  }
+void TiledImageExplorer::SetCameraView(const CameraView& camera_view) {
+  // UpdateViewParams() takes care of level switches; the offset is then set to match the center.
+  QPoint window_center(width() / 2, height() / 2);
+  UpdateViewParams(camera_view.level_exact - view_params_.cur_level_exact, window_center);
+  view_params_.view_offset = QPointF(window_center) -
+    camera_view.center * std::pow(2.0, view_params_.cur_level_exact);
 }
 
 bool TiledImageExplorer::AttachTiledImageObject(std::shared_ptr<TiledImageObject> tiled_image_object) {
   if (tiled_image_object == nullptr)
     return false;
 
+  StopFlyTo();
   tiled_image_object_ = tiled_image_object;
+  tile_request_scheduler_.SetTiledImageObject(tiled_image_object_);
+  PinCoarseLevels();
+  LoadTextureFormatSetting();
+  focus_on_cursor_ = false;
   InitViewParams();     // Compute initial view parameters so image fits in window.
   InitTiledImageData(); // Initialize empty tiled image data containers.
   initializeGL();       // Initialize GL with correct tiled image parameters.
@@ -134,6 +464,22 @@ bool TiledImageExplorer::AttachTiledImageObject(std::shared_ptr<TiledImageObject
   return true;
 }
 
+void TiledImageExplorer::PinCoarseLevels() {
+  if (texture_cache_ == nullptr || tiled_image_object_ == nullptr)
+    return;
+
+  int num_tiles = 0;
+  int max_level = -1;
+  for (int level = 0; level < tiled_image_object_->num_levels(); ++level) {
+    Size2DInt tile_res = tiled_image_object_->tileres_for_level(level);
+    num_tiles += tile_res.width * tile_res.height;
+    if (num_tiles > MAX_PINNED_TILES)
+      break;
+    max_level = level;
+  }
+  texture_cache_->SetPinnedLevels(max_level);
+}
+
 void TiledImageExplorer::SetClearColor(const QColor &color) {
   clear_color_ = color;
   update();
@@ -147,6 +493,17 @@ QSize TiledImageExplorer::sizeHint() const {
   return QSize(64 * 21, 64 * 10);
 }
 
+void TiledImageExplorer::SetPrefetchMargin(int num_tiles) {
+  extra_tiles_ = Size2DInt(qMax(0, num_tiles), qMax(0, num_tiles));
+  tile_request_scheduler_.SetPrefetchMargin(extra_tiles_);
+  update();
+}
+
+void TiledImageExplorer::SetZoomPrefetchDepth(int depth) {
+  tile_request_scheduler_.SetZoomPrefetchDepth(qBound(0, depth, 2));
+  update();
+}
+
 void TiledImageExplorer::SetPatchCoordsToDraw(std::vector<PatchCoords>& patches_to_draw) {
   patches_to_draw_ = patches_to_draw;
   update();
@@ -202,6 +559,9 @@ void TiledImageExplorer::initializeGL() {
     opengl_functions_ptr_ = new QOpenGLFunctions();
     opengl_functions_ptr_->initializeOpenGLFunctions();
   }
+  if (texture_cache_ != nullptr) {
+    texture_cache_->AutoDetectBudget();
+  }
 
   if (tiled_image_object_ == nullptr)
     return;
@@ -211,8 +571,8 @@ void TiledImageExplorer::initializeGL() {
   draw_on_window_->Init(size());
   draw_focus_patch_on_window_->Init(size());
   AssignPatchPointersColors();
-  if (texture_placeholder_ == nullptr) {
-    texture_placeholder_ = std::make_shared<QOpenGLTexture>(CreateCheckerboardPattern(tile_size));
+  if (texture_cache_ != nullptr) {
+    texture_cache_->InitGL(tile_size);
   }
 
 
@@ -226,12 +586,27 @@ void TiledImageExplorer::paintGL() {
   QPainter painter(this);
   painter.beginNativePainting();
 
+  // Frames are only painted when something asked for one with update(): input, newly loaded
+  // tiles or uploads left for later. There is no timer, so an idle viewer does no work.
+  frames_painted_++;
+  AdvanceFlyTo();
+  ApplyPendingInput();
+
   opengl_functions_ptr_->glClearColor(clear_color_.redF(), clear_color_.greenF(),
                                       clear_color_.blueF(), clear_color_.alphaF());
   opengl_functions_ptr_->glDisable(GL_DEPTH_TEST);
   opengl_functions_ptr_->glClear(GL_COLOR_BUFFER_BIT);
   opengl_functions_ptr_->glDisable(GL_BLEND);
-  
+
+  if (texture_cache_ != nullptr) {
+    texture_cache_->BeginFrame();
+    bool tiles_uploaded = texture_cache_->UploadLoadedTextures() > 0;
+    ScheduleTileRequests(tiles_uploaded);
+    // The upload budget left tiles for the next frames.
+    if (texture_cache_->HasPendingUploads()) {
+      update();
+    }
+  }
   DrawTiles();
 
   opengl_functions_ptr_->glEnable(GL_BLEND);
@@ -280,7 +655,12 @@ void TiledImageExplorer::resizeGL(int width, int height) {
 }
 
 void TiledImageExplorer::mousePressEvent(QMouseEvent *event) {
+  StopFlyTo();
+  // The selection below is in window coordinates of the current view.
+  ApplyPendingInput();
   last_mouse_pos_ = event->pos();
+  pan_velocity_ = QPointF(0.0f, 0.0f);
+  pan_timer_.start();
 
   // Create new selection when SHIFT key is held.
   if (event->modifiers() & Qt::ShiftModifier) {
@@ -304,8 +684,11 @@ void TiledImageExplorer::mouseMoveEvent(QMouseEvent *event) {
     image_selection_.rect->setGeometry(QRect(image_selection_.origin, event->pos()).normalized());
   } else {
     if (event->buttons() & Qt::LeftButton) {
-      AdjustSelectionTranslation(dx, dy);
-      AdjustGlobalTranslation(QPointF(float(dx), float(dy)));
+      focus_on_cursor_ = false;  // While dragging, the view center is what the user looks at.
+      UpdatePanVelocity(dx, dy);
+      pending_input_.pan_delta += QPoint(dx, dy);
+      input_events_++;
+      update();
     }
   }
 
@@ -313,6 +696,13 @@ void TiledImageExplorer::mouseMoveEvent(QMouseEvent *event) {
 }
 
 void TiledImageExplorer::mouseReleaseEvent(QMouseEvent * event) {
+  ApplyPendingInput();
+  // Panning stopped, so prefetch evenly around the view again.
+  if (!pan_velocity_.isNull()) {
+    pan_velocity_ = QPointF(0.0f, 0.0f);
+    update();
+  }
+
   if (image_selection_.rect->isVisible() && event->modifiers() & Qt::ShiftModifier) {
     if ((image_selection_.origin.x() < last_mouse_pos_.x()) &&
         (image_selection_.origin.y() < last_mouse_pos_.y())) {
@@ -332,13 +722,102 @@ void TiledImageExplorer::wheelEvent(QWheelEvent *event) {
   // TODO (ronell): Adjust selection. For now hide it.
   image_selection_.rect->hide();
 
-  AdjustGlobalZoom(event->delta(), event->pos());
+  StopFlyTo();
+  // Load tiles around the zoom center first.
+  focus_on_cursor_ = true;
+  cursor_focus_pos_ = event->pos();
+  zoom_direction_ = (event->delta() > 0) ? 1 : ((event->delta() < 0) ? -1 : 0);
+  pending_input_.wheel_delta += event->delta();
+  pending_input_.zoom_center = event->pos();
+  input_events_++;
+  update();
   event->accept();
 }
 
+void TiledImageExplorer::hideEvent(QHideEvent *event) {
+  // Nothing is painted while hidden, so decoding tiles would only take CPU time.
+  if (texture_cache_ != nullptr) {
+    texture_cache_->tile_loader()->CancelPendingRequests();
+  }
+  tile_request_scheduler_.Invalidate();
+  QOpenGLWidget::hideEvent(event);
+}
+
+void TiledImageExplorer::showEvent(QShowEvent *event) {
+  QOpenGLWidget::showEvent(event);
+  tile_request_scheduler_.Invalidate();
+  update();
+}
+
+void TiledImageExplorer::ApplyPendingInput() {
+  if (pending_input_.empty())
+    return;
+
+  PendingInput input = pending_input_;
+  pending_input_ = PendingInput();
+  if (!input.pan_delta.isNull()) {
+    AdjustSelectionTranslation(input.pan_delta.x(), input.pan_delta.y());
+    AdjustGlobalTranslation(QPointF(input.pan_delta));
+  }
+  if (input.wheel_delta != 0 && tiled_image_object_ != nullptr) {
+    double prev_level_exact = view_params_.cur_level_exact;
+    AdjustGlobalZoom(input.wheel_delta, input.zoom_center);
+    UpdateZoomSpeed(float(view_params_.cur_level_exact - prev_level_exact));
+  }
+  view_updates_++;
+}
+
 void TiledImageExplorer::AdjustGlobalTranslation(QPointF translation_delta) {
+  // Callers repaint (or are called from paintGL()).
   view_params_.view_offset += translation_delta;
-  update();
+}
+
+void TiledImageExplorer::UpdatePanVelocity(int dx, int dy) {
+  if (!pan_timer_.isValid()) {
+    pan_timer_.start();
+    return;
+  }
+  qint64 elapsed = pan_timer_.restart();
+  if (elapsed <= 0)
+    return;
+
+  // Smooth the per-event velocity since mouse events arrive at irregular intervals.
+  QPointF velocity(float(dx) / float(elapsed), float(dy) / float(elapsed));
+  if (elapsed > PAN_VELOCITY_TIMEOUT_MILLISECS) {
+    pan_velocity_ = velocity;
+  } else {
+    pan_velocity_ = 0.5f * pan_velocity_ + 0.5f * velocity;
+  }
+}
+
+void TiledImageExplorer::UpdateZoomSpeed(float level_delta) {
+  if (!zoom_timer_.isValid()) {
+    zoom_timer_.start();
+    return;
+  }
+  qint64 elapsed = zoom_timer_.restart();
+  if (elapsed <= 0)
+    return;
+
+  // Smoothed like the pan velocity, so a single wheel step after a pause does not count as fast.
+  float speed = std::fabs(level_delta) * 1000.0f / float(elapsed);
+  if (elapsed > PAN_VELOCITY_TIMEOUT_MILLISECS) {
+    zoom_speed_ = speed;
+  } else {
+    zoom_speed_ = 0.5f * zoom_speed_ + 0.5f * speed;
+  }
+}
+
+float TiledImageExplorer::GetZoomSpeed() {
+  if (!zoom_timer_.isValid() || zoom_timer_.elapsed() > PAN_VELOCITY_TIMEOUT_MILLISECS)
+    return 0.0f;
+  return zoom_speed_;
+}
+
+QPointF TiledImageExplorer::GetPanVelocity() {
+  if (!pan_timer_.isValid() || pan_timer_.elapsed() > PAN_VELOCITY_TIMEOUT_MILLISECS)
+    return QPointF(0.0f, 0.0f);
+  return pan_velocity_;
 }
 
 void TiledImageExplorer::AdjustSelectionTranslation(int dx, int dy) {
@@ -354,8 +833,8 @@ void TiledImageExplorer::AdjustGlobalZoom(int zoom_delta, QPoint zoom_center) {
   // sure what king of scaling is used here, but it seems to work ok.
   // Lower the zoom sensitivity for more sensitive mouse (default: kZoomSensitivity = 0.6f).
   const float kZoomSensitivity = 0.6f;
-  float level_delta = (qreal(zoom_delta * (view_params_.cur_level() + 1)) * 0.25) /
-    (1200.0f * kZoomSensitivity);
+  double level_delta = (qreal(zoom_delta * (view_params_.cur_level() + 1)) * 0.25) /
+    (1200.0 * kZoomSensitivity);
   UpdateViewParams(level_delta, zoom_center);
 }
 
@@ -364,12 +843,12 @@ void TiledImageExplorer::CleanupGL() {
     return;
   }
   makeCurrent();
-  texture_placeholder_ = nullptr;
   draw_tile_->CleanupGL();
   draw_on_window_->CleanupGL();
   draw_focus_patch_on_window_->CleanupGL();
-  current_tiles.CleanupGL();
-  previous_tiles_.CleanupGL();
+  if (texture_cache_ != nullptr) {
+    texture_cache_->Clear();
+  }
   delete(opengl_functions_ptr_);
   opengl_functions_ptr_ = nullptr;
   doneCurrent();
@@ -387,33 +866,31 @@ void TiledImageExplorer::InitViewParams() {
     }
   }
 
-  view_params_.cur_level_exact = float(ref_level);
+  view_params_.cur_level_exact = double(ref_level);
   view_params_.prev_level = view_params_.cur_level();
-  view_params_.cur_draw_scale = view_params_.prev_draw_scale = 1.0f;
-  view_params_.view_offset.setX((float(width()) / 2.0f) - 
-                                (float(tiled_image_object_->imgres_for_level(ref_level).width) /
-                                2.0f));
-  view_params_.view_offset.setY((float(height()) / 2.0f) -
-                                (float(tiled_image_object_->imgres_for_level(ref_level).height) /
-                                2.0f));
+  view_params_.cur_draw_scale = 1.0;
+  view_params_.view_offset.setX((double(width()) / 2.0) - 
+                                (double(tiled_image_object_->imgres_for_level(ref_level).width) /
+                                2.0));
+  view_params_.view_offset.setY((double(height()) / 2.0) -
+                                (double(tiled_image_object_->imgres_for_level(ref_level).height) /
+                                2.0));
 }
 
-void TiledImageExplorer::UpdateViewParams(float level_delta, QPoint zoom_center) {
+void TiledImageExplorer::UpdateViewParams(double level_delta, QPoint zoom_center) {
   int prev_level = view_params_.cur_level();
-  float prev_cur_level_exact = view_params_.cur_level_exact;
-  float prev_draw_scale = view_params_.cur_draw_scale;
+  double prev_cur_level_exact = view_params_.cur_level_exact;
 
   // Update exact level and drawing scale factor for current level:
-  view_params_.cur_level_exact = qBound(0.0f, view_params_.cur_level_exact + level_delta,
-                                       float(tiled_image_object_->num_levels() - 1));
-  view_params_.cur_draw_scale = pow(2.0f,
-                                   view_params_.cur_level_exact - float(view_params_.cur_level()));
+  view_params_.cur_level_exact = qBound(0.0, view_params_.cur_level_exact + level_delta,
+                                       double(tiled_image_object_->num_levels() - 1));
+  view_params_.cur_draw_scale = view_params_.draw_scale_for_level(view_params_.cur_level());
 
   // Update view offset: we center the zooming relative to the mouse position,
   // hence the translation before and after the scaling.
-  QPointF pos(float(zoom_center.x()), float(zoom_center.y()));
+  QPointF pos(double(zoom_center.x()), double(zoom_center.y()));
   QPointF center = pos - view_params_.view_offset;
-  center *= (pow(2.0f, view_params_.cur_level_exact) / pow(2.0f, prev_cur_level_exact));
+  center *= std::pow(2.0, view_params_.cur_level_exact - prev_cur_level_exact);
   view_params_.view_offset = pos - center;
 
   // Update resolution levels if we switch from one level to another:
@@ -424,22 +901,16 @@ void TiledImageExplorer::UpdateViewParams(float level_delta, QPoint zoom_center)
     RefreshTiledImageData();
     printf("Switched from level %d to %d.\n", view_params_.prev_level, view_params_.cur_level());
   }
-
-  // Update drawing scale factor for previous level.
-  view_params_.prev_draw_scale = pow(2.0f,
-                                     view_params_.cur_level_exact - float(view_params_.prev_level));
-  update();
 }
 
 bool TiledImageExplorer::InitTiledImageData() {
   if (tiled_image_object_->tile_size().width <= 0 || tiled_image_object_->tile_size().height <= 0)
     return false;
 
-  previous_tiles_ = TiledImageData(this, Size2DIntToQSize(tiled_image_object_->tile_size()));
-  current_tiles = TiledImageData(this, Size2DIntToQSize(tiled_image_object_->tile_size()));
+  current_tiles = TiledImageData(Size2DIntToQSize(tiled_image_object_->tile_size()));
 
   if (tiled_image_object_->num_levels() > 0) {
-    current_tiles.ResizeTextures(Size2DIntToQSize(
+    current_tiles.set_tile_res(Size2DIntToQSize(
       tiled_image_object_->tileres_for_level(view_params_.cur_level())));
   }
   return true;
@@ -447,12 +918,7 @@ bool TiledImageExplorer::InitTiledImageData() {
 
 
 void TiledImageExplorer::RefreshTiledImageData() {
-
-  previous_tiles_.ClearTextures();
-  previous_tiles_ = current_tiles;
-
-  current_tiles = TiledImageData(this, Size2DIntToQSize(tiled_image_object_->tile_size()));
-  current_tiles.ResizeTextures(Size2DIntToQSize(
+  current_tiles.set_tile_res(Size2DIntToQSize(
     tiled_image_object_->tileres_for_level(view_params_.cur_level())));
 }
 
@@ -460,8 +926,15 @@ void TiledImageExplorer::DrawTiles() {
   if (tiled_image_object_ == nullptr) 
     return;   // don't draw anything if not initialized
 
-  DrawPreviousTilesGlobal();
+  if (texture_cache_ == nullptr)
+    return;
+
+  // Missing current tiles are covered by cached ancestors and descendants first, then the
+  // current tiles are drawn. All of them are collected and drawn with one draw call.
+  draw_tile_->BeginTiles();
+  DrawFallbackTilesGlobal();
   DrawCurrentTilesGlobal();
+  draw_tile_->DrawTiles(texture_cache_->texture_array());
 }
 
 void TiledImageExplorer::DrawCurrentTilesGlobal() {
@@ -475,72 +948,194 @@ void TiledImageExplorer::DrawCurrentTilesGlobal() {
                                                        QPointF(view_params_.cur_draw_scale,
                                                        view_params_.cur_draw_scale));
 
-  int next_tile_tx = -1;
-  int next_tile_ty = -1;
-  
   for (int ty = tile_range.top(); ty <= tile_range.bottom(); ++ty) {
     for (int tx = tile_range.left(); tx <= tile_range.right(); ++tx) {
 
-      QPointF tileTranslation(tx * tiled_image_object_->tile_size().width,
-                              ty * tiled_image_object_->tile_size().height);
+      QPointF tileTranslation(double(tx) * tiled_image_object_->tile_size().width,
+                              double(ty) * tiled_image_object_->tile_size().height);
 
 
-      std::string tilename = tiled_image_object_->GetTileFilename(view_params_.cur_level(), tx, ty);
-      if (texture_cache_->Contains(tilename)) {
+      TileKey key = tiled_image_object_->GetTileKey(view_params_.cur_level(), tx, ty);
+      int layer = texture_cache_->GetTextureLayer(key);
+      if (layer >= 0) {
 
         // Draw textured quad for this tile at given location (local translation).
-        draw_tile_->DrawTileAt(tileTranslation, texture_cache_->GetTexture(tilename));
+        draw_tile_->AddTileAt(tileTranslation, layer);
 
-      } else if (next_tile_tx == -1) {  // Mark for loading next time
-          next_tile_tx = tx;
-          next_tile_ty = ty;
       }
     }
   }
-
-  // Load needed tile
-  if (next_tile_tx > -1) {
-    UpdateSingleTileGlobal(view_params_.cur_level(), next_tile_tx, next_tile_ty);
-    update();
-  }
 }
 
-void TiledImageExplorer::DrawPreviousTilesGlobal() {
+void TiledImageExplorer::DrawFallbackTilesGlobal() {
   if (tiled_image_object_ == nullptr)
     return; // Don't draw anything if there is no object attached
 
-  draw_tile_->SetGlobalTranslation(view_params_.view_offset);
-  
-  draw_tile_->SetGlobalScaleFactor(QPointF(view_params_.prev_draw_scale,
-       view_params_.prev_draw_scale));
-  QRect tile_range = previous_tiles_.GetVisibleTileRange(view_params_.view_offset, size(),
-                                                           QPointF(view_params_.prev_draw_scale,
-                                                           view_params_.prev_draw_scale));
-
+  const int level = view_params_.cur_level();
+  QRect tile_range = current_tiles.GetVisibleTileRange(view_params_.view_offset, size(),
+                                                       QPointF(view_params_.cur_draw_scale,
+                                                       view_params_.cur_draw_scale));
+  std::vector<PatchTile> missing_tiles;
   for (int ty = tile_range.top(); ty <= tile_range.bottom(); ++ty) {
     for (int tx = tile_range.left(); tx <= tile_range.right(); ++tx) {
-    
-        QPointF tileTranslation(tx * tiled_image_object_->tile_size().width,
-                                ty * tiled_image_object_->tile_size().height);
-                
-        std::string tilename = tiled_image_object_->GetTileFilename(view_params_.prev_level, tx, ty);
-        if (texture_cache_->Contains(tilename)) {
+      if (!texture_cache_->Contains(tiled_image_object_->GetTileKey(level, tx, ty))) {
+        missing_tiles.push_back(PatchTile(tx, ty));
+      }
+    }
+  }
+  if (missing_tiles.empty())
+    return;
 
-          // Draw textured quad for this tile at given location (local translation).
-          draw_tile_->DrawTileAt(tileTranslation, texture_cache_->GetTexture(tilename));
+  DrawAncestorTilesGlobal(level, missing_tiles);
 
-        } else {
+  // Finer tiles that are still cached (e.g. after zooming out) are drawn downscaled on top, the
+  // closest level last.
+  for (int levels_down = MAX_FALLBACK_DESCENDANT_DEPTH; levels_down >= 1; --levels_down) {
+    DrawDescendantTilesGlobal(level, levels_down, missing_tiles);
+  }
+}
 
-          draw_tile_->DrawTileAt(tileTranslation, texture_placeholder_.get());
+void TiledImageExplorer::DrawAncestorTilesGlobal(int level,
+                                                 const std::vector<PatchTile>& missing_tiles) {
+  draw_tile_->SetGlobalTranslation(view_params_.view_offset);
+  draw_tile_->SetGlobalScaleFactor(QPointF(view_params_.cur_draw_scale,
+    view_params_.cur_draw_scale));
+
+  for (size_t i = 0; i < missing_tiles.size(); ++i) {
+    int tx = missing_tiles[i].tx;
+    int ty = missing_tiles[i].ty;
+    if (AreChildTilesCached(level, tx, ty))
+      continue;  // Completely covered by its descendants.
+
+    QPointF tileTranslation(double(tx) * tiled_image_object_->tile_size().width,
+                            double(ty) * tiled_image_object_->tile_size().height);
+
+    // An ancestor levels_up levels coarser covers 2^levels_up x 2^levels_up tiles of this
+    // level, so we draw the sub-rectangle of it that corresponds to this tile.
+    int levels_up = 0;
+    int ancestor_layer = GetNearestCachedAncestorLayer(level, tx, ty, &levels_up);
+    if (ancestor_layer < 0) {
+      draw_tile_->AddTileAt(tileTranslation, -1);  // Placeholder.
+      continue;
+    }
+
+    int tiles_per_ancestor = 1 << levels_up;
+    float texcoords_scale = 1.0f / float(tiles_per_ancestor);
+    int tx_in_ancestor = tx - ((tx >> levels_up) << levels_up);
+    int ty_in_ancestor = ty - ((ty >> levels_up) << levels_up);
+    draw_tile_->UpdateTextureCoordsScale(QPointF(texcoords_scale, texcoords_scale));
+    draw_tile_->UpdateTextureCoordsShift(QPointF(float(tx_in_ancestor) * texcoords_scale,
+                                                 float(ty_in_ancestor) * texcoords_scale));
+    draw_tile_->AddTileAt(tileTranslation, ancestor_layer);
+  }
+
+  draw_tile_->UpdateTextureCoordsScale(QPointF(1.0f, 1.0f));
+  draw_tile_->UpdateTextureCoordsShift(QPointF(0.0f, 0.0f));
+}
+
+void TiledImageExplorer::DrawDescendantTilesGlobal(int level, int levels_down,
+                                                   const std::vector<PatchTile>& missing_tiles) {
+  const int descendant_level = level + levels_down;
+  if (descendant_level >= tiled_image_object_->num_levels())
+    return;
+
+  // Descendant tiles are drawn in their own level's coordinates, at their own scale.
+  double draw_scale = view_params_.draw_scale_for_level(descendant_level);
+  draw_tile_->SetGlobalTranslation(view_params_.view_offset);
+  draw_tile_->SetGlobalScaleFactor(QPointF(draw_scale, draw_scale));
+
+  Size2DInt tile_res = tiled_image_object_->tileres_for_level(descendant_level);
+  const int tiles_per_tile = 1 << levels_down;
+  for (size_t i = 0; i < missing_tiles.size(); ++i) {
+    int first_tx = missing_tiles[i].tx << levels_down;
+    int first_ty = missing_tiles[i].ty << levels_down;
+    int last_tx = qMin(first_tx + tiles_per_tile, tile_res.width) - 1;
+    int last_ty = qMin(first_ty + tiles_per_tile, tile_res.height) - 1;
+    for (int ty = first_ty; ty <= last_ty; ++ty) {
+      for (int tx = first_tx; tx <= last_tx; ++tx) {
+        // Only probe with Contains() so that the cache's hit/miss counts reflect visible tiles.
+        TileKey key = tiled_image_object_->GetTileKey(descendant_level, tx, ty);
+        if (texture_cache_->Contains(key)) {
+          QPointF tileTranslation(double(tx) * tiled_image_object_->tile_size().width,
+                                  double(ty) * tiled_image_object_->tile_size().height);
+          draw_tile_->AddTileAt(tileTranslation, texture_cache_->GetTextureLayer(key));
         }
+      }
     }
   }
 }
 
-void TiledImageExplorer::UpdateSingleTileGlobal(int level, int tx, int ty) {
-  
-  std::string tilename = tiled_image_object_->GetTileFilename(level, tx, ty);
-  texture_cache_->GetTexture(tilename);
+bool TiledImageExplorer::AreChildTilesCached(int level, int tx, int ty) {
+  const int child_level = level + 1;
+  if (child_level >= tiled_image_object_->num_levels())
+    return false;
+
+  Size2DInt tile_res = tiled_image_object_->tileres_for_level(child_level);
+  for (int cy = 2 * ty; cy <= qMin(2 * ty + 1, tile_res.height - 1); ++cy) {
+    for (int cx = 2 * tx; cx <= qMin(2 * tx + 1, tile_res.width - 1); ++cx) {
+      if (!texture_cache_->Contains(tiled_image_object_->GetTileKey(child_level, cx, cy)))
+        return false;
+    }
+  }
+  return true;
+}
+
+int TiledImageExplorer::GetNearestCachedAncestorLayer(int level, int tx, int ty,
+                                                      int* levels_up) {
+  for (int up = 1; up <= level; ++up) {
+    TileKey key = tiled_image_object_->GetTileKey(level - up, tx >> up, ty >> up);
+    if (texture_cache_->Contains(key)) {
+      *levels_up = up;
+      return texture_cache_->GetTextureLayer(key);
+    }
+  }
+  return -1;
+}
+
+void TiledImageExplorer::ScheduleTileRequests(bool tiles_uploaded) {
+  if (tiled_image_object_ == nullptr)
+    return;
+
+  InteractionHints hints;
+  hints.focus_pos = focus_on_cursor_ ? QPointF(cursor_focus_pos_) :
+    QPointF(float(width()) / 2.0f, float(height()) / 2.0f);
+  hints.pan_velocity = GetPanVelocity();
+  hints.zoom_direction = focus_on_cursor_ ? zoom_direction_ : 0;
+  hints.zoom_speed = GetZoomSpeed();
+  bool ranking_changed = tile_request_scheduler_.Update(view_params_, size(), hints);
+  // Tiles were requested for a coarser level because of the motion. Nothing repaints when the
+  // motion stops, so make sure the ranking gets rebuilt for the current level then.
+  if (tile_request_scheduler_.motion_lod_levels() > 0) {
+    motion_settled_timer_.start();
+  }
+  // If nothing changed, the queued requests are still complete and in the right order. New
+  // uploads may have evicted needed tiles from the cache though, so we re-check those.
+  if (!ranking_changed && !tiles_uploaded)
+    return;
+
+  const std::vector<TileRequest>& requests = tile_request_scheduler_.ranked_requests();
+  std::vector<TileLoadRequest> ranked_tiles;
+  ranked_tiles.reserve(requests.size());
+  for (size_t i = 0; i < requests.size(); ++i) {
+    ranked_tiles.push_back(TileLoadRequest(
+      tiled_image_object_->GetTileKey(requests[i].level, requests[i].tx, requests[i].ty),
+      tiled_image_object_));
+  }
+  texture_cache_->RequestTextures(ranked_tiles, tile_request_scheduler_.epoch());
+}
+
+void TiledImageExplorer::OnTilesLoaded() {
+  update();
+}
+
+void TiledImageExplorer::OnMotionSettled() {
+  update();
+}
+
+void TiledImageExplorer::OnFrameSwapped() {
+  if (flying_) {
+    update();
+  }
 }
 
 void TiledImageExplorer::ToggleDisplayTileDebugInfo() {
@@ -573,7 +1168,7 @@ void TiledImageExplorer::DrawPatchPointers() {
       continue; // Skip current level if specified.
     }
 
-    float level_draw_scale = pow(2.0f, view_params_.cur_level_exact - float(level));
+    double level_draw_scale = view_params_.draw_scale_for_level(level);
     draw_on_window_->SetGlobalScaleFactor(QPointF(level_draw_scale, level_draw_scale));
     draw_on_window_->SetGlobalTranslation(view_params_.view_offset);
 
@@ -596,19 +1191,22 @@ void TiledImageExplorer::PaintSinglePatchPointer(QPainter *painter, PatchCoords
     return;
 
   int level = int(patch_coords.level);
-  float level_draw_scale = pow(2.0f, view_params_.cur_level_exact - float(level));
-  QSize patch_display_size(int(float(focus_patch_params_.patch_size.width) * level_draw_scale),
-                           int(float(focus_patch_params_.patch_size.height) * level_draw_scale));
+  double level_draw_scale = view_params_.draw_scale_for_level(level);
+  QSize patch_display_size(int(double(focus_patch_params_.patch_size.width) * level_draw_scale),
+                           int(double(focus_patch_params_.patch_size.height) * level_draw_scale));
 
-  patch_coords.x = int((float(patch_coords.x) * level_draw_scale) + view_params_.view_offset.x());
-  patch_coords.y = int((float(patch_coords.y) * level_draw_scale) + view_params_.view_offset.y());
+  // Window position of the patch; the image position itself may not fit in an int.
+  QPoint window_pos(int(std::floor(double(patch_coords.x) * level_draw_scale +
+                                   view_params_.view_offset.x())),
+                    int(std::floor(double(patch_coords.y) * level_draw_scale +
+                                   view_params_.view_offset.y())));
 
   QPen pen = painter->pen();
   pen.setBrush(single_patch_color_);
   pen.setWidth(2);
   painter->setPen(pen);
-  painter->drawRect(patch_coords.x - (patch_display_size.width() / 2),
-                    patch_coords.y - (patch_display_size.height() / 2),
+  painter->drawRect(window_pos.x() - (patch_display_size.width() / 2),
+                    window_pos.y() - (patch_display_size.height() / 2),
                     patch_display_size.width(), patch_display_size.height());
 
   // Draw bigger rectangle
@@ -619,8 +1217,8 @@ void TiledImageExplorer::PaintSinglePatchPointer(QPainter *painter, PatchCoords
     pen.setBrush(single_patch_color_bigger_);
     pen.setWidth(2);
     painter->setPen(pen);
-    painter->drawRect(patch_coords.x - (patch_pointer_target_size_.width() / 2),
-                      patch_coords.y - (patch_pointer_target_size_.height() / 2),
+    painter->drawRect(window_pos.x() - (patch_pointer_target_size_.width() / 2),
+                      window_pos.y() - (patch_pointer_target_size_.height() / 2),
                       patch_pointer_target_size_.width(), patch_pointer_target_size_.height());
   }
 }
@@ -630,7 +1228,7 @@ void TiledImageExplorer::DrawSinglePatchPointer(PatchCoords patch_coords,
   if (draw_focus_patch_on_window_ == nullptr)
     return;
   int level = int(patch_coords.level);
-  float level_draw_scale = pow(2.0f, view_params_.cur_level_exact - float(level));
+  double level_draw_scale = view_params_.draw_scale_for_level(level);
   draw_focus_patch_on_window_->SetPatchPointSize(float(size.width()));  // TODO (ronell): make 2D.
   draw_focus_patch_on_window_->SetGlobalScaleFactor(QPointF(level_draw_scale, level_draw_scale));
   draw_focus_patch_on_window_->SetGlobalTranslation(view_params_.view_offset);
@@ -671,33 +1269,23 @@ void TiledImageExplorer::UpdateSelectionROIs() {
 }
 
 QPoint TiledImageExplorer::ConvertToImagePosInLevel(QPoint window_pos, int level) {
-  float level_draw_scale = pow(2.0f, view_params_.cur_level_exact - float(level));
+  double level_draw_scale = view_params_.draw_scale_for_level(level);
   QPoint image_pos;
-  image_pos.setX(int(((float(window_pos.x()) -
-    view_params_.view_offset.x()) / level_draw_scale) + 0.5f));
-  image_pos.setY(int(((float(window_pos.y()) -
-    view_params_.view_offset.y()) / level_draw_scale) + 0.5f));
+  image_pos.setX(int(((double(window_pos.x()) -
+    view_params_.view_offset.x()) / level_draw_scale) + 0.5));
+  image_pos.setY(int(((double(window_pos.y()) -
+    view_params_.view_offset.y()) / level_draw_scale) + 0.5));
   return image_pos;
 }
 
 QSize TiledImageExplorer::ConvertToImageSizeInLevel(QSize window_size, int level) {
-  float level_draw_scale = pow(2.0f, view_params_.cur_level_exact - float(level));
+  double level_draw_scale = view_params_.draw_scale_for_level(level);
   QSize image_size;
-  image_size.setWidth(int((float(window_size.width() / level_draw_scale) + 0.5f)));
-  image_size.setHeight(int((float(window_size.height() / level_draw_scale) + 0.5f)));
+  image_size.setWidth(int((double(window_size.width()) / level_draw_scale) + 0.5));
+  image_size.setHeight(int((double(window_size.height()) / level_draw_scale) + 0.5));
   return image_size;
 }
 
 std::shared_ptr<QImage> TiledImageExplorer::LoadTileJPG(const std::string& filename) {
   return std::make_shared<QImage>(QString(filename.c_str()));
 }
-
-QImage TiledImageExplorer::CreateCheckerboardPattern(QSize size) {
-  QImage pattern(size.width(), size.height(), QImage::Format_ARGB32);
-  QRgb color1 = qRgb(0, 0, 0);
-  QRgb color2 = qRgb(35, 35, 35);
-  for (int y = 0; y < size.height(); ++y)
-  for (int x = 0; x < size.width(); ++x)
-    pattern.setPixel(x, y, (((x >> 4) + (y >> 4)) & 1) ? color1 : color2);
-  return pattern;
-}
\ No newline at end of file
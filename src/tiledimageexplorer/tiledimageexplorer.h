@@ -1,9 +1,11 @@
 #ifndef GIGAPATCHEXPLORER_EXPLORER_TILEDIMAGEEXPLORER_H_
 #define GIGAPATCHEXPLORER_EXPLORER_TILEDIMAGEEXPLORER_H_
 
+#include <cmath>
 #include <memory>
 
 #include <QCoreApplication>
+#include <QElapsedTimer>
 #include <QEventLoop>
 #include <QOpenGLBuffer>
 #include <QOpenGLFunctions>
@@ -13,11 +15,14 @@
 #include <QPainter>
 #include <QRubberBand>
 #include <QTime>
+#include <QTimer>
 
 #include "drawing/drawonwindow.h"
 #include "drawing/drawtile.h"
 #include "drawing/texturecache.h"
+#include "tiledimageexplorer/flytopath.h"
 #include "tiledimageexplorer/tiledimagedata.h"
+#include "tiledimageexplorer/tilerequestscheduler.h"
 #include "imagesources/tiledimage.h"
 
 QT_FORWARD_DECLARE_CLASS(QOpenGLShaderProgram);
@@ -26,15 +31,21 @@ QT_FORWARD_DECLARE_CLASS(QOpenGLTexture)
 // Contains parameters for the viewing window and interactions (panning and zooming).
 // Encapsulates two resolution levels being viewed - current level, which is what we want to view,
 // and previous level, which is what we were looking at before.
+// Everything is in double precision: the offset of the finest levels of terapixel images is in
+// the millions of pixels, where floats cannot even represent whole pixels (above 2^24). Only
+// window relative positions are converted to float, when they are sent to the shaders.
 struct ViewParams {
 
   QPointF view_offset;    // Offset of upper left corner of image from window corner.
-  float cur_level_exact;  // Exact resolution level being viewed - valid range: [0, num_levels-1]
-  float cur_draw_scale;   // Scaling factor [0.5, 2.0] for current tiles.
+  double cur_level_exact; // Exact resolution level being viewed - valid range: [0, num_levels-1]
+  double cur_draw_scale;  // Scaling factor [0.5, 2.0] for current tiles.
   int prev_level;         // Resolution level of previous tiles.
-  float prev_draw_scale;  // Scaling factor [0.5, 2.0] for previous tiles.
-  int cur_level() {       // Current resolution level (round down exact current level).
-    return int(cur_level_exact + 0.5f);
+  int cur_level() const { // Current resolution level (round down exact current level).
+    return int(cur_level_exact + 0.5);
+  }
+  // Scaling factor for drawing tiles of the given level.
+  double draw_scale_for_level(int level) const {
+    return std::pow(2.0, cur_level_exact - double(level));
   }
 };
 
@@ -65,11 +76,14 @@ public:
   // Returns true when TiledImageObject is attached successfully.
   bool AttachTiledImageObject(std::shared_ptr<TiledImageObject> tiled_image_object);
   void SetClearColor(const QColor &color);
-  QOpenGLTexture* GetPlaceholderTexture() { return texture_placeholder_.get(); }
 
   // Do not change the names of the following window size related functions.
   QSize minimumSizeHint() const Q_DECL_OVERRIDE;
   QSize sizeHint() const Q_DECL_OVERRIDE;
+  // Number of tiles around the visible ones that are prefetched (more in the panning direction).
+  void SetPrefetchMargin(int num_tiles);
+  // Number of finer levels (0, 1 or 2) around the cursor that are prefetched when zooming in.
+  void SetZoomPrefetchDepth(int depth);
   void SetPatchCoordsToDraw(std::vector<PatchCoords>& patches_to_draw);
   void SetPatchPointersSize(int pointers_size);
   void SetLookaheadDepth(int depth);
@@ -93,13 +107,41 @@ public:
   }
   void ResetView();
   void TestMouse();
-  void ZoomToPosition(int level, int global_x, int global_y, 
-                      int num_steps = 20, int millisecs_delay_per_step = 50);
+  // Prints how many tiles were loaded, how much loading was saved by dropping obsolete ones, and
+  // how the texture cache is doing.
+  void PrintTileStats();
+  // Times the per-frame lookup of the visible tiles by filename (as the draw loop used to) and
+  // by tile key, and prints both.
+  void BenchmarkTileLoop();
+  // Switches the texture format of the tiles of the current image and remembers it for the
+  // image's directory.
+  void SetTextureFormat(TileTextureFormat format);
+  void CycleTextureFormat();
+  // Requests coarser tiles while the view pans or zooms fast (see TileRequestScheduler).
+  void SetMotionAdaptiveLod(bool enabled);
+  // Pans and zooms the view with a fixed script of synthetic input events (one per frame
+  // interval) and prints how many tiles were requested and decoded per second, so that loading
+  // policies can be compared under the same motion.
+  void RunScriptedInputBenchmark();
+  // Starts flying the view so that (global_x, global_y), in pixels of the given level, ends up in
+  // the window center at that level after duration_millisecs. Returns right away; the animation
+  // advances with each painted frame, and mouse or wheel input stops it. The tiles at the
+  // destination and along the way are requested as soon as the flight starts.
+  void ZoomToPosition(int level, int global_x, int global_y, int duration_millisecs = 1000);
+  void StopFlyTo();
+  bool IsFlying() { return flying_; }
   void UseTextureCache(QTextureCache* texture_cache) {
     if (texture_cache == nullptr)
       return;
 
+    if (texture_cache_ != nullptr) {
+      disconnect(texture_cache_->tile_loader(), &TileLoader::TilesLoaded,
+                 this, &TiledImageExplorer::OnTilesLoaded);
+    }
     texture_cache_ = texture_cache;
+    connect(texture_cache_->tile_loader(), &TileLoader::TilesLoaded,
+            this, &TiledImageExplorer::OnTilesLoaded);
+    PinCoarseLevels();
   }
   int GetCurrentSourceMaxResolutionLevel() {
     return tiled_image_object_->num_levels();
@@ -119,6 +161,13 @@ signals:
 
   public slots:
   void EmitSelectionSignal();
+  // Repaints so that newly decoded tiles get uploaded and drawn.
+  void OnTilesLoaded();
+  // Paces animations by the display: the next frame is scheduled when the last one was shown.
+  void OnFrameSwapped();
+  // Repaints once the view stopped moving, so that the tiles of the current level get requested.
+  void OnMotionSettled();
+  void OnScriptedInputTick();
 
 signals:
   void clicked();
@@ -134,21 +183,67 @@ protected:
   void mouseReleaseEvent(QMouseEvent *event) Q_DECL_OVERRIDE;
   void keyPressEvent(QKeyEvent *event) Q_DECL_OVERRIDE;
   void wheelEvent(QWheelEvent *event);
+  // Stop loading tiles while hidden, and rebuild the requests when shown again.
+  void hideEvent(QHideEvent *event) Q_DECL_OVERRIDE;
+  void showEvent(QShowEvent *event) Q_DECL_OVERRIDE;
   
 private:
+  // Input received since the last frame. Mouse and wheel events only add to it and schedule a
+  // repaint; paintGL() applies it as one view update, however many events arrived in between.
+  struct PendingInput {
+    PendingInput() : wheel_delta(0) {}
+    bool empty() { return pan_delta.isNull() && wheel_delta == 0; }
+
+    QPoint pan_delta;       // Sum of the drag deltas in window pixels.
+    int wheel_delta;        // Sum of the wheel deltas.
+    QPoint zoom_center;     // Cursor position of the last wheel event.
+  };
+
+  // Applies and clears pending_input_.
+  void ApplyPendingInput();
+  // Moves the view along the fly-to path according to the time since the flight started.
+  void AdvanceFlyTo();
+  CameraView GetCameraView();
+  void SetCameraView(const CameraView& camera_view);
   void AdjustGlobalTranslation(QPointF translation_delta);
   void AdjustSelectionTranslation(int dx, int dy);
+  // Updates the smoothed pan velocity from the latest mouse drag delta.
+  void UpdatePanVelocity(int dx, int dy);
+  // Pan velocity in window pixels per millisecond (zero if not panning).
+  QPointF GetPanVelocity();
+  // Updates the smoothed zoom speed from the level change of the latest wheel zoom.
+  void UpdateZoomSpeed(float level_delta);
+  // Zoom speed in levels per second (zero if not zooming).
+  float GetZoomSpeed();
   void AdjustGlobalZoom(int zoom_delta, QPoint zoom_center);
   void CleanupGL();
   // We initialize the view parameters so that the whole image fits into the window.
   void InitViewParams();
-  void UpdateViewParams(float level_delta, QPoint zoom_center);
+  void UpdateViewParams(double level_delta, QPoint zoom_center);
   bool InitTiledImageData();
   void RefreshTiledImageData();
   void DrawTiles();
   void DrawCurrentTilesGlobal();
-  void DrawPreviousTilesGlobal();
-  void UpdateSingleTileGlobal(int level, int tx, int ty);
+  // Draws stand-ins for missing visible tiles of the current level from cached tiles of other
+  // levels, so that no extra tiles need to be loaded.
+  void DrawFallbackTilesGlobal();
+  // Draws the matching part of each tile's nearest cached ancestor, or the placeholder if no
+  // ancestor is cached.
+  void DrawAncestorTilesGlobal(int level, const std::vector<PatchTile>& missing_tiles);
+  // Draws the cached tiles levels_down levels finer that cover each tile, downscaled.
+  void DrawDescendantTilesGlobal(int level, int levels_down,
+                                 const std::vector<PatchTile>& missing_tiles);
+  // True if all (up to four) children of the tile are cached.
+  bool AreChildTilesCached(int level, int tx, int ty);
+  // Returns the texture array layer of the finest cached ancestor of the tile (or -1 if there is
+  // none), and how many levels up it is.
+  int GetNearestCachedAncestorLayer(int level, int tx, int ty, int* levels_up);
+  // Pins the coarsest levels in the texture cache (see MAX_PINNED_TILES).
+  void PinCoarseLevels();
+  // Applies the texture format remembered for the current image (or the default format).
+  void LoadTextureFormatSetting();
+  // Requests missing tiles from the texture cache in the order ranked by the scheduler.
+  void ScheduleTileRequests(bool tiles_uploaded);
   void ToggleDisplayTileDebugInfo();
   void DrawPatchPointers();
   void AssignPatchPointersColors();
@@ -163,7 +258,6 @@ private:
   void PaintResolutionLevel(QPainter *painter);
 
   static std::shared_ptr<QImage> LoadTileJPG(const std::string& filename);
-  static QImage CreateCheckerboardPattern(QSize size);
 
   bool display_tile_debug_info_;
   bool display_patch_pointers_for_coarse_levels_;
@@ -180,14 +274,19 @@ private:
   QSize patch_pointer_target_size_;
   std::vector<QColor> patch_pointers_color_per_level_;
   QPoint last_mouse_pos_;
+  QPointF pan_velocity_;
+  QElapsedTimer pan_timer_;               // Time since the last drag event.
+  float zoom_speed_;
+  QElapsedTimer zoom_timer_;              // Time since the last wheel zoom.
+  QTimer motion_settled_timer_;
+  QTimer scripted_input_timer_;
+  QElapsedTimer scripted_input_clock_;
   std::shared_ptr<TiledImageObject> tiled_image_object_;
   ViewParams view_params_;
   std::shared_ptr<DrawOnWindow> draw_on_window_;
   std::shared_ptr<DrawOnWindow> draw_focus_patch_on_window_;
   std::shared_ptr<DrawTile> draw_tile_;
-  TiledImageData previous_tiles_;
   TiledImageData current_tiles;
-  std::shared_ptr<QOpenGLTexture> texture_placeholder_;
   Size2DInt extra_tiles_;                 // Extra tiles to load from each TiledImageData.
   QOpenGLFunctions *opengl_functions_ptr_; // Use this to call raw OpenGL functions.
   std::vector<PatchCoords> patches_to_draw_;
@@ -195,14 +294,21 @@ private:
 
   ImageSelection image_selection_;
   QTextureCache* texture_cache_;
+  TileRequestScheduler tile_request_scheduler_;
+  bool focus_on_cursor_;      // Rank tiles around cursor_focus_pos_ instead of the view center.
+  QPoint cursor_focus_pos_;
+  int zoom_direction_;        // Direction of the last wheel zoom (> 0 in) around the cursor.
   bool draw_current_level_;
+  PendingInput pending_input_;
+  long long frames_painted_;
+  long long input_events_;    // Mouse drag and wheel events merged into pending_input_.
+  long long view_updates_;    // Frames that applied pending input.
+  bool flying_;
+  FlyToPath fly_to_path_;
+  QElapsedTimer fly_to_timer_;
+  int fly_to_duration_millisecs_;
+  std::vector<ViewWaypoint> fly_to_waypoints_;   // Still ahead, the destination last.
+  std::vector<double> fly_to_waypoint_params_;   // Path parameter of each waypoint.
 };
 
-inline void QTDelay(int millisecondsToWait) {
-  QTime dieTime = QTime::currentTime().addMSecs(millisecondsToWait);
-  while (QTime::currentTime() < dieTime) {
-    QCoreApplication::processEvents(QEventLoop::AllEvents, 100);
-  }
-}
-
 #endif  // GIGAPATCHEXPLORER_EXPLORER_TILEDIMAGEEXPLORER_H_
@@ -0,0 +1,222 @@
+#include <cmath>
+
+#include "tiledimageexplorer/tilerequestscheduler.h"
+#include "tiledimageexplorer/tiledimageexplorer.h"
+
+// How far ahead (in time) we prefetch tiles in the direction of panning.
+const float kPanLookaheadMillisecs = 300.0f;
+// When zooming in, we prefetch a finer level once we are this close (in levels) to switching to
+// it. Levels switch at half levels (see ViewParams::cur_level()).
+const float kZoomPrefetchLevelDistance = 0.5f;
+// Panning faster than this (in window pixels per millisecond) requests tiles one level coarser;
+// every doubling of the speed adds another level, up to kMaxMotionLodLevels.
+const float kMotionLodPanSpeed = 1.5f;
+// Same for zooming, in levels per second.
+const float kMotionLodZoomSpeed = 2.0f;
+const int kMaxMotionLodLevels = 2;
+
+TileRequestScheduler::TileRequestScheduler()
+    : tiled_image_object_(nullptr),
+      prefetch_margin_(0, 0),
+      zoom_prefetch_depth_(1),
+      motion_adaptive_lod_(true),
+      motion_lod_levels_(0),
+      valid_(false),
+      epoch_(0),
+      cur_level_exact_(0.0) {}
+
+void TileRequestScheduler::SetTiledImageObject(
+    std::shared_ptr<TiledImageObject> tiled_image_object) {
+  tiled_image_object_ = tiled_image_object;
+  ranked_requests_.clear();
+  valid_ = false;
+}
+
+bool TileRequestScheduler::Update(const ViewParams& view_params, QSize view_size,
+                                  const InteractionHints& hints) {
+  if (tiled_image_object_ == nullptr || tiled_image_object_->num_levels() <= 0)
+    return false;
+
+  if (valid_ && view_offset_ == view_params.view_offset &&
+      cur_level_exact_ == view_params.cur_level_exact && view_size_ == view_size &&
+      hints_ == hints) {
+    return false;
+  }
+
+  view_offset_ = view_params.view_offset;
+  cur_level_exact_ = view_params.cur_level_exact;
+  view_size_ = view_size;
+  hints_ = hints;
+  valid_ = true;
+  epoch_++;
+
+  ViewParams view = view_params;
+  motion_lod_levels_ = qMin(view.cur_level(), MotionLodLevels(hints));
+  int level = view.cur_level() - motion_lod_levels_;
+  ranked_requests_.clear();
+  AddTilesInView(level, TileRequestClass_VISIBLE);
+  if (level > 0) {
+    AddTilesInView(level - 1, TileRequestClass_FALLBACK);
+  }
+  AddPanPrefetchTiles(level);
+  if (motion_lod_levels_ == 0) {
+    AddZoomPrefetchTiles(level);
+  }
+  AddFlightPathTiles();
+
+  std::sort(ranked_requests_.begin(), ranked_requests_.end(), TileRequestLessThan);
+  return true;
+}
+
+int TileRequestScheduler::MotionLodLevels(const InteractionHints& hints) {
+  if (!motion_adaptive_lod_)
+    return 0;
+
+  float pan_speed = std::sqrt(hints.pan_velocity.x() * hints.pan_velocity.x() +
+                              hints.pan_velocity.y() * hints.pan_velocity.y());
+  int pan_levels = 0;
+  if (pan_speed >= kMotionLodPanSpeed) {
+    pan_levels = 1 + int(std::log2(pan_speed / kMotionLodPanSpeed));
+  }
+  int zoom_levels = 0;
+  if (hints.zoom_speed >= kMotionLodZoomSpeed) {
+    zoom_levels = 1 + int(std::log2(hints.zoom_speed / kMotionLodZoomSpeed));
+  }
+  return qMin(kMaxMotionLodLevels, qMax(pan_levels, zoom_levels));
+}
+
+QRect TileRequestScheduler::GetTileRangeInView(int level, QPointF view_offset,
+                                               double level_exact) {
+  QSize tile_size = Size2DIntToQSize(tiled_image_object_->tile_size());
+  double draw_scale = std::pow(2.0, level_exact - double(level));
+  return TiledImageData::ComputeVisibleTileRange(
+    tile_size, Size2DIntToQSize(tiled_image_object_->tileres_for_level(level)), view_offset,
+    view_size_, QPointF(draw_scale, draw_scale));
+}
+
+float TileRequestScheduler::GetTileDistance(int level, int tx, int ty, QPointF view_offset,
+                                            double level_exact, QPointF pos) {
+  // The tile position is huge on fine levels, so only the distance is small enough for a float.
+  double draw_scale = std::pow(2.0, level_exact - double(level));
+  double center_x = view_offset.x() + (double(tx) + 0.5) *
+    double(tiled_image_object_->tile_size().width) * draw_scale;
+  double center_y = view_offset.y() + (double(ty) + 0.5) *
+    double(tiled_image_object_->tile_size().height) * draw_scale;
+  double dx = center_x - pos.x();
+  double dy = center_y - pos.y();
+  return float(std::sqrt(dx * dx + dy * dy));
+}
+
+void TileRequestScheduler::AddTilesInView(int level, TileRequestClass request_class) {
+  if (level < 0 || level >= tiled_image_object_->num_levels())
+    return;
+
+  QRect tile_range = GetTileRangeInView(level, view_offset_, cur_level_exact_);
+  for (int ty = tile_range.top(); ty <= tile_range.bottom(); ++ty) {
+    for (int tx = tile_range.left(); tx <= tile_range.right(); ++tx) {
+      ranked_requests_.push_back(TileRequest(level, tx, ty, request_class,
+                                             GetTileDistance(level, tx, ty, view_offset_,
+                                                             cur_level_exact_,
+                                                             hints_.focus_pos)));
+    }
+  }
+}
+
+void TileRequestScheduler::AddPanPrefetchTiles(int level) {
+  if (level < 0 || level >= tiled_image_object_->num_levels())
+    return;
+  if (prefetch_margin_.width <= 0 && prefetch_margin_.height <= 0 &&
+      hints_.pan_velocity.isNull())
+    return;
+
+  QRect visible_range = GetTileRangeInView(level, view_offset_, cur_level_exact_);
+  double draw_scale = std::pow(2.0, cur_level_exact_ - double(level));
+  double tile_width = double(tiled_image_object_->tile_size().width) * draw_scale;
+  double tile_height = double(tiled_image_object_->tile_size().height) * draw_scale;
+
+  // Number of tiles the view will move by during the lookahead time at the current velocity.
+  // Dragging to the right (positive velocity) brings tiles with smaller indices into view, so
+  // the ring grows on that side and shrinks on the trailing side.
+  QPointF shift = hints_.pan_velocity * kPanLookaheadMillisecs;
+  int lookahead_x = int(std::ceil(std::fabs(shift.x()) / tile_width));
+  int lookahead_y = int(std::ceil(std::fabs(shift.y()) / tile_height));
+  int left = prefetch_margin_.width + ((shift.x() > 0.0) ? lookahead_x : -lookahead_x);
+  int right = prefetch_margin_.width + ((shift.x() < 0.0) ? lookahead_x : -lookahead_x);
+  int top = prefetch_margin_.height + ((shift.y() > 0.0) ? lookahead_y : -lookahead_y);
+  int bottom = prefetch_margin_.height + ((shift.y() < 0.0) ? lookahead_y : -lookahead_y);
+
+  Size2DInt tile_res = tiled_image_object_->tileres_for_level(level);
+  int tx1 = qMax(0, visible_range.left() - qMax(0, left));
+  int tx2 = qMin(tile_res.width - 1, visible_range.right() + qMax(0, right));
+  int ty1 = qMax(0, visible_range.top() - qMax(0, top));
+  int ty2 = qMin(tile_res.height - 1, visible_range.bottom() + qMax(0, bottom));
+
+  // Rank by distance to where the focus point is heading.
+  QPointF predicted_focus_pos = hints_.focus_pos - shift;
+  for (int ty = ty1; ty <= ty2; ++ty) {
+    for (int tx = tx1; tx <= tx2; ++tx) {
+      if (visible_range.contains(tx, ty))
+        continue;
+      ranked_requests_.push_back(TileRequest(level, tx, ty, TileRequestClass_PREFETCH,
+                                             GetTileDistance(level, tx, ty, view_offset_,
+                                                             cur_level_exact_,
+                                                             predicted_focus_pos)));
+    }
+  }
+}
+
+void TileRequestScheduler::AddZoomPrefetchTiles(int level) {
+  if (hints_.zoom_direction <= 0)
+    return;
+
+  // Tiles of deeper levels are ranked behind all tiles of shallower ones.
+  float level_penalty = float(view_size_.width() + view_size_.height());
+  for (int depth = 1; depth <= zoom_prefetch_depth_; ++depth) {
+    int next_level = level + depth;
+    if (next_level >= tiled_image_object_->num_levels())
+      return;
+
+    // Zooming keeps the cursor fixed, so the view at the level switch is the current view
+    // scaled around the cursor.
+    double switch_level_exact = double(next_level) - 0.5;
+    double levels_to_switch = switch_level_exact - cur_level_exact_;
+    if (levels_to_switch > kZoomPrefetchLevelDistance + double(depth - 1))
+      return;
+
+    double scale = std::pow(2.0, levels_to_switch);
+    QPointF predicted_offset = hints_.focus_pos - (hints_.focus_pos - view_offset_) * scale;
+    QRect tile_range = GetTileRangeInView(next_level, predicted_offset, switch_level_exact);
+    for (int ty = tile_range.top(); ty <= tile_range.bottom(); ++ty) {
+      for (int tx = tile_range.left(); tx <= tile_range.right(); ++tx) {
+        float distance = GetTileDistance(next_level, tx, ty, predicted_offset,
+                                         switch_level_exact, hints_.focus_pos);
+        ranked_requests_.push_back(TileRequest(next_level, tx, ty, TileRequestClass_PREFETCH,
+                                               distance + float(depth - 1) * level_penalty));
+      }
+    }
+  }
+}
+
+void TileRequestScheduler::AddFlightPathTiles() {
+  if (flight_path_.empty())
+    return;
+
+  // The destination comes first, then the waypoints in the order they are passed. Within each
+  // view, tiles are ranked center-out.
+  float view_penalty = float(view_size_.width() + view_size_.height());
+  QPointF view_center(float(view_size_.width()) / 2.0f, float(view_size_.height()) / 2.0f);
+  for (size_t i = 0; i < flight_path_.size(); ++i) {
+    const ViewWaypoint& waypoint = (i == 0) ? flight_path_.back() : flight_path_[i - 1];
+    float rank_offset = float(i) * view_penalty;
+    int level = qBound(0, int(waypoint.level_exact + 0.5), tiled_image_object_->num_levels() - 1);
+    QRect tile_range = GetTileRangeInView(level, waypoint.view_offset, waypoint.level_exact);
+    for (int ty = tile_range.top(); ty <= tile_range.bottom(); ++ty) {
+      for (int tx = tile_range.left(); tx <= tile_range.right(); ++tx) {
+        float distance = GetTileDistance(level, tx, ty, waypoint.view_offset,
+                                         waypoint.level_exact, view_center);
+        ranked_requests_.push_back(TileRequest(level, tx, ty, TileRequestClass_FLIGHT,
+                                               distance + rank_offset));
+      }
+    }
+  }
+}
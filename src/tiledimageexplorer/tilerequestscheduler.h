@@ -0,0 +1,140 @@
+#ifndef GIGAPATCHEXPLORER_EXPLORER_TILEREQUESTSCHEDULER_H_
+#define GIGAPATCHEXPLORER_EXPLORER_TILEREQUESTSCHEDULER_H_
+
+#include <memory>
+#include <vector>
+
+#include <QPointF>
+#include <QRect>
+#include <QSize>
+
+#include "imagesources/tiledimage.h"
+
+struct ViewParams;
+
+// Request classes in decreasing order of importance.
+enum TileRequestClass {
+  TileRequestClass_VISIBLE,   // Visible tiles of the current level.
+  TileRequestClass_FALLBACK,  // Coarser tiles drawn in place of missing visible tiles.
+  TileRequestClass_FLIGHT,    // Tiles at the destination of a fly-to animation and along its path.
+  TileRequestClass_PREFETCH   // Tiles that are not visible yet but probably will be soon.
+};
+
+struct TileRequest {
+  int level;
+  int tx;
+  int ty;
+  TileRequestClass request_class;
+  float distance;  // Distance in window pixels from the tile center to the focus point.
+  TileRequest(int _level, int _tx, int _ty, TileRequestClass _request_class, float _distance)
+    : level(_level), tx(_tx), ty(_ty), request_class(_request_class), distance(_distance) {}
+};
+
+inline bool TileRequestLessThan(const TileRequest& lhs, const TileRequest& rhs) {
+  if (lhs.request_class != rhs.request_class)
+    return lhs.request_class < rhs.request_class;
+  return lhs.distance < rhs.distance;
+}
+
+// What the user is doing, used to predict which tiles will be needed next.
+struct InteractionHints {
+  QPointF focus_pos;     // Window position the user looks at (view center or zoom cursor).
+  QPointF pan_velocity;  // Pan velocity in window pixels per millisecond.
+  int zoom_direction;    // > 0 when zooming in (around focus_pos), < 0 zooming out, else 0.
+  float zoom_speed;      // Zoom speed in levels per second (zero if not zooming).
+  InteractionHints() : zoom_direction(0), zoom_speed(0.0f) {}
+
+  bool operator==(const InteractionHints& other) const {
+    return focus_pos == other.focus_pos && pan_velocity == other.pan_velocity &&
+      zoom_direction == other.zoom_direction && zoom_speed == other.zoom_speed;
+  }
+};
+
+// A view the camera will pass through (e.g. during a fly-to animation).
+struct ViewWaypoint {
+  QPointF view_offset;
+  double level_exact;
+  ViewWaypoint() : level_exact(0.0) {}
+  ViewWaypoint(QPointF _view_offset, double _level_exact)
+    : view_offset(_view_offset), level_exact(_level_exact) {}
+};
+
+// Ranks the tiles needed to display a view: visible tiles of the current level first, ordered
+// center-out from the focus point (view center or cursor), then coarser fallback tiles, then
+// prefetch candidates. The ranking only depends on the view, so it is rebuilt only when the view
+// changes; filtering out tiles that are already loaded is left to the caller. Each rebuild starts
+// a new epoch, which tags the requests made for it so that obsolete ones can be dropped.
+//
+// Prefetch candidates are a ring around the visible tiles that is widened in the panning
+// direction, and, when zooming in, the tiles of the next finer level(s) that will be visible
+// around the cursor once the level switches.
+//
+// While the view pans or zooms fast, the tiles of the current level would be obsolete a few
+// frames later, so the ranking is built for a coarser level instead (see MotionLodLevels()) and
+// the finer levels are not prefetched. The missing tiles of the current level are drawn from
+// those coarser tiles, and are requested once the motion stops and the ranking is rebuilt.
+//
+// During a fly-to animation, the tiles visible at the destination and at the waypoints still
+// ahead are ranked right behind the tiles of the current view, destination first, so that they
+// load while the camera is moving.
+class TileRequestScheduler {
+public:
+  TileRequestScheduler();
+
+  void SetTiledImageObject(std::shared_ptr<TiledImageObject> tiled_image_object);
+  // Number of extra tiles around the visible ones (in each direction) that are prefetched.
+  void SetPrefetchMargin(Size2DInt margin) { prefetch_margin_ = margin; valid_ = false; }
+  // Number of finer levels (0, 1 or 2) prefetched while zooming in.
+  void SetZoomPrefetchDepth(int depth) { zoom_prefetch_depth_ = depth; valid_ = false; }
+  // Enables requesting coarser levels while the view moves fast (on by default).
+  void SetMotionAdaptiveLod(bool enabled) { motion_adaptive_lod_ = enabled; valid_ = false; }
+  bool motion_adaptive_lod() { return motion_adaptive_lod_; }
+  // Number of levels below the current one the last ranking was built for (0 when not moving).
+  int motion_lod_levels() { return motion_lod_levels_; }
+  // Views the camera is going to pass through, in order, ending with the destination. Empty when
+  // not flying.
+  void SetFlightPath(const std::vector<ViewWaypoint>& waypoints) {
+    flight_path_ = waypoints;
+    valid_ = false;
+  }
+  // Rebuilds the ranking if the view, window size or interaction changed since the last call.
+  // Returns true if the ranking was rebuilt.
+  bool Update(const ViewParams& view_params, QSize view_size, const InteractionHints& hints);
+  // Forces a rebuild on the next Update().
+  void Invalidate() { valid_ = false; }
+  const std::vector<TileRequest>& ranked_requests() { return ranked_requests_; }
+  int epoch() { return epoch_; }
+
+private:
+  // Number of levels to go coarser for the given interaction.
+  int MotionLodLevels(const InteractionHints& hints);
+  // Range of tiles at the given level that are visible when viewing with offset/level_exact.
+  QRect GetTileRangeInView(int level, QPointF view_offset, double level_exact);
+  // Distance in window pixels between pos and the center of the tile in the given view.
+  float GetTileDistance(int level, int tx, int ty, QPointF view_offset, double level_exact,
+                        QPointF pos);
+  void AddTilesInView(int level, TileRequestClass request_class);
+  // Adds the prefetch ring around the visible tiles, widened in the direction of panning.
+  void AddPanPrefetchTiles(int level);
+  // Adds the tiles of finer levels that will be visible around the cursor when zooming in.
+  void AddZoomPrefetchTiles(int level);
+  // Adds the tiles visible at the waypoints of the flight path.
+  void AddFlightPathTiles();
+
+  std::shared_ptr<TiledImageObject> tiled_image_object_;
+  std::vector<TileRequest> ranked_requests_;
+  Size2DInt prefetch_margin_;
+  int zoom_prefetch_depth_;
+  std::vector<ViewWaypoint> flight_path_;
+  bool motion_adaptive_lod_;
+  int motion_lod_levels_;
+  bool valid_;
+  int epoch_;
+  // View the ranking was built for.
+  QPointF view_offset_;
+  double cur_level_exact_;
+  QSize view_size_;
+  InteractionHints hints_;
+};
+
+#endif  // GIGAPATCHEXPLORER_EXPLORER_TILEREQUESTSCHEDULER_H_